@@ -0,0 +1,86 @@
+// Compares the single pass announce query parser with the query filters it replaced.
+// Run with `cargo bench --bench http_query`.
+use std::hint::black_box;
+use std::net::{IpAddr, Ipv4Addr};
+use std::str::FromStr;
+use std::time::Instant;
+
+use serde::Deserialize;
+
+use torrust_tracker::{InfoHash, PeerId};
+use torrust_tracker::http::{AnnounceRequest, Bytes};
+
+const ITERATIONS: u32 = 1_000_000;
+const PEER_ADDR: IpAddr = IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1));
+const RAW_QUERY: &str = "info_hash=%3B%24U%04%CF%5F%11%BB%DB%E1%20%1C%EAjk%F4Z%EE%1B%C0&peer_id=-qB00000000000000001\
+    &port=17548&uploaded=0&downloaded=0&left=0&event=started&compact=1&numwant=50&key=abc";
+
+// The remaining fields, which the previous filters deserialized with warp's serde_urlencoded query filter
+#[allow(dead_code)]
+#[derive(Deserialize)]
+struct LegacyAnnounceQuery {
+    downloaded: Option<Bytes>,
+    uploaded: Option<Bytes>,
+    key: Option<String>,
+    port: u16,
+    left: Option<Bytes>,
+    event: Option<String>,
+    compact: Option<u8>,
+    numwant: Option<u32>,
+}
+
+// The info_hash and peer_id passes of the previous filters, each over the whole query string
+fn legacy_info_hashes(raw_query: &str) -> Vec<InfoHash> {
+    let split_raw_query: Vec<&str> = raw_query.split("&").collect();
+    let mut info_hashes: Vec<InfoHash> = Vec::new();
+
+    for v in split_raw_query {
+        if v.contains("info_hash") {
+            let raw_info_hash = v.split("=").collect::<Vec<&str>>()[1];
+            let info_hash_bytes = percent_encoding::percent_decode_str(raw_info_hash).collect::<Vec<u8>>();
+            if let Ok(ih) = InfoHash::from_str(&hex::encode(info_hash_bytes)) {
+                info_hashes.push(ih);
+            }
+        }
+    }
+
+    info_hashes
+}
+
+fn legacy_peer_id(raw_query: &str) -> Option<PeerId> {
+    let split_raw_query: Vec<&str> = raw_query.split("&").collect();
+
+    for v in split_raw_query {
+        if v.contains("peer_id") {
+            let raw_peer_id = v.split("=").collect::<Vec<&str>>()[1];
+            let peer_id_bytes = percent_encoding::percent_decode_str(raw_peer_id).collect::<Vec<u8>>();
+            if peer_id_bytes.len() != 20 { return None; }
+
+            let mut byte_arr: [u8; 20] = Default::default();
+            byte_arr.clone_from_slice(peer_id_bytes.as_slice());
+            return Some(PeerId(byte_arr));
+        }
+    }
+
+    None
+}
+
+fn bench<F: FnMut()>(name: &str, mut f: F) {
+    let start = Instant::now();
+    for _ in 0..ITERATIONS { f(); }
+    let elapsed = start.elapsed();
+
+    println!("{:<40} {:>8.1} ns/iter", name, elapsed.as_nanos() as f64 / ITERATIONS as f64);
+}
+
+fn main() {
+    bench("legacy query + info_hash + peer_id filters", || {
+        black_box(serde_urlencoded::from_str::<LegacyAnnounceQuery>(black_box(RAW_QUERY)).ok());
+        black_box(legacy_info_hashes(black_box(RAW_QUERY)));
+        black_box(legacy_peer_id(black_box(RAW_QUERY)));
+    });
+
+    bench("AnnounceRequest::from_query", || {
+        black_box(AnnounceRequest::from_query(black_box(RAW_QUERY), PEER_ADDR).ok());
+    });
+}
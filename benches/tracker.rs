@@ -0,0 +1,259 @@
+// Throughput of the in-process announce, cleanup and response writing paths.
+// Run with `cargo bench --bench tracker`.
+use std::collections::{BTreeMap, HashMap};
+use std::hint::black_box;
+use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+use std::sync::Arc;
+use std::time::Instant;
+
+use aquatic_udp_protocol::{AnnounceEvent, NumberOfBytes, NumberOfDownloads, NumberOfPeers, Response, ScrapeResponse, TorrentScrapeStatistics, TransactionId};
+
+use torrust_tracker::{Configuration, InfoHash, PeerId};
+use torrust_tracker::http::{CompactAnnounceResponse, ScrapeResponse as HttpScrapeResponse, ScrapeResponseEntry};
+use torrust_tracker::peer::TorrentPeer;
+use torrust_tracker::protocol::hashing::KeyHashMap;
+use torrust_tracker::protocol::utils::get_connection_id;
+use torrust_tracker::torrent::TorrentEntry;
+use torrust_tracker::tracker::announce_cache::AnnounceCachePolicy;
+use torrust_tracker::tracker::tracker::TorrentTracker;
+use torrust_tracker::udp::{handle_packet, MAX_PACKET_SIZE, write_response};
+
+const TORRENTS: u32 = 10_000;
+const PEERS_PER_TORRENT: u32 = 50;
+const ITERATIONS: u32 = 1_000_000;
+
+fn info_hash(torrent: u32) -> InfoHash {
+    // spread the torrents over the shards, like SHA-1 output would
+    let mut info_hash = [0u8; 20];
+    info_hash[..4].copy_from_slice(&torrent.wrapping_mul(0x9e37_79b9).to_be_bytes());
+    info_hash[4..8].copy_from_slice(&torrent.to_be_bytes());
+    InfoHash(info_hash)
+}
+
+fn peer(peer: u32) -> TorrentPeer {
+    let mut peer_id = [0u8; 20];
+    peer_id[..8].copy_from_slice(b"-BE0001-");
+    peer_id[16..].copy_from_slice(&peer.to_be_bytes());
+
+    TorrentPeer {
+        peer_id: PeerId(peer_id),
+        peer_addr: SocketAddr::new(IpAddr::V4(Ipv4Addr::from(0x0a00_0000 | peer)), 6881),
+        updated: Instant::now(),
+        uploaded: NumberOfBytes(0),
+        downloaded: NumberOfBytes(0),
+        left: NumberOfBytes(if peer % 2 == 0 { 0 } else { 1000 }),
+        event: AnnounceEvent::Started,
+    }
+}
+
+fn tracker() -> Arc<TorrentTracker> {
+    let mut config = Configuration::default();
+    config.db_path = std::env::temp_dir().join("torrust-tracker-bench.db").to_string_lossy().into_owned();
+
+    Arc::new(TorrentTracker::new(Arc::new(config)).expect("Could not create the tracker."))
+}
+
+// A tracker with TORRENTS torrents of PEERS_PER_TORRENT peers each
+async fn populated_tracker() -> Arc<TorrentTracker> {
+    let tracker = tracker();
+
+    for torrent in 0..TORRENTS {
+        for index in 0..PEERS_PER_TORRENT {
+            tracker.update_torrent_with_peer_and_get_stats(&info_hash(torrent), &peer(torrent * PEERS_PER_TORRENT + index)).await;
+        }
+    }
+
+    tracker
+}
+
+fn report(name: &str, iterations: u32, start: Instant) {
+    let elapsed = start.elapsed();
+    println!("{:<50} {:>10.1} ns/iter", name, elapsed.as_nanos() as f64 / iterations as f64);
+}
+
+fn bench<F: FnMut(u32)>(name: &str, iterations: u32, mut f: F) {
+    let start = Instant::now();
+    for iteration in 0..iterations { f(iteration); }
+    report(name, iterations, start);
+}
+
+async fn bench_tracker() {
+    let tracker = populated_tracker().await;
+    let peers = TORRENTS * PEERS_PER_TORRENT;
+
+    let start = Instant::now();
+    for iteration in 0..ITERATIONS {
+        let peer_index = iteration.wrapping_mul(7919) % peers;
+        black_box(tracker.update_torrent_with_peer_and_get_stats(&info_hash(peer_index / PEERS_PER_TORRENT), &peer(peer_index)).await);
+    }
+    report("update_torrent_with_peer_and_get_stats", ITERATIONS, start);
+
+    let mut compact_peers: Vec<u8> = Vec::with_capacity(74 * 6);
+    let start = Instant::now();
+    for iteration in 0..ITERATIONS {
+        let peer_index = iteration.wrapping_mul(7919) % peers;
+        compact_peers.clear();
+        black_box(tracker.update_torrent_with_peer_and_get_peers(&info_hash(peer_index / PEERS_PER_TORRENT), &peer(peer_index), Some(74), |_peer_id, compact_addr| {
+            compact_peers.extend_from_slice(compact_addr);
+        }).await);
+    }
+    report("update_torrent_with_peer_and_get_peers (74)", ITERATIONS, start);
+
+    let scrape: Vec<InfoHash> = (0..74).map(info_hash).collect();
+    let scrapes = ITERATIONS / 100;
+    let start = Instant::now();
+    for _ in 0..scrapes {
+        black_box(tracker.scrape_torrents(&scrape, &None).await);
+    }
+    report("scrape_torrents (74 torrents)", scrapes, start);
+
+    // every peer is still active, so this is the cost of visiting the whole swarm
+    let cleanups = 10;
+    let start = Instant::now();
+    for _ in 0..cleanups { tracker.cleanup_torrents().await; }
+    report(&format!("cleanup_torrents ({} torrents)", TORRENTS), cleanups, start);
+
+    let remote_addr = SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 6881);
+    let connection_id = get_connection_id(&remote_addr);
+    let mut response_buffer = [0u8; MAX_PACKET_SIZE];
+
+    let start = Instant::now();
+    for iteration in 0..ITERATIONS {
+        let peer_index = iteration.wrapping_mul(7919) % peers;
+        let packet = udp_announce(connection_id.0, &info_hash(peer_index / PEERS_PER_TORRENT), &peer(peer_index).peer_id);
+        black_box(handle_packet(remote_addr, &packet, tracker.clone(), &mut response_buffer).await.ok());
+    }
+    report("udp handle_packet (announce)", ITERATIONS, start);
+}
+
+// BEP 15 announce request
+fn udp_announce(connection_id: i64, info_hash: &InfoHash, peer_id: &PeerId) -> Vec<u8> {
+    let mut packet = Vec::with_capacity(98);
+    packet.extend_from_slice(&connection_id.to_be_bytes());
+    packet.extend_from_slice(&1i32.to_be_bytes());
+    packet.extend_from_slice(&0i32.to_be_bytes());
+    packet.extend_from_slice(&info_hash.0);
+    packet.extend_from_slice(&peer_id.0);
+    packet.extend_from_slice(&[0u8; 24]);
+    packet.extend_from_slice(&0i32.to_be_bytes());
+    packet.extend_from_slice(&[0u8; 8]);
+    packet.extend_from_slice(&74i32.to_be_bytes());
+    packet.extend_from_slice(&6881u16.to_be_bytes());
+    packet
+}
+
+fn bench_torrent_entry() {
+    let mut torrent_entry = TorrentEntry::new();
+    for index in 0..1000 { torrent_entry.update_peer(&peer(index)); }
+
+    bench("TorrentEntry::get_peers (74 of 1000)", ITERATIONS, |_| {
+        black_box(torrent_entry.get_peers(74));
+    });
+
+    let client_addr = SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 6881);
+    let mut compact_peers: Vec<u8> = Vec::with_capacity(74 * 6);
+
+    bench("TorrentEntry::sample_peers (74 of 1000)", ITERATIONS, |_| {
+        compact_peers.clear();
+        torrent_entry.sample_peers(&client_addr, 74, |_peer_id, compact_addr| compact_peers.extend_from_slice(compact_addr));
+        black_box(&compact_peers);
+    });
+
+    // A hot swarm sampled through its peer list, and copied out of its cached compact peer string
+    let mut hot_torrent_entry = TorrentEntry::new();
+    for index in 0..100_000 { hot_torrent_entry.update_peer(&peer(index)); }
+
+    bench("TorrentEntry::sample_peers (74 of 100000)", ITERATIONS, |_| {
+        compact_peers.clear();
+        hot_torrent_entry.sample_peers(&client_addr, 74, |_peer_id, compact_addr| compact_peers.extend_from_slice(compact_addr));
+        black_box(&compact_peers);
+    });
+
+    let policy = AnnounceCachePolicy { min_peers: 1000, cached_peers: 4 * 74, ttl: u32::MAX, max_mutations: u32::MAX };
+
+    bench("TorrentEntry::sample_compact_peers_cached (74 of 100000)", ITERATIONS, |_| {
+        compact_peers.clear();
+        hot_torrent_entry.sample_compact_peers_cached(&client_addr, 74, &policy, |compact_addrs| compact_peers.extend_from_slice(compact_addrs));
+        black_box(&compact_peers);
+    });
+}
+
+// The peer index of a 1000 peer swarm and a 10k torrent lookup, with SipHash, the key hasher and a BTreeMap
+fn bench_key_maps() {
+    let peer_ids: Vec<PeerId> = (0..1000).map(|index| peer(index).peer_id).collect();
+    let info_hashes: Vec<InfoHash> = (0..TORRENTS).map(info_hash).collect();
+    let builds = ITERATIONS / 1000;
+
+    bench("HashMap<PeerId> insert (SipHash, 1000 peers)", builds, |_| {
+        let mut index: HashMap<PeerId, u32> = HashMap::new();
+        for (position, peer_id) in peer_ids.iter().enumerate() { index.insert(peer_id.clone(), position as u32); }
+        black_box(index);
+    });
+
+    bench("KeyHashMap<PeerId> insert (1000 peers)", builds, |_| {
+        let mut index: KeyHashMap<PeerId, u32> = KeyHashMap::default();
+        for (position, peer_id) in peer_ids.iter().enumerate() { index.insert(peer_id.clone(), position as u32); }
+        black_box(index);
+    });
+
+    let sip_index: HashMap<PeerId, u32> = peer_ids.iter().cloned().zip(0..).collect();
+    let key_index: KeyHashMap<PeerId, u32> = peer_ids.iter().cloned().zip(0..).collect();
+
+    bench("HashMap<PeerId> get (SipHash)", ITERATIONS, |iteration| {
+        black_box(sip_index.get(&peer_ids[(iteration.wrapping_mul(7919) % 1000) as usize]));
+    });
+
+    bench("KeyHashMap<PeerId> get", ITERATIONS, |iteration| {
+        black_box(key_index.get(&peer_ids[(iteration.wrapping_mul(7919) % 1000) as usize]));
+    });
+
+    let btree_torrents: BTreeMap<InfoHash, u32> = info_hashes.iter().copied().zip(0..).collect();
+    let key_torrents: KeyHashMap<InfoHash, u32> = info_hashes.iter().copied().zip(0..).collect();
+
+    bench(&format!("BTreeMap<InfoHash> get ({} torrents)", TORRENTS), ITERATIONS, |iteration| {
+        black_box(btree_torrents.get(&info_hashes[(iteration.wrapping_mul(7919) % TORRENTS) as usize]));
+    });
+
+    bench(&format!("KeyHashMap<InfoHash> get ({} torrents)", TORRENTS), ITERATIONS, |iteration| {
+        black_box(key_torrents.get(&info_hashes[(iteration.wrapping_mul(7919) % TORRENTS) as usize]));
+    });
+}
+
+fn bench_response_writers() {
+    bench("http CompactAnnounceResponse (74 peers)", ITERATIONS, |_| {
+        let mut announce_response = CompactAnnounceResponse::new(false, 74 * 6);
+        for _ in 0..74 { announce_response.write_peer(&[1u8; 6]); }
+        black_box(announce_response.finish(120, 120, 1000, 1000).ok());
+    });
+
+    let mut files: Vec<_> = (0..10).map(|torrent| (info_hash(torrent), ScrapeResponseEntry { complete: 1000, downloaded: 1000, incomplete: 1000 })).collect();
+    files.sort_unstable_by(|(a, _), (b, _)| a.cmp(b));
+    let scrape_response = HttpScrapeResponse { files };
+
+    bench("http ScrapeResponse::write (10 torrents)", ITERATIONS, |_| {
+        black_box(scrape_response.write().ok());
+    });
+
+    let scrape_response = Response::from(ScrapeResponse {
+        transaction_id: TransactionId(0),
+        torrent_stats: (0..10).map(|_| TorrentScrapeStatistics {
+            seeders: NumberOfPeers(1000),
+            completed: NumberOfDownloads(1000),
+            leechers: NumberOfPeers(1000),
+        }).collect(),
+    });
+    let mut response_buffer = [0u8; MAX_PACKET_SIZE];
+
+    bench("udp write_response (scrape, 10 torrents)", ITERATIONS, |_| {
+        black_box(write_response(&scrape_response, &mut response_buffer).ok());
+    });
+}
+
+fn main() {
+    bench_torrent_entry();
+    bench_key_maps();
+    bench_response_writers();
+
+    let runtime = tokio::runtime::Runtime::new().expect("Could not start the tokio runtime.");
+    runtime.block_on(bench_tracker());
+}
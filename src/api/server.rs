@@ -1,17 +1,34 @@
 use std::cmp::min;
 use std::collections::{HashMap, HashSet};
 use std::net::SocketAddr;
+use std::ops::Bound;
+use std::pin::Pin;
+use std::str::FromStr;
 use std::sync::Arc;
 
+use futures::{Stream, StreamExt};
 use serde::{Deserialize, Serialize};
 use warp::{Filter, filters, reply, serve};
+use warp::hyper::body::Buf;
 
 use crate::protocol::common::*;
 use crate::peer::TorrentPeer;
+use crate::tracker::key::AuthKey;
 use crate::tracker::tracker::TorrentTracker;
 
+// Torrents listed per shard lock acquisition, each batch is sent as one chunk of the response
+const TORRENT_LIST_CHUNK_SIZE: usize = 1000;
+const MAX_TORRENT_LIST_LIMIT: u32 = 4000;
+// longest line accepted by the bulk imports, an info hash or a key and its expiry are far shorter
+const MAX_IMPORT_LINE_LENGTH: usize = 256;
+// entries of a bulk import parsed before they are written
+const IMPORT_CHUNK_ENTRIES: usize = 100_000;
+// a whitelist loaded from a file is changed by editing the file, API changes would be lost on the next reload
+const WHITELIST_FILE_IN_USE: &str = "whitelist is loaded from whitelist_path, change the file and reload";
+
 #[derive(Deserialize, Debug)]
 struct TorrentInfoQuery {
+    after: Option<InfoHash>,
     offset: Option<u32>,
     limit: Option<u32>,
 }
@@ -23,7 +40,106 @@ struct Torrent<'a> {
     completed: u32,
     leechers: u32,
     #[serde(skip_serializing_if = "Option::is_none")]
-    peers: Option<Vec<&'a TorrentPeer>>,
+    peers: Option<Vec<TorrentPeer>>,
+}
+
+#[derive(Serialize)]
+struct ListedTorrent {
+    info_hash: InfoHash,
+    seeders: u32,
+    completed: u32,
+    leechers: u32,
+}
+
+// Walks the shards in order and serializes the listed torrents as a JSON array, one chunk at a time.
+// Shards are in info hash order, so the cursor seeks straight to its shard and position
+// and every hash in later shards sorts after it.
+struct TorrentListing {
+    tracker: Arc<TorrentTracker>,
+    shard: usize,
+    after: Option<InfoHash>,
+    skip: usize,
+    remaining: usize,
+    listed: usize,
+    finished: bool,
+}
+
+impl TorrentListing {
+    fn new(tracker: Arc<TorrentTracker>, after: Option<InfoHash>, skip: usize, remaining: usize) -> TorrentListing {
+        let shard = after.map(|info_hash| tracker.get_torrents().shard_index(&info_hash)).unwrap_or(0);
+
+        TorrentListing {
+            tracker,
+            shard,
+            after,
+            skip,
+            remaining,
+            listed: 0,
+            finished: false,
+        }
+    }
+
+    async fn next_chunk(&mut self) -> Option<Vec<u8>> {
+        if self.finished { return None; }
+
+        let torrents = self.tracker.get_torrents();
+        let mut chunk: Vec<u8> = Vec::new();
+
+        if self.listed == 0 { chunk.push(b'['); }
+
+        while self.remaining > 0 && self.shard < torrents.shard_count() {
+            let db = torrents.read_shard(self.shard).await;
+
+            // skip whole shards without visiting their entries
+            if self.after.is_none() && self.skip >= db.len() {
+                self.skip -= db.len();
+                self.shard += 1;
+                continue;
+            }
+
+            let lower_bound = match self.after {
+                Some(info_hash) => Bound::Excluded(info_hash),
+                None => Bound::Unbounded
+            };
+
+            let batch_size = min(self.remaining, TORRENT_LIST_CHUNK_SIZE);
+            let mut batch_listed = 0;
+            let mut entries = db.range((lower_bound, Bound::Unbounded));
+
+            // an offset past the end of this shard carries on into the next ones
+            while self.skip > 0 && entries.next().is_some() { self.skip -= 1; }
+
+            for (info_hash, torrent_entry) in entries.take(batch_size) {
+                let (seeders, completed, leechers) = torrent_entry.get_stats();
+
+                if self.listed > 0 { chunk.push(b','); }
+                let _ = serde_json::to_writer(&mut chunk, &ListedTorrent {
+                    info_hash: *info_hash,
+                    seeders,
+                    completed,
+                    leechers,
+                });
+
+                self.after = Some(*info_hash);
+                self.listed += 1;
+                batch_listed += 1;
+            }
+
+            self.remaining -= batch_listed;
+
+            // the rest of this shard comes in the next chunk
+            if batch_listed == batch_size && self.remaining > 0 { return Some(chunk); }
+
+            // every torrent in the later shards sorts after the cursor
+            self.shard += 1;
+            self.after = None;
+        }
+
+        self.finished = true;
+        chunk.push(b']');
+
+        Some(chunk)
+    }
 }
 
 #[derive(Serialize)]
@@ -84,9 +200,114 @@ fn authenticate(tokens: HashMap<String, String>) -> impl Filter<Extract=(), Erro
         .untuple_one()
 }
 
+// Reads a bulk import body of one entry per line as its chunks arrive, blank lines are skipped.
+// Entries are handed out `IMPORT_CHUNK_ENTRIES` at a time and written while the rest of the body is
+// still coming in, so an import never sits in memory whole. The first line that does not parse ends
+// the import, the entries before it are imported.
+struct ImportReader<S, F> {
+    body: Pin<Box<S>>,
+    parse: F,
+    // the body read but not parsed yet, from `start` on
+    pending: Vec<u8>,
+    start: usize,
+    line_number: usize,
+    finished: bool,
+}
+
+impl<S, B, T, F> ImportReader<S, F>
+    where S: Stream<Item=Result<B, warp::Error>>,
+          B: Buf,
+          F: Fn(&str) -> Option<T>
+{
+    fn new(body: S, parse: F) -> ImportReader<S, F> {
+        ImportReader {
+            body: Box::pin(body),
+            parse,
+            pending: Vec::new(),
+            start: 0,
+            line_number: 0,
+            finished: false,
+        }
+    }
+
+    // The next entries, None once the whole body is read
+    async fn next_entries(&mut self) -> Result<Option<Vec<T>>, String> {
+        let mut entries = Vec::new();
+
+        while !self.finished {
+            while let Some(end) = self.pending[self.start..].iter().position(|&byte| byte == b'\n') {
+                self.line_number += 1;
+                parse_import_line(&self.pending[self.start..self.start + end], self.line_number, &self.parse, &mut entries)?;
+                self.start += end + 1;
+
+                if entries.len() == IMPORT_CHUNK_ENTRIES { return Ok(Some(entries)); }
+            }
+
+            self.pending.drain(..self.start);
+            self.start = 0;
+
+            if self.pending.len() > MAX_IMPORT_LINE_LENGTH {
+                return Err(format!("line {} is too long", self.line_number + 1));
+            }
+
+            match self.body.next().await {
+                Some(chunk) => {
+                    let mut chunk = chunk.map_err(|_| "could not read request body".to_string())?;
+
+                    while chunk.has_remaining() {
+                        let bytes = chunk.chunk();
+                        let length = bytes.len();
+                        self.pending.extend_from_slice(bytes);
+                        chunk.advance(length);
+                    }
+                }
+                None => {
+                    self.finished = true;
+                    parse_import_line(&self.pending, self.line_number + 1, &self.parse, &mut entries)?;
+                }
+            }
+        }
+
+        Ok(if entries.is_empty() { None } else { Some(entries) })
+    }
+}
+
+fn parse_import_line<T, F>(line: &[u8], line_number: usize, parse: &F, entries: &mut Vec<T>) -> Result<(), String>
+    where F: Fn(&str) -> Option<T>
+{
+    let line = match std::str::from_utf8(line) {
+        Ok(line) => line.trim(),
+        Err(_) => return Err(format!("invalid entry on line {}", line_number))
+    };
+
+    if line.is_empty() { return Ok(()); }
+
+    match parse(line) {
+        Some(entry) => {
+            entries.push(entry);
+            Ok(())
+        }
+        None => Err(format!("invalid entry on line {}", line_number))
+    }
+}
+
+// A key to import: the key and the unix time it is valid until, separated by whitespace
+fn parse_auth_key(line: &str) -> Option<AuthKey> {
+    let mut fields = line.split_whitespace();
+    let key = AuthKey::from_string(fields.next()?)?;
+    let valid_until = fields.next()?.parse::<u64>().ok()?;
+
+    if fields.next().is_some() { return None; }
+
+    Some(AuthKey {
+        valid_until: Some(valid_until),
+        ..key
+    })
+}
+
 pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp::Future<Output = ()> {
-    // GET /api/torrents?offset=:u32&limit=:u32
-    // View torrent list
+    // GET /api/torrents?after=:info_hash&limit=:u32 (or, slower, ?offset=:u32&limit=:u32)
+    // View torrent list, in info hash order. Pass the last info hash of a page as `after` to get the next one.
     let api_torrents = tracker.clone();
     let view_torrent_list = filters::method::get()
         .and(filters::path::path("torrents"))
@@ -98,27 +319,19 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
         })
         .and_then(|(limits, tracker): (TorrentInfoQuery, Arc<TorrentTracker>)| {
             async move {
-                let offset = limits.offset.unwrap_or(0);
-                let limit = min(limits.limit.unwrap_or(1000), 4000);
-
-                let db = tracker.get_torrents().await;
-                let results: Vec<_> = db
-                    .iter()
-                    .map(|(info_hash, torrent_entry)| {
-                        let (seeders, completed, leechers) = torrent_entry.get_stats();
-                        Torrent {
-                            info_hash,
-                            seeders,
-                            completed,
-                            leechers,
-                            peers: None,
-                        }
-                    })
-                    .skip(offset as usize)
-                    .take(limit as usize)
-                    .collect();
+                let limit = min(limits.limit.unwrap_or(1000), MAX_TORRENT_LIST_LIMIT);
+                let listing = TorrentListing::new(tracker, limits.after, limits.offset.unwrap_or(0) as usize, limit as usize);
 
-                Result::<_, warp::reject::Rejection>::Ok(reply::json(&results))
+                let body = futures::stream::unfold(listing, |mut listing| async move {
+                    listing.next_chunk().await.map(|chunk| (Ok::<_, std::convert::Infallible>(chunk), listing))
+                });
+
+                let response = warp::http::Response::builder()
+                    .header("content-type", "application/json")
+                    .body(warp::hyper::Body::wrap_stream(body))
+                    .unwrap();
+
+                Result::<_, warp::reject::Rejection>::Ok(response)
             }
         });
 
@@ -153,20 +366,14 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
                     udp6_scrapes_handled: 0,
                 };
 
-                let db = tracker.get_torrents().await;
+                let swarm_stats = tracker.get_swarm_stats();
 
-                let _: Vec<_> = db
-                    .iter()
-                    .map(|(_info_hash, torrent_entry)| {
-                        let (seeders, completed, leechers) = torrent_entry.get_stats();
-                        results.seeders += seeders;
-                        results.completed += completed;
-                        results.leechers += leechers;
-                        results.torrents += 1;
-                    })
-                    .collect();
+                results.torrents = swarm_stats.torrents as u32;
+                results.seeders = swarm_stats.seeders as u32;
+                results.completed = swarm_stats.completed as u32;
+                results.leechers = swarm_stats.leechers as u32;
 
-                let stats = tracker.get_stats().await;
+                let stats = tracker.get_stats();
 
                 results.tcp4_connections_handled = stats.tcp4_connections_handled as u32;
                 results.tcp4_announces_handled = stats.tcp4_announces_handled as u32;
@@ -198,7 +405,7 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
         })
         .and_then(|(info_hash, tracker): (InfoHash, Arc<TorrentTracker>)| {
             async move {
-                let db = tracker.get_torrents().await;
+                let db = tracker.get_torrents().get_shard(&info_hash).await;
                 let torrent_entry_option = db.get(&info_hash);
 
                 if torrent_entry_option.is_none() {
@@ -208,7 +415,7 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
                 let torrent_entry = torrent_entry_option.unwrap();
                 let (seeders, completed, leechers) = torrent_entry.get_stats();
 
-                let peers = torrent_entry.get_peers(None);
+                let peers = torrent_entry.get_peers(MAX_SCRAPE_TORRENTS as usize);
 
                 Ok(reply::json(&Torrent {
                     info_hash: &info_hash,
@@ -233,6 +440,10 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
         })
         .and_then(|(info_hash, tracker): (InfoHash, Arc<TorrentTracker>)| {
             async move {
+                if tracker.config.get_whitelist_path().is_some() {
+                    return Err(warp::reject::custom(ActionStatus::Err { reason: WHITELIST_FILE_IN_USE.into() }));
+                }
+
                 match tracker.remove_torrent_from_whitelist(&info_hash).await {
                     Ok(_) => Ok(warp::reply::json(&ActionStatus::Ok)),
                     Err(_) => Err(warp::reject::custom(ActionStatus::Err { reason: "failed to remove torrent from whitelist".into() }))
@@ -253,6 +464,10 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
         })
         .and_then(|(info_hash, tracker): (InfoHash, Arc<TorrentTracker>)| {
             async move {
+                if tracker.config.get_whitelist_path().is_some() {
+                    return Err(warp::reject::custom(ActionStatus::Err { reason: WHITELIST_FILE_IN_USE.into() }));
+                }
+
                 match tracker.add_torrent_to_whitelist(&info_hash).await {
                     Ok(..) => Ok(warp::reply::json(&ActionStatus::Ok)),
                     Err(..) => Err(warp::reject::custom(ActionStatus::Err { reason: "failed to whitelist torrent".into() }))
@@ -260,6 +475,33 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
             }
         });
 
+    // POST /api/whitelist
+    // Whitelist the info hashes in the request body, one per line
+    let t10 = tracker.clone();
+    let import_whitelist = filters::method::post()
+        .and(filters::path::path("whitelist"))
+        .and(filters::path::end())
+        .and(filters::body::stream())
+        .and_then(move |body| {
+            let tracker = t10.clone();
+            async move {
+                if tracker.config.get_whitelist_path().is_some() {
+                    return Err(warp::reject::custom(ActionStatus::Err { reason: WHITELIST_FILE_IN_USE.into() }));
+                }
+
+                let mut import = ImportReader::new(body, |line: &str| InfoHash::from_str(line).ok());
+
+                while let Some(info_hashes) = import.next_entries().await
+                    .map_err(|reason| warp::reject::custom(ActionStatus::Err { reason: reason.into() }))? {
+                    if tracker.add_torrents_to_whitelist(&info_hashes).await.is_err() {
+                        return Err(warp::reject::custom(ActionStatus::Err { reason: "failed to whitelist torrents".into() }));
+                    }
+                }
+
+                Ok(warp::reply::json(&ActionStatus::Ok))
+            }
+        });
+
     // POST /api/key/:seconds_valid
     // Generate new key
     let t5 = tracker.clone();
@@ -300,6 +542,29 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
             }
         });
 
+    // POST /api/keys
+    // Add the keys in the request body, one `<key> <valid_until>` per line
+    let t11 = tracker.clone();
+    let import_keys = filters::method::post()
+        .and(filters::path::path("keys"))
+        .and(filters::path::end())
+        .and(filters::body::stream())
+        .and_then(move |body| {
+            let tracker = t11.clone();
+            async move {
+                let mut import = ImportReader::new(body, parse_auth_key);
+
+                while let Some(auth_keys) = import.next_entries().await
+                    .map_err(|reason| warp::reject::custom(ActionStatus::Err { reason: reason.into() }))? {
+                    if tracker.add_auth_keys(&auth_keys).await.is_err() {
+                        return Err(warp::reject::custom(ActionStatus::Err { reason: "failed to add keys".into() }));
+                    }
+                }
+
+                Ok(warp::reply::json(&ActionStatus::Ok))
+            }
+        });
+
     // GET /api/whitelist/reload
     // Reload whitelist
     let t7 = tracker.clone();
@@ -313,9 +578,14 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
         })
         .and_then(|tracker: Arc<TorrentTracker>| {
             async move {
-                match tracker.load_whitelist().await {
-                    Ok(_) => Ok(warp::reply::json(&ActionStatus::Ok)),
-                    Err(_) => Err(warp::reject::custom(ActionStatus::Err { reason: "failed to reload whitelist".into() }))
+                let reloaded = match tracker.config.get_whitelist_path() {
+                    Some(path) => tracker.load_whitelist_file(path).await.is_ok(),
+                    None => tracker.load_whitelist().await.is_ok()
+                };
+
+                match reloaded {
+                    true => Ok(warp::reply::json(&ActionStatus::Ok)),
+                    false => Err(warp::reject::custom(ActionStatus::Err { reason: "failed to reload whitelist".into() }))
                 }
             }
         });
@@ -340,6 +610,21 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
             }
         });
 
+    // GET /metrics
+    // Prometheus metrics
+    let t9 = tracker.clone();
+    let view_metrics = filters::method::get()
+        .and(filters::path::path("metrics"))
+        .and(filters::path::end())
+        .map(move || {
+            let tracker = t9.clone();
+            tracker
+        })
+        .map(|tracker: Arc<TorrentTracker>| {
+            let metrics = tracker.metrics().render(&tracker.get_stats(), &tracker.get_swarm_stats());
+            reply::with_header(metrics, "content-type", "text/plain; version=0.0.4")
+        });
+
     let api_routes =
         filters::path::path("api")
             .and(view_torrent_list
@@ -347,13 +632,15 @@ pub fn start(socket_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> impl warp
                 .or(view_torrent_info)
                 .or(view_stats_list)
                 .or(add_torrent)
+                .or(import_whitelist)
                 .or(create_key)
                 .or(delete_key)
+                .or(import_keys)
                 .or(reload_whitelist)
                 .or(reload_keys)
             );
 
-    let server = api_routes.and(authenticate(tracker.config.http_api.access_tokens.clone()));
+    let server = api_routes.or(view_metrics).and(authenticate(tracker.config.http_api.access_tokens.clone()));
 
     let (_addr, api_server) = serve(server).bind_with_graceful_shutdown(socket_addr, async move {
         tokio::signal::ctrl_c()
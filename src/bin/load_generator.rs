@@ -0,0 +1,496 @@
+// Load generator for the UDP and HTTP trackers. Workers announce and scrape against a simulated
+// swarm for a fixed duration, then throughput and latency percentiles are reported.
+//
+//   cargo run --release --bin load_generator -- --protocol udp --target 127.0.0.1:6969 \
+//       --torrents 1000 --peers 10000 --concurrency 16 --duration 10 --scrape-ratio 0.1
+//
+// Every request comes from this host's ip, which the tracker leaves out of its own announce
+// responses, so run it from several hosts to get (and measure) full peer lists.
+use std::io;
+use std::net::SocketAddr;
+use std::str::FromStr;
+use std::time::{Duration, Instant};
+
+use rand::{Rng, SeedableRng};
+use rand::rngs::StdRng;
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::net::{TcpStream, UdpSocket};
+
+const UDP_PROTOCOL_ID: i64 = 0x41727101980;
+const UDP_CONNECT_ACTION: i32 = 0;
+const UDP_ANNOUNCE_ACTION: i32 = 1;
+const UDP_SCRAPE_ACTION: i32 = 2;
+const UDP_ERROR_ACTION: i32 = 3;
+// reconnect well before the tracker stops accepting the connection id
+const UDP_CONNECTION_ID_LIFETIME: Duration = Duration::from_secs(30);
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(1);
+// waits between failed HTTP connects, doubling up to the maximum
+const CONNECT_RETRY_DELAY: Duration = Duration::from_millis(10);
+const MAX_CONNECT_RETRY_DELAY: Duration = Duration::from_secs(1);
+const SCRAPE_TORRENTS: usize = 5;
+
+#[derive(Clone, Copy, PartialEq)]
+enum Protocol {
+    Udp,
+    Http,
+}
+
+#[derive(Clone)]
+struct Options {
+    protocol: Protocol,
+    target: SocketAddr,
+    torrents: u32,
+    peers: u32,
+    concurrency: u32,
+    duration: Duration,
+    scrape_ratio: f64,
+    seeder_ratio: f64,
+    // shares of the announces of started peers that stop, or complete the torrent if leeching
+    stopped_ratio: f64,
+    completed_ratio: f64,
+    numwant: i32,
+}
+
+impl Options {
+    fn from_args() -> Result<Options, String> {
+        let mut options = Options {
+            protocol: Protocol::Udp,
+            target: SocketAddr::from(([127, 0, 0, 1], 6969)),
+            torrents: 1000,
+            peers: 10_000,
+            concurrency: 16,
+            duration: Duration::from_secs(10),
+            scrape_ratio: 0.1,
+            seeder_ratio: 0.5,
+            stopped_ratio: 0.0,
+            completed_ratio: 0.0,
+            numwant: 50,
+        };
+
+        let mut args = std::env::args().skip(1);
+
+        while let Some(arg) = args.next() {
+            let value = args.next().ok_or_else(|| format!("Missing value for {}", arg))?;
+
+            match arg.as_str() {
+                "--protocol" => options.protocol = match value.as_str() {
+                    "udp" => Protocol::Udp,
+                    "http" => Protocol::Http,
+                    _ => return Err(format!("Unknown protocol: {}", value))
+                },
+                "--target" => options.target = parse(&arg, &value)?,
+                "--torrents" => options.torrents = parse::<u32>(&arg, &value)?.max(1),
+                "--peers" => options.peers = parse::<u32>(&arg, &value)?.max(1),
+                "--concurrency" => options.concurrency = parse::<u32>(&arg, &value)?.max(1),
+                "--duration" => options.duration = Duration::from_secs(parse(&arg, &value)?),
+                "--scrape-ratio" => options.scrape_ratio = parse::<f64>(&arg, &value)?.clamp(0.0, 1.0),
+                "--seeder-ratio" => options.seeder_ratio = parse::<f64>(&arg, &value)?.clamp(0.0, 1.0),
+                "--stopped-ratio" => options.stopped_ratio = parse::<f64>(&arg, &value)?.clamp(0.0, 1.0),
+                "--completed-ratio" => options.completed_ratio = parse::<f64>(&arg, &value)?.clamp(0.0, 1.0),
+                "--numwant" => options.numwant = parse(&arg, &value)?,
+                _ => return Err(format!("Unknown option: {}", arg))
+            }
+        }
+
+        Ok(options)
+    }
+}
+
+fn parse<T: FromStr>(arg: &str, value: &str) -> Result<T, String> {
+    value.parse().map_err(|_| format!("Invalid value for {}: {}", arg, value))
+}
+
+#[derive(Default)]
+struct Report {
+    announces: u64,
+    scrapes: u64,
+    errors: u64,
+    timeouts: u64,
+    // microseconds per successful request
+    latencies: Vec<u32>,
+}
+
+impl Report {
+    fn merge(&mut self, other: Report) {
+        self.announces += other.announces;
+        self.scrapes += other.scrapes;
+        self.errors += other.errors;
+        self.timeouts += other.timeouts;
+        self.latencies.extend(other.latencies);
+    }
+
+    fn print(mut self, elapsed: Duration) {
+        let requests = self.announces + self.scrapes;
+        self.latencies.sort_unstable();
+
+        println!("requests   {} ({:.1}/s)", requests, requests as f64 / elapsed.as_secs_f64());
+        println!("announces  {}", self.announces);
+        println!("scrapes    {}", self.scrapes);
+        println!("errors     {}", self.errors);
+        println!("timeouts   {}", self.timeouts);
+
+        if self.latencies.is_empty() { return; }
+
+        let percentile = |p: f64| self.latencies[((self.latencies.len() - 1) as f64 * p) as usize];
+
+        println!("latency    p50 {}us  p90 {}us  p99 {}us  p99.9 {}us  max {}us",
+                 percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), self.latencies[self.latencies.len() - 1]);
+    }
+}
+
+// The simulated swarm: peer n is in torrent n % torrents and starts out a seeder or a leecher.
+// A peer announces `started` the first time and again after it stopped, a leecher that announces
+// `completed` seeds from then on. Every worker owns the peers n % concurrency == worker.
+struct Swarm {
+    options: Options,
+    worker: u32,
+    owned_peers: u32,
+    started: Vec<bool>,
+    completed: Vec<bool>,
+    rng: StdRng,
+}
+
+enum Action {
+    Announce { info_hash: [u8; 20], peer_id: [u8; 20], left: i64, event: i32 },
+    Scrape { info_hashes: Vec<[u8; 20]> },
+}
+
+impl Swarm {
+    fn new(options: &Options, worker: u32) -> Swarm {
+        let owned_peers = ((options.peers.saturating_sub(worker) + options.concurrency - 1) / options.concurrency).max(1);
+
+        Swarm {
+            options: options.clone(),
+            worker,
+            owned_peers,
+            started: vec![false; owned_peers as usize],
+            completed: vec![false; owned_peers as usize],
+            rng: StdRng::from_entropy(),
+        }
+    }
+
+    fn next_action(&mut self) -> Action {
+        if self.rng.gen_bool(self.options.scrape_ratio) {
+            let info_hashes = (0..SCRAPE_TORRENTS).map(|_| info_hash(self.rng.gen_range(0..self.options.torrents))).collect();
+            return Action::Scrape { info_hashes };
+        }
+
+        let slot = self.rng.gen_range(0..self.owned_peers) as usize;
+        let peer = slot as u32 * self.options.concurrency + self.worker;
+        let seeding = self.completed[slot] || (peer as f64) < self.options.peers as f64 * self.options.seeder_ratio;
+
+        // BEP 15 events
+        let event = if !self.started[slot] {
+            self.started[slot] = true;
+            2
+        } else if self.rng.gen_bool(self.options.stopped_ratio) {
+            self.started[slot] = false;
+            3
+        } else if !seeding && self.rng.gen_bool(self.options.completed_ratio) {
+            self.completed[slot] = true;
+            1
+        } else {
+            0
+        };
+
+        let left = if seeding || event == 1 { 0 } else { 1000 };
+
+        Action::Announce { info_hash: info_hash(peer % self.options.torrents), peer_id: peer_id(peer), left, event }
+    }
+}
+
+fn info_hash(torrent: u32) -> [u8; 20] {
+    // spread the torrents over the tracker's shards, like SHA-1 output would
+    let mut info_hash = [0u8; 20];
+    info_hash[..4].copy_from_slice(&torrent.wrapping_mul(0x9e37_79b9).to_be_bytes());
+    info_hash[4..8].copy_from_slice(&torrent.to_be_bytes());
+    info_hash
+}
+
+fn peer_id(peer: u32) -> [u8; 20] {
+    let mut peer_id = [b'0'; 20];
+    peer_id[..8].copy_from_slice(b"-LG0001-");
+    peer_id[8..18].copy_from_slice(format!("{:010}", peer).as_bytes());
+    peer_id
+}
+
+async fn udp_worker(options: Options, worker: u32, deadline: Instant) -> io::Result<Report> {
+    let bind_addr: SocketAddr = if options.target.is_ipv4() { SocketAddr::from(([0, 0, 0, 0], 0)) } else { SocketAddr::from(([0u16; 8], 0)) };
+    let socket = UdpSocket::bind(bind_addr).await?;
+    socket.connect(options.target).await?;
+
+    let mut swarm = Swarm::new(&options, worker);
+    let mut report = Report::default();
+    let mut request: Vec<u8> = Vec::with_capacity(128);
+    let mut response = [0u8; 2048];
+    let mut connection: Option<(i64, Instant)> = None;
+
+    while Instant::now() < deadline {
+        let connection_id = match connection {
+            Some((connection_id, connected_at)) if connected_at.elapsed() < UDP_CONNECTION_ID_LIFETIME => connection_id,
+            _ => {
+                request.clear();
+                let transaction_id: i32 = swarm.rng.gen();
+                request.extend_from_slice(&UDP_PROTOCOL_ID.to_be_bytes());
+                request.extend_from_slice(&UDP_CONNECT_ACTION.to_be_bytes());
+                request.extend_from_slice(&transaction_id.to_be_bytes());
+
+                match udp_exchange(&socket, &request, &mut response, transaction_id).await? {
+                    Some(len) if len >= 16 && action(&response) == UDP_CONNECT_ACTION => {
+                        let connection_id = i64::from_be_bytes(response[8..16].try_into().unwrap());
+                        connection = Some((connection_id, Instant::now()));
+                        connection_id
+                    }
+                    Some(_) => { report.errors += 1; continue; }
+                    None => { report.timeouts += 1; continue; }
+                }
+            }
+        };
+
+        let transaction_id: i32 = swarm.rng.gen();
+        let action_sent = swarm.next_action();
+
+        request.clear();
+        request.extend_from_slice(&connection_id.to_be_bytes());
+
+        match &action_sent {
+            Action::Announce { info_hash, peer_id, left, event } => {
+                request.extend_from_slice(&UDP_ANNOUNCE_ACTION.to_be_bytes());
+                request.extend_from_slice(&transaction_id.to_be_bytes());
+                request.extend_from_slice(info_hash);
+                request.extend_from_slice(peer_id);
+                request.extend_from_slice(&0i64.to_be_bytes());
+                request.extend_from_slice(&left.to_be_bytes());
+                request.extend_from_slice(&0i64.to_be_bytes());
+                request.extend_from_slice(&event.to_be_bytes());
+                request.extend_from_slice(&0u32.to_be_bytes());
+                request.extend_from_slice(&0u32.to_be_bytes());
+                request.extend_from_slice(&options.numwant.to_be_bytes());
+                request.extend_from_slice(&6881u16.to_be_bytes());
+            }
+            Action::Scrape { info_hashes } => {
+                request.extend_from_slice(&UDP_SCRAPE_ACTION.to_be_bytes());
+                request.extend_from_slice(&transaction_id.to_be_bytes());
+                for info_hash in info_hashes { request.extend_from_slice(info_hash); }
+            }
+        }
+
+        let start_time = Instant::now();
+
+        match udp_exchange(&socket, &request, &mut response, transaction_id).await? {
+            Some(len) if len >= 8 && action(&response) != UDP_ERROR_ACTION => {
+                report.latencies.push(start_time.elapsed().as_micros() as u32);
+                match action_sent {
+                    Action::Announce { .. } => report.announces += 1,
+                    Action::Scrape { .. } => report.scrapes += 1,
+                }
+            }
+            Some(_) => {
+                report.errors += 1;
+                // most likely an expired connection id
+                connection = None;
+            }
+            None => report.timeouts += 1
+        }
+    }
+
+    Ok(report)
+}
+
+fn action(response: &[u8]) -> i32 {
+    i32::from_be_bytes(response[0..4].try_into().unwrap())
+}
+
+// Sends a request and waits for the response with the same transaction id, None on timeout
+async fn udp_exchange(socket: &UdpSocket, request: &[u8], response: &mut [u8], transaction_id: i32) -> io::Result<Option<usize>> {
+    socket.send(request).await?;
+
+    let deadline = tokio::time::Instant::now() + REQUEST_TIMEOUT;
+
+    loop {
+        match tokio::time::timeout_at(deadline, socket.recv(response)).await {
+            Err(_) => return Ok(None),
+            Ok(Err(e)) => return Err(e),
+            // a late response to an earlier request
+            Ok(Ok(len)) if len < 8 || response[4..8] != transaction_id.to_be_bytes() => continue,
+            Ok(Ok(len)) => return Ok(Some(len)),
+        }
+    }
+}
+
+async fn http_worker(options: Options, worker: u32, deadline: Instant) -> io::Result<Report> {
+    let mut swarm = Swarm::new(&options, worker);
+    let mut report = Report::default();
+    let mut connection: Option<HttpConnection> = None;
+    let mut path = String::with_capacity(256);
+    let mut retry_delay = CONNECT_RETRY_DELAY;
+
+    while Instant::now() < deadline {
+        if connection.is_none() {
+            match HttpConnection::connect(options.target).await {
+                Ok(http_connection) => {
+                    connection = Some(http_connection);
+                    retry_delay = CONNECT_RETRY_DELAY;
+                }
+                Err(_) => {
+                    report.errors += 1;
+                    tokio::time::sleep(retry_delay).await;
+                    retry_delay = (retry_delay * 2).min(MAX_CONNECT_RETRY_DELAY);
+                    continue;
+                }
+            }
+        }
+
+        let http_connection = connection.as_mut().unwrap();
+
+        let action_sent = swarm.next_action();
+
+        path.clear();
+
+        match &action_sent {
+            Action::Announce { info_hash, peer_id, left, event } => {
+                let event = match event {
+                    1 => "&event=completed",
+                    2 => "&event=started",
+                    3 => "&event=stopped",
+                    _ => ""
+                };
+                path.push_str("/announce?info_hash=");
+                percent_encode(&mut path, info_hash);
+                path.push_str("&peer_id=");
+                percent_encode(&mut path, peer_id);
+                path.push_str(&format!("&port=6881&uploaded=0&downloaded=0&left={}{}&compact=1&numwant={}", left, event, options.numwant));
+            }
+            Action::Scrape { info_hashes } => {
+                path.push_str("/scrape?");
+                for (index, info_hash) in info_hashes.iter().enumerate() {
+                    if index > 0 { path.push('&'); }
+                    path.push_str("info_hash=");
+                    percent_encode(&mut path, info_hash);
+                }
+            }
+        }
+
+        let start_time = Instant::now();
+
+        match tokio::time::timeout(REQUEST_TIMEOUT, http_connection.get(&path, options.target)).await {
+            Ok(Ok(200)) => {
+                report.latencies.push(start_time.elapsed().as_micros() as u32);
+                match action_sent {
+                    Action::Announce { .. } => report.announces += 1,
+                    Action::Scrape { .. } => report.scrapes += 1,
+                }
+            }
+            Ok(Ok(_)) => report.errors += 1,
+            Ok(Err(_)) => {
+                report.errors += 1;
+                connection = None;
+            }
+            Err(_) => {
+                report.timeouts += 1;
+                connection = None;
+            }
+        }
+    }
+
+    Ok(report)
+}
+
+fn percent_encode(path: &mut String, bytes: &[u8]) {
+    for byte in bytes {
+        path.push_str(&format!("%{:02X}", byte));
+    }
+}
+
+// A keep-alive HTTP/1.1 connection, reading responses that have a content-length
+struct HttpConnection {
+    stream: TcpStream,
+    buffer: Vec<u8>,
+}
+
+impl HttpConnection {
+    async fn connect(target: SocketAddr) -> io::Result<HttpConnection> {
+        let stream = TcpStream::connect(target).await?;
+        stream.set_nodelay(true)?;
+
+        Ok(HttpConnection { stream, buffer: Vec::with_capacity(4096) })
+    }
+
+    // Returns the status code of the response
+    async fn get(&mut self, path: &str, target: SocketAddr) -> io::Result<u16> {
+        let request = format!("GET {} HTTP/1.1\r\nHost: {}\r\n\r\n", path, target);
+        self.stream.write_all(request.as_bytes()).await?;
+
+        self.buffer.clear();
+
+        let header_len = loop {
+            if let Some(position) = self.buffer.windows(4).position(|window| window == b"\r\n\r\n") { break position + 4; }
+            self.read_more().await?;
+        };
+
+        let header = std::str::from_utf8(&self.buffer[..header_len]).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        let status: u16 = header.split(' ').nth(1).and_then(|status| status.parse().ok())
+            .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "invalid status line"))?;
+
+        let content_length: usize = header.lines()
+            .find_map(|line| {
+                let (name, value) = line.split_once(':')?;
+                if name.eq_ignore_ascii_case("content-length") { value.trim().parse().ok() } else { None }
+            })
+            .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "response without content-length"))?;
+
+        while self.buffer.len() < header_len + content_length {
+            self.read_more().await?;
+        }
+
+        Ok(status)
+    }
+
+    async fn read_more(&mut self) -> io::Result<()> {
+        let mut chunk = [0u8; 4096];
+        let len = self.stream.read(&mut chunk).await?;
+        if len == 0 { return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "connection closed")); }
+        self.buffer.extend_from_slice(&chunk[..len]);
+        Ok(())
+    }
+}
+
+#[tokio::main]
+async fn main() {
+    let options = match Options::from_args() {
+        Ok(options) => options,
+        Err(error) => {
+            eprintln!("{}", error);
+            eprintln!("Usage: load_generator [--protocol udp|http] [--target ip:port] [--torrents n] [--peers n] \
+                [--concurrency n] [--duration seconds] [--scrape-ratio 0..1] [--seeder-ratio 0..1] \
+                [--stopped-ratio 0..1] [--completed-ratio 0..1] [--numwant n]");
+            std::process::exit(1);
+        }
+    };
+
+    let start_time = Instant::now();
+    let deadline = start_time + options.duration;
+
+    let workers: Vec<_> = (0..options.concurrency).map(|worker| {
+        let options = options.clone();
+        tokio::spawn(async move {
+            match options.protocol {
+                Protocol::Udp => udp_worker(options, worker, deadline).await,
+                Protocol::Http => http_worker(options, worker, deadline).await,
+            }
+        })
+    }).collect();
+
+    let mut report = Report::default();
+
+    for worker in workers {
+        match worker.await {
+            Ok(Ok(worker_report)) => report.merge(worker_report),
+            Ok(Err(e)) => eprintln!("Worker failed: {}", e),
+            Err(e) => eprintln!("Worker panicked: {}", e),
+        }
+    }
+
+    report.print(start_time.elapsed());
+}
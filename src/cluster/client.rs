@@ -0,0 +1,146 @@
+use std::collections::HashMap;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use log::debug;
+use tokio::io::{AsyncWriteExt, BufReader};
+use tokio::net::TcpStream;
+use tokio::net::tcp::OwnedReadHalf;
+use tokio::sync::{mpsc, oneshot};
+use tokio::sync::mpsc::UnboundedReceiver;
+
+use crate::cluster::protocol::{ClusterKey, connect_handshake, Message, read_frame};
+
+// requests waiting for the connection task, more than this and the node is treated as down
+const REQUEST_QUEUE_LEN: usize = 4096;
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(1);
+// after a failed connect, requests fail immediately for this long instead of each waiting on a connect
+const RECONNECT_DELAY: Duration = Duration::from_secs(1);
+
+struct PendingRequest {
+    message: Message,
+    response: oneshot::Sender<Message>,
+}
+
+// Connection to another cluster node. Requests are pipelined over a single TCP connection,
+// which is opened on the first request and reopened after it fails.
+pub struct NodeClient {
+    requests: mpsc::Sender<PendingRequest>,
+}
+
+impl NodeClient {
+    // Must be called from within the tokio runtime, the connection is run by its own task
+    pub fn new(address: String, key: Option<Arc<ClusterKey>>) -> NodeClient {
+        let (requests, receiver) = mpsc::channel(REQUEST_QUEUE_LEN);
+
+        tokio::spawn(run_connection(address, key, receiver));
+
+        NodeClient {
+            requests,
+        }
+    }
+
+    // None if the node could not be reached, did not answer in time or could not handle the request
+    pub async fn request(&self, message: Message, timeout: Duration) -> Option<Message> {
+        let (response, receiver) = oneshot::channel();
+
+        self.requests.try_send(PendingRequest { message, response }).ok()?;
+
+        match tokio::time::timeout(timeout, receiver).await {
+            Ok(Ok(Message::Error)) => None,
+            Ok(Ok(message)) => Some(message),
+            _ => None
+        }
+    }
+}
+
+async fn run_connection(address: String, key: Option<Arc<ClusterKey>>, mut requests: mpsc::Receiver<PendingRequest>) {
+    let mut request_id: u32 = 0;
+    let mut retry_at: Option<Instant> = None;
+    let mut frame: Vec<u8> = Vec::new();
+
+    // dropping a request drops its response sender, which fails it right away
+    while let Some(pending) = requests.recv().await {
+        if retry_at.map_or(false, |retry_at| Instant::now() < retry_at) { continue; }
+
+        let mut stream = match tokio::time::timeout(CONNECT_TIMEOUT, TcpStream::connect(&address)).await {
+            Ok(Ok(stream)) => stream,
+            _ => {
+                debug!("Could not connect to cluster node: {}", address);
+                retry_at = Some(Instant::now() + RECONNECT_DELAY);
+                continue;
+            }
+        };
+
+        if let Some(key) = &key {
+            if let Err(e) = connect_handshake(&mut stream, key).await {
+                debug!("Cluster handshake with {} failed: {}", address, e);
+                retry_at = Some(Instant::now() + RECONNECT_DELAY);
+                continue;
+            }
+        }
+
+        retry_at = None;
+        let _ = stream.set_nodelay(true);
+
+        let (read_half, mut write_half) = stream.into_split();
+        let (register, registrations) = mpsc::unbounded_channel();
+        let mut reader = tokio::spawn(read_responses(read_half, registrations));
+        let mut next = Some(pending);
+
+        loop {
+            let pending = match next.take() {
+                Some(pending) => pending,
+                None => tokio::select! {
+                    pending = requests.recv() => match pending {
+                        Some(pending) => pending,
+                        None => {
+                            reader.abort();
+                            return;
+                        }
+                    },
+                    // the connection was closed or sent something unreadable
+                    _ = &mut reader => break,
+                }
+            };
+
+            request_id = request_id.wrapping_add(1);
+            frame.clear();
+            pending.message.encode(request_id, &mut frame);
+
+            // registered before writing, so the reader always knows the request by the time its response arrives
+            if register.send((request_id, pending.response)).is_err() { break; }
+
+            if let Err(e) = write_half.write_all(&frame).await {
+                debug!("Lost connection to cluster node {}: {}", address, e);
+                break;
+            }
+        }
+
+        // requests in flight on the lost connection fail with it
+        reader.abort();
+    }
+}
+
+async fn read_responses(read_half: OwnedReadHalf, mut registrations: UnboundedReceiver<(u32, oneshot::Sender<Message>)>) {
+    let mut reader = BufReader::new(read_half);
+    let mut in_flight: HashMap<u32, oneshot::Sender<Message>> = HashMap::new();
+    let mut frame: Vec<u8> = Vec::new();
+
+    while read_frame(&mut reader, &mut frame).await.is_ok() {
+        let (request_id, message) = match Message::decode(&frame) {
+            Some(decoded) => decoded,
+            None => break
+        };
+
+        while let Ok((request_id, response)) = registrations.try_recv() {
+            in_flight.insert(request_id, response);
+        }
+
+        // the requester may have timed out already
+        if let Some(response) = in_flight.remove(&request_id) {
+            let _ = response.send(message);
+        }
+    }
+}
+
@@ -0,0 +1,114 @@
+use std::collections::BTreeMap;
+use std::convert::TryInto;
+use std::sync::Arc;
+use std::time::Duration;
+
+use futures::future::join_all;
+use log::warn;
+
+use crate::{ClusterConfig, PeerId};
+use crate::cluster::client::NodeClient;
+use crate::cluster::protocol::{ClusterKey, MAX_SCRAPE_TORRENTS, Message};
+use crate::cluster::ring::HashRing;
+use crate::peer::TorrentPeer;
+use crate::protocol::common::InfoHash;
+use crate::tracker::torrent::TorrentStats;
+
+// The tracker nodes sharing the swarm. Every torrent lives on the node that owns its info hash
+// on the ring, the other nodes forward its announces and scrapes there. When the owner can not be
+// reached the request goes to the next node on the ring, so the swarm rebuilds there from the
+// next announces of its peers rather than being lost.
+pub struct Cluster {
+    ring: HashRing,
+    // a client per node, in `nodes` order, None for this node
+    nodes: Vec<Option<NodeClient>>,
+    request_timeout: Duration,
+}
+
+impl Cluster {
+    pub fn new(config: &ClusterConfig) -> Cluster {
+        if !config.nodes.contains(&config.bind_address) {
+            warn!("Cluster bind_address {} is not one of the cluster nodes, this node will not own any torrents.", config.bind_address);
+        }
+
+        let key = if config.secret.is_empty() { None } else { Some(Arc::new(ClusterKey::new(&config.secret))) };
+
+        let nodes = config.nodes.iter()
+            .map(|node| if *node == config.bind_address { None } else { Some(NodeClient::new(node.clone(), key.clone())) })
+            .collect();
+
+        Cluster {
+            ring: HashRing::new(&config.nodes, config.virtual_nodes),
+            nodes,
+            request_timeout: Duration::from_millis(config.request_timeout_ms),
+        }
+    }
+
+    // Forwards the announce to the first reachable owner of the torrent, passing the peers it returns
+    // to `write_peer`. None if this node is the first reachable owner, and has to handle it.
+    pub async fn announce<F>(&self, info_hash: &InfoHash, peer: &TorrentPeer, numwant: u32, mut write_peer: F) -> Option<TorrentStats>
+        where F: FnMut(&PeerId, &[u8])
+    {
+        for node in self.ring.owners(info_hash) {
+            let client = self.nodes[node].as_ref()?;
+
+            let request = Message::Announce { info_hash: info_hash.clone(), peer: peer.clone(), numwant };
+
+            if let Some(Message::AnnounceResponse { stats, addr_len, peers }) = client.request(request, self.request_timeout).await {
+                for peer in peers.chunks_exact(20 + addr_len) {
+                    let (peer_id, compact_addr) = peer.split_at(20);
+                    write_peer(&PeerId(peer_id.try_into().unwrap()), compact_addr);
+                }
+
+                return Some(stats);
+            }
+        }
+
+        None
+    }
+
+    // Every torrent's stats from its first reachable owner: the hashes are grouped by owner and each
+    // group sent as one scrape, all nodes at once. Hashes of a node that doesn't answer go to their
+    // next owner in the following round. None where this node is the first reachable owner, and has to answer.
+    pub async fn scrape(&self, info_hashes: &[InfoHash]) -> Vec<Option<Option<TorrentStats>>> {
+        let owners: Vec<Vec<usize>> = info_hashes.iter().map(|info_hash| self.ring.owners(info_hash)).collect();
+        let mut torrents_stats: Vec<Option<Option<TorrentStats>>> = info_hashes.iter().map(|_| None).collect();
+        let mut pending: Vec<usize> = (0..info_hashes.len()).collect();
+        let mut attempt = 0;
+
+        while !pending.is_empty() {
+            let mut by_node: BTreeMap<usize, Vec<usize>> = BTreeMap::new();
+
+            for position in pending.drain(..) {
+                // left to this node once it is the next owner
+                if let Some(&node) = owners[position].get(attempt) {
+                    if self.nodes[node].is_some() { by_node.entry(node).or_default().push(position); }
+                }
+            }
+
+            let requests = by_node.iter()
+                .flat_map(|(node, positions)| positions.chunks(MAX_SCRAPE_TORRENTS).map(move |positions| (*node, positions)))
+                .map(|(node, positions)| async move {
+                    let client = self.nodes[node].as_ref().unwrap();
+                    let request = Message::Scrape { info_hashes: positions.iter().map(|&position| info_hashes[position].clone()).collect() };
+
+                    (positions, client.request(request, self.request_timeout).await)
+                });
+
+            for (positions, response) in join_all(requests).await {
+                match response {
+                    Some(Message::ScrapeResponse { torrents }) if torrents.len() == positions.len() => {
+                        for (&position, torrent_stats) in positions.iter().zip(torrents) {
+                            torrents_stats[position] = Some(torrent_stats);
+                        }
+                    }
+                    _ => pending.extend_from_slice(positions)
+                }
+            }
+
+            attempt += 1;
+        }
+
+        torrents_stats
+    }
+}
@@ -0,0 +1,7 @@
+pub use self::cluster::*;
+
+pub mod cluster;
+pub mod client;
+pub mod protocol;
+pub mod ring;
+pub mod server;
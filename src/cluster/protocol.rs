@@ -0,0 +1,374 @@
+use std::convert::TryInto;
+use std::io;
+use std::net::SocketAddr;
+use std::time::Duration;
+
+use aquatic_udp_protocol::NumberOfBytes;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+use crate::PeerId;
+use crate::peer::{compact_addr_len, event_from_u8, event_to_u8, socket_addr_from_compact, TorrentPeer};
+use crate::protocol::common::InfoHash;
+use crate::protocol::utils::{keyed_hash, keys_from_secret};
+use crate::tracker::torrent::TorrentStats;
+
+// Inter-node protocol, over a TCP connection per pair of nodes. Every frame is
+//
+//   length (u32, of the rest of the frame), message type (u8), request id (u32), body
+//
+// all integers big endian, with the bodies:
+//
+//   announce           info hash (20), peer id (20), address length (u8), address (6 or 18, BEP 23 / BEP 7),
+//                      uploaded, downloaded, left (i64), event (u8, BEP 15), numwant (u32)
+//   announce response  seeders, completed, leechers (u32), address length (u8), peer count (u16),
+//                      then per peer its id (20) and address
+//   scrape             torrent count (u8), info hashes (20 each)
+//   scrape response    torrent count (u8), then per torrent known (u8), seeders, completed, leechers (u32)
+//   error              empty, the request could not be handled
+//
+// Responses carry the id of their request, so requests can be pipelined on one connection.
+//
+// With a cluster secret, a connecting node proves it knows the secret before its first frame:
+// the accepting node sends a random nonce (16) and the connecting node answers with the keyed
+// hash of it (16). Connections that don't answer correctly are closed unread.
+pub const FRAME_HEADER_LEN: usize = 4;
+pub const MAX_FRAME_LEN: usize = 64 * 1024;
+// torrents per scrape, the count is a single byte
+pub const MAX_SCRAPE_TORRENTS: usize = u8::MAX as usize;
+pub const NONCE_LEN: usize = 16;
+const TAG_LEN: usize = 16;
+const HANDSHAKE_TIMEOUT: Duration = Duration::from_secs(1);
+
+const ANNOUNCE: u8 = 1;
+const ANNOUNCE_RESPONSE: u8 = 2;
+const SCRAPE: u8 = 3;
+const SCRAPE_RESPONSE: u8 = 4;
+const ERROR: u8 = 255;
+
+pub enum Message {
+    Announce { info_hash: InfoHash, peer: TorrentPeer, numwant: u32 },
+    // `peers` holds every peer as its id followed by its `addr_len` byte compact address
+    AnnounceResponse { stats: TorrentStats, addr_len: usize, peers: Vec<u8> },
+    Scrape { info_hashes: Vec<InfoHash> },
+    ScrapeResponse { torrents: Vec<Option<TorrentStats>> },
+    Error,
+}
+
+impl Message {
+    // Appends the complete frame, length prefix included
+    pub fn encode(&self, request_id: u32, out: &mut Vec<u8>) {
+        let start = out.len();
+        out.extend_from_slice(&[0u8; FRAME_HEADER_LEN]);
+
+        match self {
+            Message::Announce { info_hash, peer, numwant } => {
+                out.push(ANNOUNCE);
+                out.extend_from_slice(&request_id.to_be_bytes());
+                out.extend_from_slice(&info_hash.0);
+                out.extend_from_slice(&peer.peer_id.0);
+                encode_addr(out, &peer.peer_addr);
+                out.extend_from_slice(&peer.uploaded.0.to_be_bytes());
+                out.extend_from_slice(&peer.downloaded.0.to_be_bytes());
+                out.extend_from_slice(&peer.left.0.to_be_bytes());
+                out.push(event_to_u8(peer.event));
+                out.extend_from_slice(&numwant.to_be_bytes());
+            }
+            Message::AnnounceResponse { stats, addr_len, peers } => {
+                out.push(ANNOUNCE_RESPONSE);
+                out.extend_from_slice(&request_id.to_be_bytes());
+                encode_stats(out, stats);
+                out.push(*addr_len as u8);
+                out.extend_from_slice(&((peers.len() / (20 + addr_len)) as u16).to_be_bytes());
+                out.extend_from_slice(peers);
+            }
+            Message::Scrape { info_hashes } => {
+                out.push(SCRAPE);
+                out.extend_from_slice(&request_id.to_be_bytes());
+                out.push(info_hashes.len() as u8);
+                for info_hash in info_hashes { out.extend_from_slice(&info_hash.0); }
+            }
+            Message::ScrapeResponse { torrents } => {
+                out.push(SCRAPE_RESPONSE);
+                out.extend_from_slice(&request_id.to_be_bytes());
+                out.push(torrents.len() as u8);
+                for torrent in torrents {
+                    match torrent {
+                        Some(stats) => {
+                            out.push(1);
+                            encode_stats(out, stats);
+                        }
+                        None => {
+                            out.push(0);
+                            out.extend_from_slice(&[0u8; 12]);
+                        }
+                    }
+                }
+            }
+            Message::Error => {
+                out.push(ERROR);
+                out.extend_from_slice(&request_id.to_be_bytes());
+            }
+        }
+
+        let frame_len = (out.len() - start - FRAME_HEADER_LEN) as u32;
+        out[start..start + FRAME_HEADER_LEN].copy_from_slice(&frame_len.to_be_bytes());
+    }
+
+    // Decodes a frame without its length prefix, returning its request id and message
+    pub fn decode(frame: &[u8]) -> Option<(u32, Message)> {
+        let mut frame = frame;
+        let [message_type] = take::<1>(&mut frame)?;
+        let request_id = u32::from_be_bytes(take(&mut frame)?);
+
+        let message = match message_type {
+            ANNOUNCE => {
+                let info_hash = InfoHash(take(&mut frame)?);
+                let peer_id = PeerId(take(&mut frame)?);
+                let [addr_len] = take::<1>(&mut frame)?;
+                let peer_addr = socket_addr_from_compact(take_slice(&mut frame, addr_len as usize)?)?;
+                let uploaded = i64::from_be_bytes(take(&mut frame)?);
+                let downloaded = i64::from_be_bytes(take(&mut frame)?);
+                let left = i64::from_be_bytes(take(&mut frame)?);
+                let [event] = take::<1>(&mut frame)?;
+                let numwant = u32::from_be_bytes(take(&mut frame)?);
+
+                let peer = TorrentPeer {
+                    peer_id,
+                    peer_addr,
+                    updated: std::time::Instant::now(),
+                    uploaded: NumberOfBytes(uploaded),
+                    downloaded: NumberOfBytes(downloaded),
+                    left: NumberOfBytes(left),
+                    event: event_from_u8(event),
+                };
+
+                Message::Announce { info_hash, peer, numwant }
+            }
+            ANNOUNCE_RESPONSE => {
+                let stats = decode_stats(&mut frame)?;
+                let [addr_len] = take::<1>(&mut frame)?;
+                let count = u16::from_be_bytes(take(&mut frame)?) as usize;
+                let peers = take_slice(&mut frame, count * (20 + addr_len as usize))?.to_vec();
+
+                Message::AnnounceResponse { stats, addr_len: addr_len as usize, peers }
+            }
+            SCRAPE => {
+                let [count] = take::<1>(&mut frame)?;
+                let info_hashes = (0..count).map(|_| take(&mut frame).map(InfoHash)).collect::<Option<Vec<InfoHash>>>()?;
+
+                Message::Scrape { info_hashes }
+            }
+            SCRAPE_RESPONSE => {
+                let [count] = take::<1>(&mut frame)?;
+                let mut torrents = Vec::with_capacity(count as usize);
+
+                for _ in 0..count {
+                    let [known] = take::<1>(&mut frame)?;
+                    let stats = decode_stats(&mut frame)?;
+                    torrents.push(if known == 1 { Some(stats) } else { None });
+                }
+
+                Message::ScrapeResponse { torrents }
+            }
+            ERROR => Message::Error,
+            _ => return None
+        };
+
+        if !frame.is_empty() { return None; }
+
+        Some((request_id, message))
+    }
+}
+
+// The cluster secret, as the two SipHash keys of the 128 bit handshake tag
+pub struct ClusterKey {
+    first: (u64, u64),
+    second: (u64, u64),
+}
+
+impl ClusterKey {
+    pub fn new(secret: &str) -> ClusterKey {
+        ClusterKey {
+            first: keys_from_secret(secret, "cluster handshake 1"),
+            second: keys_from_secret(secret, "cluster handshake 2"),
+        }
+    }
+
+    fn tag(&self, nonce: &[u8; NONCE_LEN]) -> [u8; TAG_LEN] {
+        let mut tag = [0u8; TAG_LEN];
+        tag[..8].copy_from_slice(&keyed_hash(self.first, nonce.as_slice()).to_be_bytes());
+        tag[8..].copy_from_slice(&keyed_hash(self.second, nonce.as_slice()).to_be_bytes());
+        tag
+    }
+}
+
+// Accepting side of the handshake, fails unless the other node answered with the right tag
+pub async fn accept_handshake<S: AsyncRead + AsyncWrite + Unpin>(stream: &mut S, key: &ClusterKey) -> io::Result<()> {
+    let nonce: [u8; NONCE_LEN] = rand::random();
+    stream.write_all(&nonce).await?;
+
+    let mut tag = [0u8; TAG_LEN];
+    tokio::time::timeout(HANDSHAKE_TIMEOUT, stream.read_exact(&mut tag)).await
+        .map_err(|_| io::Error::new(io::ErrorKind::TimedOut, "cluster handshake timed out"))??;
+
+    // compared without stopping at the first differing byte
+    let difference = tag.iter().zip(key.tag(&nonce).iter()).fold(0u8, |difference, (a, b)| difference | (a ^ b));
+    if difference != 0 {
+        return Err(io::Error::new(io::ErrorKind::PermissionDenied, "wrong cluster secret"));
+    }
+
+    Ok(())
+}
+
+// Connecting side of the handshake
+pub async fn connect_handshake<S: AsyncRead + AsyncWrite + Unpin>(stream: &mut S, key: &ClusterKey) -> io::Result<()> {
+    let mut nonce = [0u8; NONCE_LEN];
+    tokio::time::timeout(HANDSHAKE_TIMEOUT, stream.read_exact(&mut nonce)).await
+        .map_err(|_| io::Error::new(io::ErrorKind::TimedOut, "cluster handshake timed out"))??;
+
+    stream.write_all(&key.tag(&nonce)).await
+}
+
+// Reads the next frame, without its length prefix, into `frame`
+pub async fn read_frame<R: AsyncRead + Unpin>(reader: &mut R, frame: &mut Vec<u8>) -> io::Result<()> {
+    let mut frame_len = [0u8; FRAME_HEADER_LEN];
+    reader.read_exact(&mut frame_len).await?;
+
+    let frame_len = u32::from_be_bytes(frame_len) as usize;
+    if frame_len > MAX_FRAME_LEN {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "cluster frame too large"));
+    }
+
+    frame.resize(frame_len, 0);
+    reader.read_exact(frame).await?;
+
+    Ok(())
+}
+
+fn encode_addr(out: &mut Vec<u8>, peer_addr: &SocketAddr) {
+    out.push(compact_addr_len(peer_addr) as u8);
+
+    match peer_addr {
+        SocketAddr::V4(addr) => out.extend_from_slice(&addr.ip().octets()),
+        SocketAddr::V6(addr) => out.extend_from_slice(&addr.ip().octets()),
+    }
+
+    out.extend_from_slice(&peer_addr.port().to_be_bytes());
+}
+
+fn encode_stats(out: &mut Vec<u8>, stats: &TorrentStats) {
+    out.extend_from_slice(&stats.seeders.to_be_bytes());
+    out.extend_from_slice(&stats.completed.to_be_bytes());
+    out.extend_from_slice(&stats.leechers.to_be_bytes());
+}
+
+fn decode_stats(frame: &mut &[u8]) -> Option<TorrentStats> {
+    Some(TorrentStats {
+        seeders: u32::from_be_bytes(take(frame)?),
+        completed: u32::from_be_bytes(take(frame)?),
+        leechers: u32::from_be_bytes(take(frame)?),
+    })
+}
+
+fn take<const L: usize>(frame: &mut &[u8]) -> Option<[u8; L]> {
+    take_slice(frame, L).map(|bytes| bytes.try_into().unwrap())
+}
+
+fn take_slice<'a>(frame: &mut &'a [u8], len: usize) -> Option<&'a [u8]> {
+    if frame.len() < len { return None; }
+
+    let (bytes, rest) = frame.split_at(len);
+    *frame = rest;
+
+    Some(bytes)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv6Addr, SocketAddr};
+
+    use aquatic_udp_protocol::{AnnounceEvent, NumberOfBytes};
+
+    use crate::cluster::protocol::{ClusterKey, FRAME_HEADER_LEN, Message, NONCE_LEN};
+    use crate::PeerId;
+    use crate::peer::TorrentPeer;
+    use crate::protocol::common::InfoHash;
+    use crate::tracker::torrent::TorrentStats;
+
+    fn round_trip(message: Message) -> Message {
+        let mut frame = Vec::new();
+        message.encode(7, &mut frame);
+
+        assert_eq!(u32::from_be_bytes(frame[..4].try_into().unwrap()) as usize, frame.len() - FRAME_HEADER_LEN);
+
+        let (request_id, message) = Message::decode(&frame[FRAME_HEADER_LEN..]).unwrap();
+        assert_eq!(request_id, 7);
+        message
+    }
+
+    #[test]
+    fn announce_round_trip() {
+        let peer = TorrentPeer {
+            peer_id: PeerId(*b"-qB00000000000000001"),
+            peer_addr: SocketAddr::new(IpAddr::V6(Ipv6Addr::LOCALHOST), 6881),
+            updated: std::time::Instant::now(),
+            uploaded: NumberOfBytes(1),
+            downloaded: NumberOfBytes(2),
+            left: NumberOfBytes(3),
+            event: AnnounceEvent::Completed,
+        };
+
+        match round_trip(Message::Announce { info_hash: InfoHash([1; 20]), peer: peer.clone(), numwant: 50 }) {
+            Message::Announce { info_hash, peer: decoded_peer, numwant } => {
+                assert_eq!(info_hash, InfoHash([1; 20]));
+                assert_eq!(decoded_peer.peer_id, peer.peer_id);
+                assert_eq!(decoded_peer.peer_addr, peer.peer_addr);
+                assert_eq!(decoded_peer.left, peer.left);
+                assert_eq!(decoded_peer.event, AnnounceEvent::Completed);
+                assert_eq!(numwant, 50);
+            }
+            _ => panic!("not an announce")
+        }
+    }
+
+    #[test]
+    fn responses_round_trip() {
+        let peers = [[2u8; 20].as_slice(), &[126, 0, 0, 1, 0x1a, 0xe1]].concat();
+        let stats = TorrentStats { seeders: 1, completed: 2, leechers: 3 };
+
+        match round_trip(Message::AnnounceResponse { stats, addr_len: 6, peers: peers.clone() }) {
+            Message::AnnounceResponse { stats, addr_len, peers: decoded_peers } => {
+                assert_eq!((stats.seeders, stats.completed, stats.leechers), (1, 2, 3));
+                assert_eq!(addr_len, 6);
+                assert_eq!(decoded_peers, peers);
+            }
+            _ => panic!("not an announce response")
+        }
+
+        match round_trip(Message::ScrapeResponse { torrents: vec![None, Some(TorrentStats { seeders: 4, completed: 5, leechers: 6 })] }) {
+            Message::ScrapeResponse { torrents } => {
+                assert!(torrents[0].is_none());
+                assert_eq!(torrents[1].as_ref().map(|stats| stats.completed), Some(5));
+            }
+            _ => panic!("not a scrape response")
+        }
+    }
+
+    #[test]
+    fn handshake_tags_depend_on_secret_and_nonce() {
+        let key = ClusterKey::new("secret");
+
+        assert_eq!(key.tag(&[1; NONCE_LEN]), ClusterKey::new("secret").tag(&[1; NONCE_LEN]));
+        assert_ne!(key.tag(&[1; NONCE_LEN]), ClusterKey::new("other secret").tag(&[1; NONCE_LEN]));
+        assert_ne!(key.tag(&[1; NONCE_LEN]), key.tag(&[2; NONCE_LEN]));
+    }
+
+    #[test]
+    fn truncated_frames_are_rejected() {
+        let mut frame = Vec::new();
+        Message::Scrape { info_hashes: vec![InfoHash([1; 20])] }.encode(1, &mut frame);
+
+        assert!(Message::decode(&frame[FRAME_HEADER_LEN..frame.len() - 1]).is_none());
+        assert!(Message::decode(&[9, 0, 0, 0, 1]).is_none());
+    }
+}
@@ -0,0 +1,108 @@
+use std::convert::TryInto;
+
+use crate::protocol::common::InfoHash;
+
+// Consistent hash ring over the cluster nodes. Every node is placed at `virtual_nodes` points,
+// and an info hash belongs to the node of the first point at or after it, wrapping around.
+// Adding or removing a node only moves the info hashes next to its own points.
+pub struct HashRing {
+    // (position, node index), sorted by position
+    points: Vec<(u64, usize)>,
+    nodes: usize,
+}
+
+impl HashRing {
+    pub fn new(nodes: &[String], virtual_nodes: u32) -> HashRing {
+        let mut points: Vec<(u64, usize)> = nodes.iter().enumerate()
+            .flat_map(|(index, node)| (0..virtual_nodes.max(1)).map(move |point| (point_position(node, point), index)))
+            .collect();
+
+        points.sort_unstable();
+
+        HashRing {
+            points,
+            nodes: nodes.len(),
+        }
+    }
+
+    // Every node in ring order starting at the owner of `info_hash`, each once.
+    // The nodes after the owner are where its torrents fail over to.
+    pub fn owners(&self, info_hash: &InfoHash) -> Vec<usize> {
+        let mut owners: Vec<usize> = Vec::with_capacity(self.nodes);
+
+        if self.points.is_empty() { return owners; }
+
+        // info hashes are SHA-1 output, their first bytes are already uniformly distributed
+        let position = u64::from_be_bytes(info_hash.0[..8].try_into().unwrap());
+        let start = self.points.partition_point(|(point, _)| *point < position);
+
+        for (_, node) in self.points[start..].iter().chain(self.points[..start].iter()) {
+            if !owners.contains(node) {
+                owners.push(*node);
+                if owners.len() == self.nodes { break; }
+            }
+        }
+
+        owners
+    }
+}
+
+// FNV-1a of "<node>#<point>", finished with the splitmix64 mixer so similar node names
+// still spread over the whole ring. Stable across processes and builds, unlike the std hashers.
+fn point_position(node: &str, point: u32) -> u64 {
+    let mut hash: u64 = 0xcbf2_9ce4_8422_2325;
+
+    for byte in node.as_bytes().iter().chain(b"#").chain(point.to_string().as_bytes()) {
+        hash ^= *byte as u64;
+        hash = hash.wrapping_mul(0x0000_0100_0000_01b3);
+    }
+
+    hash = (hash ^ (hash >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    hash = (hash ^ (hash >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    hash ^ (hash >> 31)
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::cluster::ring::HashRing;
+    use crate::protocol::common::InfoHash;
+
+    fn info_hash(index: u32) -> InfoHash {
+        let mut info_hash = [0u8; 20];
+        info_hash[..4].copy_from_slice(&index.wrapping_mul(0x9e37_79b9).to_be_bytes());
+        InfoHash(info_hash)
+    }
+
+    fn nodes(count: usize) -> Vec<String> {
+        (0..count).map(|index| format!("10.0.0.{}:6970", index)).collect()
+    }
+
+    #[test]
+    fn info_hashes_are_spread_over_all_nodes() {
+        let ring = HashRing::new(&nodes(4), 64);
+        let mut owned = [0usize; 4];
+
+        for index in 0..10_000 {
+            let owners = ring.owners(&info_hash(index));
+            assert_eq!(owners.len(), 4);
+            owned[owners[0]] += 1;
+        }
+
+        for count in owned {
+            assert!(count > 1_500, "unbalanced ring: {:?}", owned);
+        }
+    }
+
+    #[test]
+    fn removing_a_node_only_moves_its_own_info_hashes() {
+        let ring = HashRing::new(&nodes(4), 64);
+        let smaller_ring = HashRing::new(&nodes(3), 64);
+
+        for index in 0..10_000 {
+            let owner = ring.owners(&info_hash(index))[0];
+            if owner != 3 {
+                assert_eq!(smaller_ring.owners(&info_hash(index))[0], owner);
+            }
+        }
+    }
+}
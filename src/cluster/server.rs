@@ -0,0 +1,147 @@
+use std::net::SocketAddr;
+use std::sync::Arc;
+
+use log::{debug, info, warn};
+use tokio::io::{AsyncWriteExt, BufReader};
+use tokio::net::{TcpListener, TcpStream};
+use tokio::net::tcp::OwnedWriteHalf;
+use tokio::sync::{mpsc, Semaphore};
+
+use crate::cluster::protocol::{accept_handshake, ClusterKey, MAX_FRAME_LEN, Message, read_frame};
+use crate::PeerId;
+use crate::peer::compact_addr_len;
+use crate::tracker::tracker::TorrentTracker;
+
+// requests of one connection handled at once, reading the next waits for one of them to finish
+const MAX_CONCURRENT_REQUESTS: usize = 256;
+
+// Serves the requests other cluster nodes forward for the torrents this node owns
+pub struct ClusterServer {
+    listener: TcpListener,
+    tracker: Arc<TorrentTracker>,
+    // None without a cluster secret, every connection is then accepted
+    key: Option<Arc<ClusterKey>>,
+}
+
+impl ClusterServer {
+    pub async fn new(tracker: Arc<TorrentTracker>, bind_address: &str, secret: &str) -> tokio::io::Result<ClusterServer> {
+        let listener = TcpListener::bind(bind_address).await?;
+
+        Ok(ClusterServer {
+            listener,
+            tracker,
+            key: if secret.is_empty() { None } else { Some(Arc::new(ClusterKey::new(secret))) },
+        })
+    }
+
+    pub async fn start(&self) {
+        loop {
+            tokio::select! {
+                _ = tokio::signal::ctrl_c() => {
+                    info!("Stopping cluster node: {}..", self.listener.local_addr().unwrap());
+                    break;
+                }
+                accepted = self.listener.accept() => {
+                    match accepted {
+                        Ok((stream, remote_addr)) => {
+                            debug!("Cluster node connected from: {}", remote_addr);
+                            tokio::spawn(ClusterServer::handle_connection(stream, remote_addr, self.tracker.clone(), self.key.clone()));
+                        }
+                        Err(e) => debug!("could not accept cluster connection: {}", e)
+                    }
+                }
+            }
+        }
+    }
+
+    // Every request of a connection is handled by a task of its own, so one waiting on a busy shard
+    // doesn't hold up the others. Responses carry their request id and are written as they complete.
+    async fn handle_connection(mut stream: TcpStream, remote_addr: SocketAddr, tracker: Arc<TorrentTracker>, key: Option<Arc<ClusterKey>>) {
+        let _ = stream.set_nodelay(true);
+
+        if let Some(key) = key {
+            if let Err(e) = accept_handshake(&mut stream, &key).await {
+                warn!("Rejected cluster connection from {}: {}", remote_addr, e);
+                return;
+            }
+        }
+
+        let (read_half, write_half) = stream.into_split();
+        let mut reader = BufReader::new(read_half);
+        let mut frame: Vec<u8> = Vec::new();
+
+        let (responses, receiver) = mpsc::channel(MAX_CONCURRENT_REQUESTS);
+        let writer = tokio::spawn(write_responses(write_half, receiver));
+        let permits = Arc::new(Semaphore::new(MAX_CONCURRENT_REQUESTS));
+
+        while read_frame(&mut reader, &mut frame).await.is_ok() {
+            let (request_id, message) = match Message::decode(&frame) {
+                Some(decoded) => decoded,
+                None => break
+            };
+
+            let permit = match permits.clone().acquire_owned().await {
+                Ok(permit) => permit,
+                Err(_) => break
+            };
+
+            let tracker = tracker.clone();
+            let responses = responses.clone();
+
+            tokio::spawn(async move {
+                let mut response: Vec<u8> = Vec::new();
+                handle_message(&tracker, message).await.encode(request_id, &mut response);
+                let _ = responses.send(response).await;
+                drop(permit);
+            });
+        }
+
+        // the writer stops once the requests still running have sent their responses
+        drop(responses);
+        let _ = writer.await;
+    }
+}
+
+// Writes the responses of a connection, those that completed together in one write
+async fn write_responses(mut write_half: OwnedWriteHalf, mut responses: mpsc::Receiver<Vec<u8>>) {
+    let mut out: Vec<u8> = Vec::new();
+
+    while let Some(response) = responses.recv().await {
+        out.clear();
+        out.extend_from_slice(&response);
+
+        while let Ok(response) = responses.try_recv() {
+            out.extend_from_slice(&response);
+        }
+
+        if write_half.write_all(&out).await.is_err() { break; }
+    }
+}
+
+pub async fn handle_message(tracker: &TorrentTracker, message: Message) -> Message {
+    match message {
+        Message::Announce { info_hash, peer, numwant } => {
+            let addr_len = compact_addr_len(&peer.peer_addr);
+            // every response has to fit a frame, whatever numwant the forwarding node asked for
+            let numwant = numwant.min(((MAX_FRAME_LEN - 32) / (20 + addr_len)) as u32);
+            let mut peers: Vec<u8> = Vec::with_capacity(tracker.get_numwant(Some(numwant)) * (20 + addr_len));
+
+            let stats = tracker.update_local_torrent_with_peer_and_get_peers(&info_hash, &peer, Some(numwant), |peer_id: &PeerId, compact_addr| {
+                peers.extend_from_slice(&peer_id.0);
+                peers.extend_from_slice(compact_addr);
+            }).await;
+
+            Message::AnnounceResponse { stats, addr_len, peers }
+        }
+        Message::Scrape { info_hashes } => {
+            let mut torrents = Vec::with_capacity(info_hashes.len());
+
+            for info_hash in &info_hashes {
+                torrents.push(tracker.get_local_torrent_stats(info_hash).await);
+            }
+
+            Message::ScrapeResponse { torrents }
+        }
+        _ => Message::Error
+    }
+}
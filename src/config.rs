@@ -16,6 +16,14 @@ use crate::mode::TrackerMode;
 pub struct UdpTrackerConfig {
     pub enabled: bool,
     pub bind_address: String,
+    #[serde(default = "default_udp_workers")]
+    pub workers: usize,
+    // worker threads of a runtime of its own, 0 runs on the main runtime
+    #[serde(default)]
+    pub threads: usize,
+    // cores to pin those threads to, empty leaves them to the scheduler
+    #[serde(default)]
+    pub cpu_cores: Vec<usize>,
 }
 
 #[derive(Serialize, Deserialize, Debug)]
@@ -27,6 +35,10 @@ pub struct HttpTrackerConfig {
     pub ssl_cert_path: Option<String>,
     #[serde(serialize_with = "none_as_empty_string")]
     pub ssl_key_path: Option<String>,
+    #[serde(default)]
+    pub threads: usize,
+    #[serde(default)]
+    pub cpu_cores: Vec<usize>,
 }
 
 #[derive(Serialize, Deserialize)]
@@ -36,12 +48,47 @@ pub struct HttpApiConfig {
     pub access_tokens: HashMap<String, String>,
 }
 
+#[derive(Serialize, Deserialize, Debug)]
+pub struct ClusterConfig {
+    pub enabled: bool,
+    // address the other nodes reach this node on, must be one of `nodes`
+    pub bind_address: String,
+    // every node of the cluster, the same list (in any order) on all of them
+    pub nodes: Vec<String>,
+    #[serde(default = "default_cluster_virtual_nodes")]
+    pub virtual_nodes: u32,
+    #[serde(default = "default_cluster_request_timeout_ms")]
+    pub request_timeout_ms: u64,
+    // shared by all nodes, which have to prove they know it before forwarding anything.
+    // Without it the cluster may only bind to a private or loopback address.
+    #[serde(default)]
+    pub secret: String,
+}
+
+impl Default for ClusterConfig {
+    fn default() -> Self {
+        ClusterConfig {
+            enabled: false,
+            bind_address: String::from("0.0.0.0:6970"),
+            nodes: Vec::new(),
+            virtual_nodes: default_cluster_virtual_nodes(),
+            request_timeout_ms: default_cluster_request_timeout_ms(),
+            secret: String::new(),
+        }
+    }
+}
+
 #[derive(Serialize, Deserialize)]
 pub struct Configuration {
     pub log_level: Option<String>,
     pub mode: TrackerMode,
     pub db_driver: DatabaseDrivers,
     pub db_path: String,
+    #[serde(default = "default_db_pool_size")]
+    pub db_pool_size: u32,
+    // prebuilt file of raw 20 byte info hashes the whitelist is loaded from instead of the database
+    #[serde(default, serialize_with = "none_as_empty_string")]
+    pub whitelist_path: Option<String>,
     pub announce_interval: u32,
     pub min_announce_interval: u32,
     pub max_peer_timeout: u32,
@@ -51,9 +98,55 @@ pub struct Configuration {
     pub persistent_torrent_completed_stat: bool,
     pub inactive_peer_cleanup_interval: u64,
     pub remove_peerless_torrents: bool,
+    #[serde(default = "default_max_peers_per_announce")]
+    pub max_peers_per_announce: u32,
+    #[serde(default = "default_torrent_shards")]
+    pub torrent_shards: usize,
+    #[serde(default = "default_persistence_flush_interval")]
+    pub persistence_flush_interval: u64,
+    #[serde(default, serialize_with = "none_as_empty_string")]
+    pub swarm_snapshot_path: Option<String>,
+    #[serde(default = "default_swarm_snapshot_interval")]
+    pub swarm_snapshot_interval: u64,
+    // swarms with at least this many peers of an ip family serve compact announces from a cached compact peer string, 0 disables it
+    #[serde(default)]
+    pub announce_cache_min_peers: u32,
+    #[serde(default = "default_announce_cache_ttl")]
+    pub announce_cache_ttl: u32,
+    #[serde(default = "default_announce_cache_max_mutations")]
+    pub announce_cache_max_mutations: u32,
+    // requests per second per client network on the UDP and HTTP trackers, 0 disables rate limiting
+    #[serde(default)]
+    pub rate_limit_per_second: u32,
+    #[serde(default = "default_rate_limit_burst")]
+    pub rate_limit_burst: u32,
+    #[serde(default = "default_rate_limit_ipv4_prefix")]
+    pub rate_limit_ipv4_prefix: u8,
+    #[serde(default = "default_rate_limit_ipv6_prefix")]
+    pub rate_limit_ipv6_prefix: u8,
+    // drop limited UDP announces and scrapes without an answer, instead of sending an error.
+    // Limited connects are always dropped, their sender's address is not verified yet
+    #[serde(default)]
+    pub rate_limit_silent_drop: bool,
+    // `udp://host:port`, `tcp://host:port` or a file path to export every announce to, empty disables it
+    #[serde(default, serialize_with = "none_as_empty_string")]
+    pub announce_export_sink: Option<String>,
+    // announce events waiting for the export job, further events are dropped
+    #[serde(default = "default_announce_export_buffer")]
+    pub announce_export_buffer: usize,
+    // size at which the export file is rotated, 0 never rotates it
+    #[serde(default = "default_announce_export_rotate_bytes")]
+    pub announce_export_rotate_bytes: u64,
+    // runtime of their own for the API, cleanup, persistence and snapshot jobs, like the trackers' `threads`
+    #[serde(default)]
+    pub background_threads: usize,
+    #[serde(default)]
+    pub background_cpu_cores: Vec<usize>,
     pub udp_trackers: Vec<UdpTrackerConfig>,
     pub http_trackers: Vec<HttpTrackerConfig>,
     pub http_api: HttpApiConfig,
+    #[serde(default)]
+    pub cluster: ClusterConfig,
 }
 
 #[derive(Debug)]
@@ -87,6 +180,66 @@ pub fn none_as_empty_string<T, S>(option: &Option<T>, serializer: S) -> Result<S
     }
 }
 
+pub fn default_db_pool_size() -> u32 {
+    10
+}
+
+pub fn default_torrent_shards() -> usize {
+    64
+}
+
+pub fn default_persistence_flush_interval() -> u64 {
+    10
+}
+
+pub fn default_swarm_snapshot_interval() -> u64 {
+    300
+}
+
+pub fn default_announce_export_buffer() -> usize {
+    65536
+}
+
+pub fn default_announce_export_rotate_bytes() -> u64 {
+    256 * 1024 * 1024
+}
+
+pub fn default_announce_cache_ttl() -> u32 {
+    1
+}
+
+pub fn default_announce_cache_max_mutations() -> u32 {
+    100
+}
+
+pub fn default_rate_limit_burst() -> u32 {
+    10
+}
+
+pub fn default_rate_limit_ipv4_prefix() -> u8 {
+    32
+}
+
+pub fn default_rate_limit_ipv6_prefix() -> u8 {
+    64
+}
+
+pub fn default_max_peers_per_announce() -> u32 {
+    74
+}
+
+pub fn default_udp_workers() -> usize {
+    4
+}
+
+pub fn default_cluster_virtual_nodes() -> u32 {
+    64
+}
+
+pub fn default_cluster_request_timeout_ms() -> u64 {
+    500
+}
+
 impl Configuration {
     pub fn load(data: &[u8]) -> Result<Configuration, toml::de::Error> {
         toml::from_slice(data)
@@ -106,6 +259,21 @@ impl Configuration {
         }
     }
 
+    // None if swarm snapshots are disabled (no or an empty path)
+    pub fn get_swarm_snapshot_path(&self) -> Option<&str> {
+        self.swarm_snapshot_path.as_deref().filter(|path| !path.is_empty())
+    }
+
+    // None if announces are not exported (no or an empty sink)
+    pub fn get_announce_export_sink(&self) -> Option<&str> {
+        self.announce_export_sink.as_deref().filter(|sink| !sink.is_empty())
+    }
+
+    // None if the whitelist is loaded from the database (no or an empty path)
+    pub fn get_whitelist_path(&self) -> Option<&str> {
+        self.whitelist_path.as_deref().filter(|path| !path.is_empty())
+    }
+
     pub fn get_ext_ip(&self) -> Option<IpAddr> {
         match &self.external_ip {
             None => None,
@@ -126,6 +294,8 @@ impl Configuration {
             mode: TrackerMode::Public,
             db_driver: DatabaseDrivers::Sqlite3,
             db_path: String::from("data.db"),
+            db_pool_size: default_db_pool_size(),
+            whitelist_path: None,
             announce_interval: 120,
             min_announce_interval: 120,
             max_peer_timeout: 900,
@@ -135,6 +305,24 @@ impl Configuration {
             persistent_torrent_completed_stat: false,
             inactive_peer_cleanup_interval: 600,
             remove_peerless_torrents: true,
+            max_peers_per_announce: default_max_peers_per_announce(),
+            torrent_shards: default_torrent_shards(),
+            persistence_flush_interval: default_persistence_flush_interval(),
+            swarm_snapshot_path: None,
+            swarm_snapshot_interval: default_swarm_snapshot_interval(),
+            announce_cache_min_peers: 0,
+            announce_cache_ttl: default_announce_cache_ttl(),
+            announce_cache_max_mutations: default_announce_cache_max_mutations(),
+            rate_limit_per_second: 0,
+            rate_limit_burst: default_rate_limit_burst(),
+            rate_limit_ipv4_prefix: default_rate_limit_ipv4_prefix(),
+            rate_limit_ipv6_prefix: default_rate_limit_ipv6_prefix(),
+            rate_limit_silent_drop: false,
+            announce_export_sink: None,
+            announce_export_buffer: default_announce_export_buffer(),
+            announce_export_rotate_bytes: default_announce_export_rotate_bytes(),
+            background_threads: 0,
+            background_cpu_cores: Vec::new(),
             udp_trackers: Vec::new(),
             http_trackers: Vec::new(),
             http_api: HttpApiConfig {
@@ -142,11 +330,15 @@ impl Configuration {
                 bind_address: String::from("127.0.0.1:1212"),
                 access_tokens: [(String::from("admin"), String::from("MyAccessToken"))].iter().cloned().collect(),
             },
+            cluster: ClusterConfig::default(),
         };
         configuration.udp_trackers.push(
             UdpTrackerConfig {
                 enabled: false,
                 bind_address: String::from("0.0.0.0:6969"),
+                workers: default_udp_workers(),
+                threads: 0,
+                cpu_cores: Vec::new(),
             }
         );
         configuration.http_trackers.push(
@@ -156,6 +348,8 @@ impl Configuration {
                 ssl_enabled: false,
                 ssl_cert_path: None,
                 ssl_key_path: None,
+                threads: 0,
+                cpu_cores: Vec::new(),
             }
         );
         configuration
@@ -13,14 +13,14 @@ pub enum DatabaseDrivers {
     MySQL,
 }
 
-pub fn connect_database(db_driver: &DatabaseDrivers, db_path: &str) -> Result<Box<dyn Database>, r2d2::Error> {
+pub fn connect_database(db_driver: &DatabaseDrivers, db_path: &str, db_pool_size: u32) -> Result<Box<dyn Database>, r2d2::Error> {
     let database: Box<dyn Database> = match db_driver {
         DatabaseDrivers::Sqlite3 => {
-            let db = SqliteDatabase::new(db_path)?;
+            let db = SqliteDatabase::new(db_path, db_pool_size)?;
             Box::new(db)
         }
         DatabaseDrivers::MySQL => {
-            let db = MysqlDatabase::new(db_path)?;
+            let db = MysqlDatabase::new(db_path, db_pool_size)?;
             Box::new(db)
         }
     };
@@ -42,16 +42,26 @@ pub trait Database: Sync + Send {
 
     async fn save_persistent_torrent(&self, info_hash: &InfoHash, completed: u32) -> Result<(), Error>;
 
+    async fn save_persistent_torrents(&self, torrents: &[(InfoHash, u32)]) -> Result<(), Error>;
+
     async fn get_info_hash_from_whitelist(&self, info_hash: &str) -> Result<InfoHash, Error>;
 
     async fn add_info_hash_to_whitelist(&self, info_hash: InfoHash) -> Result<usize, Error>;
 
+    // Whitelist a batch of info hashes in one transaction, hashes already on the whitelist are skipped.
+    // Returns the number of hashes that were added.
+    async fn add_info_hashes_to_whitelist(&self, info_hashes: &[InfoHash]) -> Result<usize, Error>;
+
     async fn remove_info_hash_from_whitelist(&self, info_hash: InfoHash) -> Result<usize, Error>;
 
     async fn get_key_from_keys(&self, key: &str) -> Result<AuthKey, Error>;
 
     async fn add_key_to_keys(&self, auth_key: &AuthKey) -> Result<usize, Error>;
 
+    // Add a batch of keys in one transaction, keys already present get the new valid_until.
+    // Returns the number of keys written.
+    async fn add_keys_to_keys(&self, auth_keys: &[AuthKey]) -> Result<usize, Error>;
+
     async fn remove_key_from_keys(&self, key: &str) -> Result<usize, Error>;
 }
 
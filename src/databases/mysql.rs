@@ -3,7 +3,7 @@ use std::str::FromStr;
 use async_trait::async_trait;
 use log::{debug};
 use r2d2::Pool;
-use r2d2_mysql::mysql::{Opts, OptsBuilder, params};
+use r2d2_mysql::mysql::{Conn, Opts, OptsBuilder, params, TxOpts};
 use r2d2_mysql::mysql::prelude::Queryable;
 use r2d2_mysql::MysqlConnectionManager;
 
@@ -12,21 +12,38 @@ use crate::databases::database::{Database, Error};
 use crate::databases::database;
 use crate::tracker::key::AuthKey;
 
+const STATEMENT_CACHE_SIZE: usize = 32;
+
 pub struct MysqlDatabase {
     pool: Pool<MysqlConnectionManager>,
 }
 
 impl MysqlDatabase {
-    pub fn new(db_path: &str) -> Result<Self, r2d2::Error> {
+    pub fn new(db_path: &str, pool_size: u32) -> Result<Self, r2d2::Error> {
         let opts = Opts::from_url(&db_path).expect("Failed to connect to MySQL database.");
-        let builder = OptsBuilder::from_opts(opts);
+        // every connection keeps the statements it prepared for the exec_* calls below
+        let builder = OptsBuilder::from_opts(opts).stmt_cache_size(STATEMENT_CACHE_SIZE);
         let manager = MysqlConnectionManager::new(builder);
-        let pool = r2d2::Pool::builder().build(manager).expect("Failed to create r2d2 MySQL connection pool.");
+        let pool = r2d2::Pool::builder().max_size(pool_size.max(1)).build(manager).expect("Failed to create r2d2 MySQL connection pool.");
 
         Ok(Self {
             pool
         })
     }
+
+    // Queries run on tokio's blocking thread pool, so a slow MySQL server
+    // never holds up the threads that serve announces
+    async fn run<F, T>(&self, query: F) -> Result<T, database::Error>
+        where F: FnOnce(&mut Conn) -> Result<T, database::Error> + Send + 'static,
+              T: Send + 'static
+    {
+        let pool = self.pool.clone();
+
+        tokio::task::spawn_blocking(move || {
+            let mut conn = pool.get().map_err(|_| database::Error::DatabaseError)?;
+            query(&mut conn)
+        }).await.map_err(|_| database::Error::DatabaseError)?
+    }
 }
 
 #[async_trait]
@@ -70,148 +87,218 @@ impl Database for MysqlDatabase {
     }
 
     async fn load_persistent_torrents(&self) -> Result<Vec<(InfoHash, u32)>, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        let torrents: Vec<(InfoHash, u32)> = conn.query_map("SELECT info_hash, completed FROM torrents", |(info_hash_string, completed): (String, u32)| {
-            let info_hash = InfoHash::from_str(&info_hash_string).unwrap();
-            (info_hash, completed)
-        }).map_err(|_| database::Error::QueryReturnedNoRows)?;
-
-        Ok(torrents)
+        self.run(move |conn| {
+            let torrents: Vec<(InfoHash, u32)> = conn.query_map("SELECT info_hash, completed FROM torrents", |(info_hash_string, completed): (String, u32)| {
+                let info_hash = InfoHash::from_str(&info_hash_string).unwrap();
+                (info_hash, completed)
+            }).map_err(|_| database::Error::QueryReturnedNoRows)?;
+
+            Ok(torrents)
+        }).await
     }
 
     async fn load_keys(&self) -> Result<Vec<AuthKey>, Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        let keys: Vec<AuthKey> = conn.query_map("SELECT `key`, valid_until FROM `keys`", |(key, valid_until): (String, i64)| {
-            AuthKey {
-                key,
-                valid_until: Some(valid_until as u64)
-            }
-        }).map_err(|_| database::Error::QueryReturnedNoRows)?;
+        self.run(move |conn| {
+            let keys: Vec<AuthKey> = conn.query_map("SELECT `key`, valid_until FROM `keys`", |(key, valid_until): (String, i64)| {
+                AuthKey {
+                    key,
+                    valid_until: Some(valid_until as u64)
+                }
+            }).map_err(|_| database::Error::QueryReturnedNoRows)?;
 
-        Ok(keys)
+            Ok(keys)
+        }).await
     }
 
     async fn load_whitelist(&self) -> Result<Vec<InfoHash>, Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        self.run(move |conn| {
+            let info_hashes: Vec<InfoHash> = conn.query_map("SELECT info_hash FROM whitelist", |info_hash: String| {
+                InfoHash::from_str(&info_hash).unwrap()
+            }).map_err(|_| database::Error::QueryReturnedNoRows)?;
 
-        let info_hashes: Vec<InfoHash> = conn.query_map("SELECT info_hash FROM whitelist", |info_hash: String| {
-            InfoHash::from_str(&info_hash).unwrap()
-        }).map_err(|_| database::Error::QueryReturnedNoRows)?;
-
-        Ok(info_hashes)
+            Ok(info_hashes)
+        }).await
     }
 
     async fn save_persistent_torrent(&self, info_hash: &InfoHash, completed: u32) -> Result<(), database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        let info_hash = info_hash.clone();
 
-        let info_hash_str = info_hash.to_string();
+        self.run(move |conn| {
+            let info_hash_str = info_hash.to_string();
 
-        debug!("{}", info_hash_str);
+            debug!("{}", info_hash_str);
 
-        match conn.exec_drop("INSERT INTO torrents (info_hash, completed) VALUES (:info_hash_str, :completed) ON DUPLICATE KEY UPDATE completed = VALUES(completed)", params! { info_hash_str, completed }) {
-            Ok(_) => {
-                Ok(())
+            match conn.exec_drop("INSERT INTO torrents (info_hash, completed) VALUES (:info_hash_str, :completed) ON DUPLICATE KEY UPDATE completed = VALUES(completed)", params! { info_hash_str, completed }) {
+                Ok(_) => {
+                    Ok(())
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            Err(e) => {
+        }).await
+    }
+
+    async fn save_persistent_torrents(&self, torrents: &[(InfoHash, u32)]) -> Result<(), database::Error> {
+        let torrents = torrents.to_vec();
+
+        self.run(move |conn| {
+            let mut tx = conn.start_transaction(TxOpts::default()).map_err(|_| database::Error::DatabaseError)?;
+
+            let params_iter = torrents.iter().map(|(info_hash, completed)| params! { "info_hash_str" => info_hash.to_string(), "completed" => completed });
+
+            if let Err(e) = tx.exec_batch("INSERT INTO torrents (info_hash, completed) VALUES (:info_hash_str, :completed) ON DUPLICATE KEY UPDATE completed = VALUES(completed)", params_iter) {
                 debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+                return Err(database::Error::InvalidQuery);
             }
-        }
+
+            tx.commit().map_err(|_| database::Error::DatabaseError)
+        }).await
     }
 
     async fn get_info_hash_from_whitelist(&self, info_hash: &str) -> Result<InfoHash, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        let info_hash = info_hash.to_string();
 
-        match conn.exec_first::<String, _, _>("SELECT info_hash FROM whitelist WHERE info_hash = :info_hash", params! { info_hash })
-            .map_err(|_| database::Error::QueryReturnedNoRows)? {
-            Some(info_hash) => {
-                Ok(InfoHash::from_str(&info_hash).unwrap())
+        self.run(move |conn| {
+            match conn.exec_first::<String, _, _>("SELECT info_hash FROM whitelist WHERE info_hash = :info_hash", params! { info_hash })
+                .map_err(|_| database::Error::QueryReturnedNoRows)? {
+                Some(info_hash) => {
+                    Ok(InfoHash::from_str(&info_hash).unwrap())
+                }
+                None => {
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            None => {
-                Err(database::Error::InvalidQuery)
-            }
-        }
+        }).await
     }
 
     async fn add_info_hash_to_whitelist(&self, info_hash: InfoHash) -> Result<usize, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        let info_hash_str = info_hash.to_string();
-
-        match conn.exec_drop("INSERT INTO whitelist (info_hash) VALUES (:info_hash_str)", params! { info_hash_str }) {
-            Ok(_) => {
-                Ok(1)
-            }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+        self.run(move |conn| {
+            let info_hash_str = info_hash.to_string();
+
+            match conn.exec_drop("INSERT INTO whitelist (info_hash) VALUES (:info_hash_str)", params! { info_hash_str }) {
+                Ok(_) => {
+                    Ok(1)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-        }
+        }).await
     }
 
-    async fn remove_info_hash_from_whitelist(&self, info_hash: InfoHash) -> Result<usize, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+    async fn add_info_hashes_to_whitelist(&self, info_hashes: &[InfoHash]) -> Result<usize, database::Error> {
+        let info_hashes = info_hashes.to_vec();
 
-        let info_hash = info_hash.to_string();
+        self.run(move |conn| {
+            let mut tx = conn.start_transaction(TxOpts::default()).map_err(|_| database::Error::DatabaseError)?;
+            let mut inserted = 0;
+
+            let stmt = tx.prep("INSERT IGNORE INTO whitelist (info_hash) VALUES (:info_hash_str)").map_err(|_| database::Error::InvalidQuery)?;
 
-        match conn.exec_drop("DELETE FROM whitelist WHERE info_hash = :info_hash", params! { info_hash }) {
-            Ok(_) => {
-                Ok(1)
+            // executed one by one like exec_batch does, so the hashes already whitelisted aren't counted
+            for info_hash in info_hashes {
+                if let Err(e) = tx.exec_drop(&stmt, params! { "info_hash_str" => info_hash.to_string() }) {
+                    debug!("{:?}", e);
+                    return Err(database::Error::InvalidQuery);
+                }
+                inserted += tx.affected_rows() as usize;
             }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+
+            tx.commit().map_err(|_| database::Error::DatabaseError)?;
+
+            Ok(inserted)
+        }).await
+    }
+
+    async fn remove_info_hash_from_whitelist(&self, info_hash: InfoHash) -> Result<usize, database::Error> {
+        self.run(move |conn| {
+            let info_hash = info_hash.to_string();
+
+            match conn.exec_drop("DELETE FROM whitelist WHERE info_hash = :info_hash", params! { info_hash }) {
+                Ok(_) => {
+                    Ok(1)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-        }
+        }).await
     }
 
     async fn get_key_from_keys(&self, key: &str) -> Result<AuthKey, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.exec_first::<(String, i64), _, _>("SELECT `key`, valid_until FROM `keys` WHERE `key` = :key", params! { key })
-            .map_err(|_| database::Error::QueryReturnedNoRows)? {
-            Some((key, valid_until)) => {
-                Ok(AuthKey {
-                    key,
-                    valid_until: Some(valid_until as u64),
-                })
+        let key = key.to_string();
+
+        self.run(move |conn| {
+            match conn.exec_first::<(String, i64), _, _>("SELECT `key`, valid_until FROM `keys` WHERE `key` = :key", params! { key })
+                .map_err(|_| database::Error::QueryReturnedNoRows)? {
+                Some((key, valid_until)) => {
+                    Ok(AuthKey {
+                        key,
+                        valid_until: Some(valid_until as u64),
+                    })
+                }
+                None => {
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            None => {
-                Err(database::Error::InvalidQuery)
-            }
-        }
+        }).await
     }
 
     async fn add_key_to_keys(&self, auth_key: &AuthKey) -> Result<usize, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        let auth_key = auth_key.clone();
+
+        self.run(move |conn| {
+            let key = auth_key.key.to_string();
+            let valid_until = auth_key.valid_until.unwrap_or(0).to_string();
+
+            match conn.exec_drop("INSERT INTO `keys` (`key`, valid_until) VALUES (:key, :valid_until)", params! { key, valid_until }) {
+                Ok(_) => {
+                    Ok(1)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
+            }
+        }).await
+    }
 
-        let key = auth_key.key.to_string();
-        let valid_until = auth_key.valid_until.unwrap_or(0).to_string();
+    async fn add_keys_to_keys(&self, auth_keys: &[AuthKey]) -> Result<usize, database::Error> {
+        let auth_keys = auth_keys.to_vec();
 
-        match conn.exec_drop("INSERT INTO `keys` (`key`, valid_until) VALUES (:key, :valid_until)", params! { key, valid_until }) {
-            Ok(_) => {
-                Ok(1)
-            }
-            Err(e) => {
+        self.run(move |conn| {
+            let mut tx = conn.start_transaction(TxOpts::default()).map_err(|_| database::Error::DatabaseError)?;
+
+            let params_iter = auth_keys.iter().map(|auth_key| params! { "key" => &auth_key.key, "valid_until" => auth_key.valid_until.unwrap_or(0).to_string() });
+
+            if let Err(e) = tx.exec_batch("INSERT INTO `keys` (`key`, valid_until) VALUES (:key, :valid_until) ON DUPLICATE KEY UPDATE valid_until = VALUES(valid_until)", params_iter) {
                 debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+                return Err(database::Error::InvalidQuery);
             }
-        }
+
+            tx.commit().map_err(|_| database::Error::DatabaseError)?;
+
+            Ok(auth_keys.len())
+        }).await
     }
 
     async fn remove_key_from_keys(&self, key: &str) -> Result<usize, database::Error> {
-        let mut conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.exec_drop("DELETE FROM `keys` WHERE key = :key", params! { key }) {
-            Ok(_) => {
-                Ok(1)
-            }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+        let key = key.to_string();
+
+        self.run(move |conn| {
+            match conn.exec_drop("DELETE FROM `keys` WHERE key = :key", params! { key }) {
+                Ok(_) => {
+                    Ok(1)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-        }
+        }).await
     }
 }
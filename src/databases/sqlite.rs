@@ -4,7 +4,7 @@ use async_trait::async_trait;
 use log::debug;
 use r2d2::Pool;
 use r2d2_sqlite::SqliteConnectionManager;
-use r2d2_sqlite::rusqlite::NO_PARAMS;
+use r2d2_sqlite::rusqlite::{Connection, NO_PARAMS};
 
 use crate::{InfoHash};
 use crate::databases::database::{Database, Error};
@@ -16,13 +16,27 @@ pub struct SqliteDatabase {
 }
 
 impl SqliteDatabase {
-    pub fn new(db_path: &str) -> Result<SqliteDatabase, r2d2::Error> {
+    pub fn new(db_path: &str, pool_size: u32) -> Result<SqliteDatabase, r2d2::Error> {
         let cm = SqliteConnectionManager::file(db_path);
-        let pool = Pool::new(cm).expect("Failed to create r2d2 SQLite connection pool.");
+        let pool = Pool::builder().max_size(pool_size.max(1)).build(cm).expect("Failed to create r2d2 SQLite connection pool.");
         Ok(SqliteDatabase {
             pool
         })
     }
+
+    // Queries run on tokio's blocking thread pool, so waiting on a connection or the disk
+    // never holds up the threads that serve announces
+    async fn run<F, T>(&self, query: F) -> Result<T, database::Error>
+        where F: FnOnce(&mut Connection) -> Result<T, database::Error> + Send + 'static,
+              T: Send + 'static
+    {
+        let pool = self.pool.clone();
+
+        tokio::task::spawn_blocking(move || {
+            let mut conn = pool.get().map_err(|_| database::Error::DatabaseError)?;
+            query(&mut conn)
+        }).await.map_err(|_| database::Error::DatabaseError)?
+    }
 }
 
 #[async_trait]
@@ -58,167 +72,250 @@ impl Database for SqliteDatabase {
     }
 
     async fn load_persistent_torrents(&self) -> Result<Vec<(InfoHash, u32)>, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        let mut stmt = conn.prepare("SELECT info_hash, completed FROM torrents")?;
+        self.run(move |conn| {
+            let mut stmt = conn.prepare_cached("SELECT info_hash, completed FROM torrents")?;
 
-        let torrent_iter = stmt.query_map(NO_PARAMS, |row| {
-            let info_hash_string: String = row.get(0)?;
-            let info_hash = InfoHash::from_str(&info_hash_string).unwrap();
-            let completed: u32 = row.get(1)?;
-            Ok((info_hash, completed))
-        })?;
+            let torrent_iter = stmt.query_map(NO_PARAMS, |row| {
+                let info_hash_string: String = row.get(0)?;
+                let info_hash = InfoHash::from_str(&info_hash_string).unwrap();
+                let completed: u32 = row.get(1)?;
+                Ok((info_hash, completed))
+            })?;
 
-        let torrents: Vec<(InfoHash, u32)> = torrent_iter.filter_map(|x| x.ok()).collect();
+            let torrents: Vec<(InfoHash, u32)> = torrent_iter.filter_map(|x| x.ok()).collect();
 
-        Ok(torrents)
+            Ok(torrents)
+        }).await
     }
 
     async fn load_keys(&self) -> Result<Vec<AuthKey>, Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        let mut stmt = conn.prepare("SELECT key, valid_until FROM keys")?;
+        self.run(move |conn| {
+            let mut stmt = conn.prepare_cached("SELECT key, valid_until FROM keys")?;
 
-        let keys_iter = stmt.query_map(NO_PARAMS, |row| {
-            let key = row.get(0)?;
-            let valid_until: i64 = row.get(1)?;
+            let keys_iter = stmt.query_map(NO_PARAMS, |row| {
+                let key = row.get(0)?;
+                let valid_until: i64 = row.get(1)?;
 
-            Ok(AuthKey {
-                key,
-                valid_until: Some(valid_until as u64)
-            })
-        })?;
+                Ok(AuthKey {
+                    key,
+                    valid_until: Some(valid_until as u64)
+                })
+            })?;
 
-        let keys: Vec<AuthKey> = keys_iter.filter_map(|x| x.ok()).collect();
+            let keys: Vec<AuthKey> = keys_iter.filter_map(|x| x.ok()).collect();
 
-        Ok(keys)
+            Ok(keys)
+        }).await
     }
 
     async fn load_whitelist(&self) -> Result<Vec<InfoHash>, Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        self.run(move |conn| {
+            let mut stmt = conn.prepare_cached("SELECT info_hash FROM whitelist")?;
 
-        let mut stmt = conn.prepare("SELECT info_hash FROM whitelist")?;
+            let info_hash_iter = stmt.query_map(NO_PARAMS, |row| {
+                let info_hash: String = row.get(0)?;
 
-        let info_hash_iter = stmt.query_map(NO_PARAMS, |row| {
-            let info_hash: String = row.get(0)?;
+                Ok(InfoHash::from_str(&info_hash).unwrap())
+            })?;
 
-            Ok(InfoHash::from_str(&info_hash).unwrap())
-        })?;
+            let info_hashes: Vec<InfoHash> = info_hash_iter.filter_map(|x| x.ok()).collect();
 
-        let info_hashes: Vec<InfoHash> = info_hash_iter.filter_map(|x| x.ok()).collect();
-
-        Ok(info_hashes)
+            Ok(info_hashes)
+        }).await
     }
 
     async fn save_persistent_torrent(&self, info_hash: &InfoHash, completed: u32) -> Result<(), database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.execute("INSERT INTO torrents (info_hash, completed) VALUES (?1, ?2) ON CONFLICT(info_hash) DO UPDATE SET completed = ?2", &[info_hash.to_string(), completed.to_string()]) {
-            Ok(updated) => {
-                if updated > 0 { return Ok(()); }
-                Err(database::Error::QueryReturnedNoRows)
+        let info_hash = info_hash.clone();
+
+        self.run(move |conn| {
+            match conn.prepare_cached("INSERT INTO torrents (info_hash, completed) VALUES (?1, ?2) ON CONFLICT(info_hash) DO UPDATE SET completed = ?2")?.execute(&[info_hash.to_string(), completed.to_string()]) {
+                Ok(updated) => {
+                    if updated > 0 { return Ok(()); }
+                    Err(database::Error::QueryReturnedNoRows)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+        }).await
+    }
+
+    async fn save_persistent_torrents(&self, torrents: &[(InfoHash, u32)]) -> Result<(), database::Error> {
+        let torrents = torrents.to_vec();
+
+        self.run(move |conn| {
+            let tx = conn.transaction()?;
+
+            {
+                let mut stmt = tx.prepare_cached("INSERT INTO torrents (info_hash, completed) VALUES (?1, ?2) ON CONFLICT(info_hash) DO UPDATE SET completed = ?2")?;
+
+                for (info_hash, completed) in torrents {
+                    if let Err(e) = stmt.execute(&[info_hash.to_string(), completed.to_string()]) {
+                        debug!("{:?}", e);
+                        return Err(database::Error::InvalidQuery);
+                    }
+                }
             }
-        }
+
+            tx.commit().map_err(|_| database::Error::DatabaseError)
+        }).await
     }
 
     async fn get_info_hash_from_whitelist(&self, info_hash: &str) -> Result<InfoHash, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        let info_hash = info_hash.to_string();
 
-        let mut stmt = conn.prepare("SELECT info_hash FROM whitelist WHERE info_hash = ?")?;
-        let mut rows = stmt.query(&[info_hash])?;
+        self.run(move |conn| {
+            let mut stmt = conn.prepare_cached("SELECT info_hash FROM whitelist WHERE info_hash = ?")?;
+            let mut rows = stmt.query(&[info_hash])?;
 
-        if let Some(row) = rows.next()? {
-            let info_hash: String = row.get(0).unwrap();
+            if let Some(row) = rows.next()? {
+                let info_hash: String = row.get(0).unwrap();
 
-            // should never be able to fail
-            Ok(InfoHash::from_str(&info_hash).unwrap())
-        } else {
-            Err(database::Error::InvalidQuery)
-        }
+                // should never be able to fail
+                Ok(InfoHash::from_str(&info_hash).unwrap())
+            } else {
+                Err(database::Error::InvalidQuery)
+            }
+        }).await
     }
 
     async fn add_info_hash_to_whitelist(&self, info_hash: InfoHash) -> Result<usize, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.execute("INSERT INTO whitelist (info_hash) VALUES (?)", &[info_hash.to_string()]) {
-            Ok(updated) => {
-                if updated > 0 { return Ok(updated); }
-                Err(database::Error::QueryReturnedNoRows)
+        self.run(move |conn| {
+            match conn.prepare_cached("INSERT INTO whitelist (info_hash) VALUES (?)")?.execute(&[info_hash.to_string()]) {
+                Ok(updated) => {
+                    if updated > 0 { return Ok(updated); }
+                    Err(database::Error::QueryReturnedNoRows)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+        }).await
+    }
+
+    async fn add_info_hashes_to_whitelist(&self, info_hashes: &[InfoHash]) -> Result<usize, database::Error> {
+        let info_hashes = info_hashes.to_vec();
+
+        self.run(move |conn| {
+            let tx = conn.transaction()?;
+            let mut inserted = 0;
+
+            {
+                let mut stmt = tx.prepare_cached("INSERT OR IGNORE INTO whitelist (info_hash) VALUES (?)")?;
+
+                for info_hash in info_hashes {
+                    match stmt.execute(&[info_hash.to_string()]) {
+                        Ok(updated) => inserted += updated,
+                        Err(e) => {
+                            debug!("{:?}", e);
+                            return Err(database::Error::InvalidQuery);
+                        }
+                    }
+                }
             }
-        }
+
+            tx.commit().map_err(|_| database::Error::DatabaseError)?;
+
+            Ok(inserted)
+        }).await
     }
 
     async fn remove_info_hash_from_whitelist(&self, info_hash: InfoHash) -> Result<usize, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.execute("DELETE FROM whitelist WHERE info_hash = ?", &[info_hash.to_string()]) {
-            Ok(updated) => {
-                if updated > 0 { return Ok(updated); }
-                Err(database::Error::QueryReturnedNoRows)
+        self.run(move |conn| {
+            match conn.prepare_cached("DELETE FROM whitelist WHERE info_hash = ?")?.execute(&[info_hash.to_string()]) {
+                Ok(updated) => {
+                    if updated > 0 { return Ok(updated); }
+                    Err(database::Error::QueryReturnedNoRows)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
-            }
-        }
+        }).await
     }
 
     async fn get_key_from_keys(&self, key: &str) -> Result<AuthKey, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
+        let key = key.to_string();
 
-        let mut stmt = conn.prepare("SELECT key, valid_until FROM keys WHERE key = ?")?;
-        let mut rows = stmt.query(&[key.to_string()])?;
+        self.run(move |conn| {
+            let mut stmt = conn.prepare_cached("SELECT key, valid_until FROM keys WHERE key = ?")?;
+            let mut rows = stmt.query(&[key.to_string()])?;
 
-        if let Some(row) = rows.next()? {
-            let key: String = row.get(0).unwrap();
-            let valid_until_i64: i64 = row.get(1).unwrap();
+            if let Some(row) = rows.next()? {
+                let key: String = row.get(0).unwrap();
+                let valid_until_i64: i64 = row.get(1).unwrap();
 
-            Ok(AuthKey {
-                key,
-                valid_until: Some(valid_until_i64 as u64),
-            })
-        } else {
-            Err(database::Error::QueryReturnedNoRows)
-        }
+                Ok(AuthKey {
+                    key,
+                    valid_until: Some(valid_until_i64 as u64),
+                })
+            } else {
+                Err(database::Error::QueryReturnedNoRows)
+            }
+        }).await
     }
 
     async fn add_key_to_keys(&self, auth_key: &AuthKey) -> Result<usize, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.execute("INSERT INTO keys (key, valid_until) VALUES (?1, ?2)",
-                           &[auth_key.key.to_string(), auth_key.valid_until.unwrap().to_string()],
-        ) {
-            Ok(updated) => {
-                if updated > 0 { return Ok(updated); }
-                Err(database::Error::QueryReturnedNoRows)
+        let auth_key = auth_key.clone();
+
+        self.run(move |conn| {
+            match conn.prepare_cached("INSERT INTO keys (key, valid_until) VALUES (?1, ?2)")?.execute(&[auth_key.key.to_string(), auth_key.valid_until.unwrap().to_string()]) {
+                Ok(updated) => {
+                    if updated > 0 { return Ok(updated); }
+                    Err(database::Error::QueryReturnedNoRows)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+        }).await
+    }
+
+    async fn add_keys_to_keys(&self, auth_keys: &[AuthKey]) -> Result<usize, database::Error> {
+        let auth_keys = auth_keys.to_vec();
+
+        self.run(move |conn| {
+            let tx = conn.transaction()?;
+            let mut updated = 0;
+
+            {
+                let mut stmt = tx.prepare_cached("INSERT INTO keys (key, valid_until) VALUES (?1, ?2) ON CONFLICT(key) DO UPDATE SET valid_until = ?2")?;
+
+                for auth_key in auth_keys {
+                    match stmt.execute(&[auth_key.key, auth_key.valid_until.unwrap_or(0).to_string()]) {
+                        Ok(rows) => updated += rows,
+                        Err(e) => {
+                            debug!("{:?}", e);
+                            return Err(database::Error::InvalidQuery);
+                        }
+                    }
+                }
             }
-        }
+
+            tx.commit().map_err(|_| database::Error::DatabaseError)?;
+
+            Ok(updated)
+        }).await
     }
 
     async fn remove_key_from_keys(&self, key: &str) -> Result<usize, database::Error> {
-        let conn = self.pool.get().map_err(|_| database::Error::DatabaseError)?;
-
-        match conn.execute("DELETE FROM keys WHERE key = ?", &[key]) {
-            Ok(updated) => {
-                if updated > 0 { return Ok(updated); }
-                Err(database::Error::QueryReturnedNoRows)
-            }
-            Err(e) => {
-                debug!("{:?}", e);
-                Err(database::Error::InvalidQuery)
+        let key = key.to_string();
+
+        self.run(move |conn| {
+            match conn.prepare_cached("DELETE FROM keys WHERE key = ?")?.execute(&[key]) {
+                Ok(updated) => {
+                    if updated > 0 { return Ok(updated); }
+                    Err(database::Error::QueryReturnedNoRows)
+                }
+                Err(e) => {
+                    debug!("{:?}", e);
+                    Err(database::Error::InvalidQuery)
+                }
             }
-        }
+        }).await
     }
 }
@@ -29,6 +29,12 @@ pub enum ServerError {
 
     #[error("exceeded info_hash limit")]
     ExceededInfoHashLimit,
+
+    #[error("invalid query string")]
+    InvalidQuery,
+
+    #[error("too many requests, announce at most every {0} seconds")]
+    RateLimited(u32),
 }
 
 impl Reject for ServerError {}
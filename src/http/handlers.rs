@@ -1,4 +1,3 @@
-use std::collections::HashMap;
 use std::convert::Infallible;
 use std::net::IpAddr;
 use std::sync::Arc;
@@ -6,12 +5,14 @@ use std::sync::Arc;
 use log::debug;
 use warp::{reject, Rejection, Reply};
 use warp::http::Response;
+use warp::hyper::body::Bytes;
 
 use crate::{InfoHash};
 use crate::tracker::key::AuthKey;
 use crate::tracker::torrent::{TorrentError, TorrentStats};
-use crate::http::{AnnounceRequest, AnnounceResponse, ErrorResponse, Peer, ScrapeRequest, ScrapeResponse, ScrapeResponseEntry, ServerError, WebResult};
-use crate::peer::TorrentPeer;
+use crate::http::{AnnounceRequest, AnnounceResponse, CompactAnnounceResponse, ErrorResponse, Peer, ScrapeRequest, ScrapeResponse, ScrapeResponseEntry, ServerError, WebResult};
+use crate::peer::{compact_addr_len, socket_addr_from_compact, TorrentPeer};
+use crate::tracker::metrics::TrackerRequest;
 use crate::tracker::statistics::TrackerStatisticsEvent;
 use crate::tracker::tracker::TorrentTracker;
 
@@ -36,96 +37,123 @@ pub async fn authenticate(info_hash: &InfoHash, auth_key: &Option<AuthKey>, trac
 
 /// Handle announce request
 pub async fn handle_announce(announce_request: AnnounceRequest, auth_key: Option<AuthKey>, tracker: Arc<TorrentTracker>) -> WebResult<impl Reply> {
-    if let Err(e) = authenticate(&announce_request.info_hash, &auth_key, tracker.clone()).await {
-        return Err(reject::custom(e));
+    match announce(announce_request, auth_key, tracker).await {
+        Ok(body) => Ok(Response::new(body)),
+        Err(e) => Err(reject::custom(e))
+    }
+}
+
+/// Handle scrape request
+pub async fn handle_scrape(scrape_request: ScrapeRequest, auth_key: Option<AuthKey>, tracker: Arc<TorrentTracker>) -> WebResult<impl Reply> {
+    match scrape(scrape_request, auth_key, tracker).await {
+        Ok(body) => Ok(Response::new(body)),
+        Err(e) => Err(reject::custom(e))
     }
+}
+
+/// Announce and return the bencoded response body, shared by the warp routes and the hyper service
+pub async fn announce(announce_request: AnnounceRequest, auth_key: Option<AuthKey>, tracker: Arc<TorrentTracker>) -> Result<Bytes, ServerError> {
+    let start_time = tracker.metrics().now();
+
+    authenticate(&announce_request.info_hash, &auth_key, tracker.clone()).await?;
 
     debug!("{:?}", announce_request);
 
     let peer = TorrentPeer::from_http_announce_request(&announce_request, announce_request.peer_addr, tracker.config.get_ext_ip());
-    let torrent_stats = tracker.update_torrent_with_peer_and_get_stats(&announce_request.info_hash, &peer).await;
-
-    // get all torrent peers excluding the peer_addr
-    let peers = tracker.get_torrent_peers(&announce_request.info_hash, &peer.peer_addr).await;
 
     let announce_interval = tracker.config.announce_interval;
+    let min_announce_interval = tracker.config.min_announce_interval;
+
+    // get torrent peers excluding the peer_addr
+    let response = if let Some(1) = announce_request.compact {
+        // peers are only picked from the client's ip family, so one buffer sized for numwant holds them all
+        let max_peers_length = tracker.get_numwant(announce_request.numwant) * compact_addr_len(&peer.peer_addr);
+        let mut response = CompactAnnounceResponse::new(peer.peer_addr.is_ipv6(), max_peers_length);
+
+        let torrent_stats = tracker.update_torrent_with_peer_and_get_compact_peers(&announce_request.info_hash, &peer, announce_request.numwant, |compact_peers| {
+            response.write_peer(compact_peers);
+        }).await;
+
+        response.finish(announce_interval, min_announce_interval, torrent_stats.seeders, torrent_stats.leechers)
+            .map_err(|_| ServerError::InternalServerError)
+    } else {
+        let mut peers: Vec<Peer> = Vec::new();
+
+        let torrent_stats = tracker.update_torrent_with_peer_and_get_peers(&announce_request.info_hash, &peer, announce_request.numwant, |peer_id, compact_addr| {
+            if let Some(peer_addr) = socket_addr_from_compact(compact_addr) {
+                peers.push(Peer {
+                    peer_id: peer_id.to_string(),
+                    ip: peer_addr.ip(),
+                    port: peer_addr.port(),
+                })
+            }
+        }).await;
+
+        write_announce_response(torrent_stats, peers, announce_interval, min_announce_interval).map(Bytes::from)
+    };
 
     // send stats event
     match announce_request.peer_addr {
-        IpAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp4Announce).await; }
-        IpAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp6Announce).await; }
+        IpAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp4Announce); }
+        IpAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp6Announce); }
     }
 
-    send_announce_response(&announce_request, torrent_stats, peers, announce_interval, tracker.config.min_announce_interval)
+    tracker.metrics().observe_request(TrackerRequest::HttpAnnounce, start_time);
+
+    response
 }
 
-/// Handle scrape request
-pub async fn handle_scrape(scrape_request: ScrapeRequest, auth_key: Option<AuthKey>, tracker: Arc<TorrentTracker>) -> WebResult<impl Reply> {
-    let mut files: HashMap<InfoHash, ScrapeResponseEntry> = HashMap::new();
-    let db = tracker.get_torrents().await;
-
-    for info_hash in scrape_request.info_hashes.iter() {
-        let scrape_entry = match db.get(&info_hash) {
-            Some(torrent_info) => {
-                if authenticate(info_hash, &auth_key, tracker.clone()).await.is_ok() {
-                    let (seeders, completed, leechers) = torrent_info.get_stats();
-                    ScrapeResponseEntry { complete: seeders, downloaded: completed, incomplete: leechers }
-                } else {
-                    ScrapeResponseEntry { complete: 0, downloaded: 0, incomplete: 0 }
-                }
-            }
-            None => {
-                ScrapeResponseEntry { complete: 0, downloaded: 0, incomplete: 0 }
-            }
+/// Scrape and return the bencoded response body, shared by the warp routes and the hyper service
+pub async fn scrape(scrape_request: ScrapeRequest, auth_key: Option<AuthKey>, tracker: Arc<TorrentTracker>) -> Result<Vec<u8>, ServerError> {
+    let start_time = tracker.metrics().now();
+
+    // the response lists every torrent once, in info hash order
+    let mut info_hashes = scrape_request.info_hashes.clone();
+    info_hashes.sort_unstable();
+    info_hashes.dedup();
+
+    let torrents_stats = tracker.scrape_torrents(&info_hashes, &auth_key).await;
+
+    let files = info_hashes.into_iter().zip(torrents_stats).map(|(info_hash, torrent_stats)| {
+        let scrape_entry = match torrent_stats {
+            Some(stats) => ScrapeResponseEntry { complete: stats.seeders, downloaded: stats.completed, incomplete: stats.leechers },
+            None => ScrapeResponseEntry { complete: 0, downloaded: 0, incomplete: 0 }
         };
 
-        files.insert(info_hash.clone(), scrape_entry);
-    }
+        (info_hash, scrape_entry)
+    }).collect();
 
     // send stats event
     match scrape_request.peer_addr {
-        IpAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp4Scrape).await; }
-        IpAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp6Scrape).await; }
+        IpAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp4Scrape); }
+        IpAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Tcp6Scrape); }
     }
 
-    send_scrape_response(files)
-}
+    let response = write_scrape_response(files);
 
-/// Send announce response
-fn send_announce_response(announce_request: &AnnounceRequest, torrent_stats: TorrentStats, peers: Vec<TorrentPeer>, interval: u32, interval_min: u32) -> WebResult<impl Reply> {
-    let http_peers: Vec<Peer> = peers.iter().map(|peer| Peer {
-        peer_id: peer.peer_id.to_string(),
-        ip: peer.peer_addr.ip(),
-        port: peer.peer_addr.port(),
-    }).collect();
+    tracker.metrics().observe_request(TrackerRequest::HttpScrape, start_time);
 
+    response
+}
+
+/// Write announce response
+fn write_announce_response(torrent_stats: TorrentStats, peers: Vec<Peer>, interval: u32, interval_min: u32) -> Result<Vec<u8>, ServerError> {
     let res = AnnounceResponse {
         interval,
         interval_min,
         complete: torrent_stats.seeders,
         incomplete: torrent_stats.leechers,
-        peers: http_peers,
+        peers,
     };
 
-    // check for compact response request
-    if let Some(1) = announce_request.compact {
-        match res.write_compact() {
-            Ok(body) => Ok(Response::new(body)),
-            Err(_) => Err(reject::custom(ServerError::InternalServerError))
-        }
-    } else {
-        Ok(Response::new(res.write().into()))
-    }
+    Ok(res.write().into())
 }
 
-/// Send scrape response
-fn send_scrape_response(files: HashMap<InfoHash, ScrapeResponseEntry>) -> WebResult<impl Reply> {
+/// Write scrape response
+fn write_scrape_response(files: Vec<(InfoHash, ScrapeResponseEntry)>) -> Result<Vec<u8>, ServerError> {
     let res = ScrapeResponse { files };
 
-    match res.write() {
-        Ok(body) => Ok(Response::new(body)),
-        Err(_) => Err(reject::custom(ServerError::InternalServerError))
-    }
+    res.write().map_err(|_| ServerError::InternalServerError)
 }
 
 /// Handle all server errors and send error reply
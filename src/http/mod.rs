@@ -13,6 +13,7 @@ pub mod errors;
 pub mod routes;
 pub mod handlers;
 pub mod filters;
+pub mod service;
 
 pub type Bytes = u64;
 pub type WebResult<T> = std::result::Result<T, warp::Rejection>;
@@ -1,20 +1,9 @@
 use std::net::IpAddr;
 
-use serde::Deserialize;
+use aquatic_udp_protocol::AnnounceEvent;
 
-use crate::{InfoHash, PeerId};
-use crate::http::Bytes;
-
-#[derive(Deserialize)]
-pub struct AnnounceRequestQuery {
-    pub downloaded: Option<Bytes>,
-    pub uploaded: Option<Bytes>,
-    pub key: Option<String>,
-    pub port: u16,
-    pub left: Option<Bytes>,
-    pub event: Option<String>,
-    pub compact: Option<u8>,
-}
+use crate::{InfoHash, MAX_SCRAPE_TORRENTS, PeerId};
+use crate::http::{Bytes, ServerError};
 
 #[derive(Debug)]
 pub struct AnnounceRequest {
@@ -25,11 +14,180 @@ pub struct AnnounceRequest {
     pub peer_id: PeerId,
     pub port: u16,
     pub left: Bytes,
-    pub event: Option<String>,
+    pub event: AnnounceEvent,
     pub compact: Option<u8>,
+    pub numwant: Option<u32>,
+}
+
+impl AnnounceRequest {
+    // Parses the raw query string in a single pass. info_hash and peer_id are percent-decoded
+    // straight into their 20 byte arrays, the first valid info_hash is used.
+    pub fn from_query(raw_query: &str, peer_addr: IpAddr) -> Result<AnnounceRequest, ServerError> {
+        let mut info_hash: Option<InfoHash> = None;
+        let mut peer_id: Option<PeerId> = None;
+        let mut port: Option<u16> = None;
+        let mut downloaded: Bytes = 0;
+        let mut uploaded: Bytes = 0;
+        let mut left: Bytes = 0;
+        let mut event = AnnounceEvent::None;
+        let mut compact: Option<u8> = None;
+        let mut numwant: Option<u32> = None;
+
+        for (key, value) in query_pairs(raw_query) {
+            match key {
+                "info_hash" => if info_hash.is_none() { info_hash = percent_decode_20_bytes(value).map(InfoHash); },
+                "peer_id" => if peer_id.is_none() { peer_id = Some(PeerId(percent_decode_20_bytes(value).ok_or(ServerError::InvalidPeerId)?)); },
+                "port" => port = Some(parse_number(value)?),
+                "downloaded" => downloaded = parse_number(value)?,
+                "uploaded" => uploaded = parse_number(value)?,
+                "left" => left = parse_number(value)?,
+                "event" => event = parse_event(value),
+                "compact" => compact = Some(parse_number(value)?),
+                "numwant" => numwant = parse_numwant(value),
+                _ => {}
+            }
+        }
+
+        Ok(AnnounceRequest {
+            info_hash: info_hash.ok_or(ServerError::InvalidInfoHash)?,
+            peer_addr,
+            downloaded,
+            uploaded,
+            peer_id: peer_id.ok_or(ServerError::InvalidPeerId)?,
+            port: port.ok_or(ServerError::InvalidQuery)?,
+            left,
+            event,
+            compact,
+            numwant,
+        })
+    }
 }
 
 pub struct ScrapeRequest {
     pub info_hashes: Vec<InfoHash>,
     pub peer_addr: IpAddr,
 }
+
+impl ScrapeRequest {
+    // Invalid info hashes are skipped, but at least one valid info hash is required
+    pub fn from_query(raw_query: &str, peer_addr: IpAddr) -> Result<ScrapeRequest, ServerError> {
+        let mut info_hashes: Vec<InfoHash> = Vec::new();
+
+        for (key, value) in query_pairs(raw_query) {
+            if key != "info_hash" { continue; }
+
+            if let Some(info_hash) = percent_decode_20_bytes(value) {
+                if info_hashes.len() == MAX_SCRAPE_TORRENTS as usize {
+                    return Err(ServerError::ExceededInfoHashLimit);
+                }
+
+                info_hashes.push(InfoHash(info_hash));
+            }
+        }
+
+        if info_hashes.is_empty() { return Err(ServerError::InvalidInfoHash); }
+
+        Ok(ScrapeRequest {
+            info_hashes,
+            peer_addr,
+        })
+    }
+}
+
+fn query_pairs(raw_query: &str) -> impl Iterator<Item=(&str, &str)> {
+    raw_query.split('&').filter_map(|pair| pair.split_once('='))
+}
+
+// None unless the value decodes to exactly 20 bytes
+fn percent_decode_20_bytes(value: &str) -> Option<[u8; 20]> {
+    let mut bytes = [0u8; 20];
+    let mut len = 0;
+
+    for byte in percent_encoding::percent_decode_str(value) {
+        if len == bytes.len() { return None; }
+        bytes[len] = byte;
+        len += 1;
+    }
+
+    if len == bytes.len() { Some(bytes) } else { None }
+}
+
+fn parse_number<T: std::str::FromStr>(value: &str) -> Result<T, ServerError> {
+    value.parse().map_err(|_| ServerError::InvalidQuery)
+}
+
+// Unknown events are regular announces, like a missing one
+fn parse_event(value: &str) -> AnnounceEvent {
+    match value {
+        "started" => AnnounceEvent::Started,
+        "stopped" => AnnounceEvent::Stopped,
+        "completed" => AnnounceEvent::Completed,
+        _ => AnnounceEvent::None
+    }
+}
+
+// Clients send numwant=-1 and worse, so like a UDP peers_wanted <= 0 a bad, negative or zero numwant
+// leaves it to the tracker, and numbers too big for a u32 are clamped. get_numwant caps it anyway.
+fn parse_numwant(value: &str) -> Option<u32> {
+    match value.parse::<i64>() {
+        Ok(numwant) if numwant > 0 => Some(numwant.min(u32::MAX as i64) as u32),
+        Ok(_) => None,
+        Err(_) if !value.is_empty() && value.bytes().all(|byte| byte.is_ascii_digit()) => Some(u32::MAX),
+        Err(_) => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr};
+
+    use aquatic_udp_protocol::AnnounceEvent;
+
+    use crate::http::{AnnounceRequest, ScrapeRequest};
+
+    const PEER_ADDR: IpAddr = IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1));
+
+    #[test]
+    fn announce_query_is_parsed_in_one_pass() {
+        let raw_query = "info_hash=%3B%24U%04%CF%5F%11%BB%DB%E1%20%1C%EAjk%F4Z%EE%1B%C0&peer_id=-qB00000000000000001\
+            &port=17548&uploaded=1&downloaded=2&left=3&event=started&compact=1&numwant=50&key=abc";
+
+        let announce_request = AnnounceRequest::from_query(raw_query, PEER_ADDR).unwrap();
+
+        assert_eq!(announce_request.info_hash.to_string(), "3b245504cf5f11bbdbe1201cea6a6bf45aee1bc0");
+        assert_eq!(&announce_request.peer_id.0, b"-qB00000000000000001");
+        assert_eq!(announce_request.port, 17548);
+        assert_eq!((announce_request.uploaded, announce_request.downloaded, announce_request.left), (1, 2, 3));
+        assert_eq!(announce_request.event, AnnounceEvent::Started);
+        assert_eq!(announce_request.compact, Some(1));
+        assert_eq!(announce_request.numwant, Some(50));
+    }
+
+    #[test]
+    fn announce_query_needs_a_20_byte_peer_id_and_a_port() {
+        let info_hash = "info_hash=%3B%24U%04%CF%5F%11%BB%DB%E1%20%1C%EAjk%F4Z%EE%1B%C0";
+
+        assert!(AnnounceRequest::from_query(&format!("{}&peer_id=short&port=1", info_hash), PEER_ADDR).is_err());
+        assert!(AnnounceRequest::from_query(&format!("{}&peer_id=-qB00000000000000001", info_hash), PEER_ADDR).is_err());
+    }
+
+    #[test]
+    fn announce_query_numwant_is_parsed_leniently() {
+        let query = "info_hash=%3B%24U%04%CF%5F%11%BB%DB%E1%20%1C%EAjk%F4Z%EE%1B%C0&peer_id=-qB00000000000000001&port=1";
+        let numwant = |value: &str| AnnounceRequest::from_query(&format!("{}&numwant={}", query, value), PEER_ADDR).unwrap().numwant;
+
+        assert_eq!(numwant("-1"), None);
+        assert_eq!(numwant("0"), None);
+        assert_eq!(numwant("lots"), None);
+        assert_eq!(numwant("4294967296"), Some(u32::MAX));
+        assert_eq!(numwant("99999999999999999999999"), Some(u32::MAX));
+    }
+
+    #[test]
+    fn scrape_query_skips_invalid_info_hashes() {
+        let raw_query = "info_hash=%3B%24U%04%CF%5F%11%BB%DB%E1%20%1C%EAjk%F4Z%EE%1B%C0&info_hash=tooshort";
+
+        assert_eq!(ScrapeRequest::from_query(raw_query, PEER_ADDR).unwrap().info_hashes.len(), 1);
+        assert!(ScrapeRequest::from_query("info_hash=tooshort", PEER_ADDR).is_err());
+    }
+}
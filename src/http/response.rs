@@ -1,10 +1,10 @@
-use std::collections::HashMap;
 use std::error::Error;
-use std::io::Write;
+use std::io::{Cursor, Write};
 use std::net::IpAddr;
 
 use serde;
 use serde::Serialize;
+use warp::hyper::body::Bytes;
 use crate::InfoHash;
 
 #[derive(Serialize)]
@@ -29,44 +29,57 @@ impl AnnounceResponse {
     pub fn write(&self) -> String {
         serde_bencode::to_string(&self).unwrap()
     }
+}
+
+// BEP 23 / BEP 7 response built in one buffer: the compact peers of the client's ip family are
+// appended as they are picked, behind room for the keys and counts in front of them, which are
+// only known once the peers are. The finished body starts wherever its header does.
+pub struct CompactAnnounceResponse {
+    bytes: Vec<u8>,
+    ipv6: bool,
+}
 
-    pub fn write_compact(&self) -> Result<Vec<u8>, Box<dyn Error>> {
-        let mut peers_v4: Vec<u8> = Vec::new();
-        let mut peers_v6: Vec<u8> = Vec::new();
-
-        for peer in &self.peers {
-            match peer.ip {
-                IpAddr::V4(ip) => {
-                    peers_v4.write(&u32::from(ip).to_be_bytes())?;
-                    peers_v4.write(&peer.port.to_be_bytes())?;
-                }
-                IpAddr::V6(ip) => {
-                    peers_v6.write(&u128::from(ip).to_be_bytes())?;
-                    peers_v6.write(&peer.port.to_be_bytes())?;
-                }
-            }
+impl CompactAnnounceResponse {
+    // room for the keys and the integers in front of the peer string
+    const MAX_HEADER_LENGTH: usize = 160;
+    const TRAILER_LENGTH: usize = 11;
+
+    pub fn new(ipv6: bool, max_peers_length: usize) -> CompactAnnounceResponse {
+        let mut bytes: Vec<u8> = Vec::with_capacity(Self::MAX_HEADER_LENGTH + max_peers_length + Self::TRAILER_LENGTH);
+        bytes.resize(Self::MAX_HEADER_LENGTH, 0);
+
+        CompactAnnounceResponse {
+            bytes,
+            ipv6,
         }
+    }
 
-        let mut bytes: Vec<u8> = Vec::new();
-        bytes.write(b"d8:intervali")?;
-        bytes.write(&self.interval.to_string().as_bytes())?;
-        bytes.write(b"e12:min intervali")?;
-        bytes.write(&self.interval_min.to_string().as_bytes())?;
-        bytes.write(b"e8:completei")?;
-        bytes.write(&self.complete.to_string().as_bytes())?;
-        bytes.write(b"e10:incompletei")?;
-        bytes.write(&self.incomplete.to_string().as_bytes())?;
-        bytes.write(b"e5:peers")?;
-        bytes.write(&peers_v4.len().to_string().as_bytes())?;
-        bytes.write(b":")?;
-        bytes.write(peers_v4.as_slice())?;
-        bytes.write(b"e6:peers6")?;
-        bytes.write(&peers_v6.len().to_string().as_bytes())?;
-        bytes.write(b":")?;
-        bytes.write(peers_v6.as_slice())?;
-        bytes.write(b"e")?;
+    // Appends one compact address, or a run of them copied out of a swarm's cached compact peer string
+    pub fn write_peer(&mut self, compact_addrs: &[u8]) {
+        self.bytes.extend_from_slice(compact_addrs);
+    }
 
-        Ok(bytes)
+    pub fn finish(mut self, interval: u32, interval_min: u32, complete: u32, incomplete: u32) -> Result<Bytes, Box<dyn Error>> {
+        let peers_length = self.bytes.len() - Self::MAX_HEADER_LENGTH;
+        let mut header = Cursor::new([0u8; Self::MAX_HEADER_LENGTH]);
+
+        write!(header, "d8:intervali{}e12:min intervali{}e", interval, interval_min)?;
+        write!(header, "8:completei{}e10:incompletei{}e", complete, incomplete)?;
+        match self.ipv6 {
+            true => write!(header, "5:peers0:6:peers6{}:", peers_length)?,
+            false => write!(header, "5:peers{}:", peers_length)?
+        }
+
+        let header_length = header.position() as usize;
+        let start = Self::MAX_HEADER_LENGTH - header_length;
+        self.bytes[start..Self::MAX_HEADER_LENGTH].copy_from_slice(&header.get_ref()[..header_length]);
+
+        match self.ipv6 {
+            true => self.bytes.push(b'e'),
+            false => self.bytes.extend_from_slice(b"6:peers60:e")
+        }
+
+        Ok(Bytes::from(self.bytes).slice(start..))
     }
 }
 
@@ -77,27 +90,23 @@ pub struct ScrapeResponseEntry {
     pub incomplete: u32,
 }
 
+// `files` in info hash order without duplicates, the key order bencoded dictionaries require
 #[derive(Serialize)]
 pub struct ScrapeResponse {
-    pub files: HashMap<InfoHash, ScrapeResponseEntry>,
+    pub files: Vec<(InfoHash, ScrapeResponseEntry)>,
 }
 
 impl ScrapeResponse {
     pub fn write(&self) -> Result<Vec<u8>, Box<dyn Error>> {
-        let mut bytes: Vec<u8> = Vec::new();
+        // "20:" + info hash + "d8:completei" ... "ee" takes at most 104 bytes per file
+        let mut bytes: Vec<u8> = Vec::with_capacity(11 + self.files.len() * 104);
 
         bytes.write(b"d5:filesd")?;
 
         for (info_hash, scrape_response_entry) in self.files.iter() {
             bytes.write(b"20:")?;
             bytes.write(&info_hash.0)?;
-            bytes.write(b"d8:completei")?;
-            bytes.write(scrape_response_entry.complete.to_string().as_bytes())?;
-            bytes.write(b"e10:downloadedi")?;
-            bytes.write(scrape_response_entry.downloaded.to_string().as_bytes())?;
-            bytes.write(b"e10:incompletei")?;
-            bytes.write(scrape_response_entry.incomplete.to_string().as_bytes())?;
-            bytes.write(b"ee")?;
+            write!(bytes, "d8:completei{}e10:downloadedi{}e10:incompletei{}ee", scrape_response_entry.complete, scrape_response_entry.downloaded, scrape_response_entry.incomplete)?;
         }
 
         bytes.write(b"ee")?;
@@ -117,3 +126,23 @@ impl ErrorResponse {
         serde_bencode::to_string(&self).unwrap()
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use crate::http::CompactAnnounceResponse;
+
+    #[test]
+    fn compact_announce_response_is_bencoded() {
+        let mut response = CompactAnnounceResponse::new(false, 6);
+        response.write_peer(&[126, 0, 0, 1, 0x1f, 0x90]);
+
+        let mut expected = b"d8:intervali120e12:min intervali60e8:completei1e10:incompletei2e5:peers6:".to_vec();
+        expected.extend_from_slice(&[126, 0, 0, 1, 0x1f, 0x90]);
+        expected.extend_from_slice(b"6:peers60:e");
+
+        assert_eq!(&response.finish(120, 60, 1, 2).unwrap()[..], &expected[..]);
+
+        let response = CompactAnnounceResponse::new(true, 18);
+        assert_eq!(&response.finish(4294967295, 60, 0, 0).unwrap()[..], &b"d8:intervali4294967295e12:min intervali60e8:completei0e10:incompletei0e5:peers0:6:peers60:e"[..]);
+    }
+}
@@ -8,6 +8,7 @@ use crate::http::handle_scrape;
 use crate::http::send_error;
 use crate::http::with_announce_request;
 use crate::http::with_auth_key;
+use crate::http::with_rate_limit;
 use crate::http::with_scrape_request;
 use crate::http::with_tracker;
 use crate::tracker::tracker::TorrentTracker;
@@ -23,6 +24,7 @@ pub fn routes(tracker: Arc<TorrentTracker>) -> impl Filter<Extract=impl warp::Re
 fn announce(tracker: Arc<TorrentTracker>) -> impl Filter<Extract=impl warp::Reply, Error=Rejection> + Clone {
     warp::path::path("announce")
         .and(warp::filters::method::get())
+        .and(with_rate_limit(tracker.clone()))
         .and(with_announce_request(tracker.config.on_reverse_proxy))
         .and(with_auth_key())
         .and(with_tracker(tracker))
@@ -33,6 +35,7 @@ fn announce(tracker: Arc<TorrentTracker>) -> impl Filter<Extract=impl warp::Repl
 fn scrape(tracker: Arc<TorrentTracker>) -> impl Filter<Extract=impl warp::Reply, Error=Rejection> + Clone {
     warp::path::path("scrape")
         .and(warp::filters::method::get())
+        .and(with_rate_limit(tracker.clone()))
         .and(with_scrape_request(tracker.config.on_reverse_proxy))
         .and(with_auth_key())
         .and(with_tracker(tracker))
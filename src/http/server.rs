@@ -1,7 +1,7 @@
 use std::net::SocketAddr;
 use std::sync::Arc;
 
-use crate::http::routes;
+use crate::http::{routes, service};
 use crate::tracker::tracker::TorrentTracker;
 
 /// Server that listens on HTTP, needs a TorrentTracker
@@ -17,19 +17,12 @@ impl HttpServer {
         }
     }
 
-    /// Start the HttpServer
-    pub fn start(&self, socket_addr: SocketAddr) -> impl warp::Future<Output = ()> {
-        let (_addr, server) = warp::serve(routes(self.tracker.clone()))
-            .bind_with_graceful_shutdown(socket_addr, async move {
-                tokio::signal::ctrl_c()
-                    .await
-                    .expect("Failed to listen to shutdown signal.");
-            });
-
-        server
+    /// Start the HttpServer, announce and scrape are served by the hyper service
+    pub async fn start(&self, socket_addr: SocketAddr) {
+        service::serve(self.tracker.clone(), socket_addr).await
     }
 
-    /// Start the HttpServer in TLS mode
+    /// Start the HttpServer in TLS mode, on the warp routes which carry the TLS support
     pub fn start_tls(&self, socket_addr: SocketAddr, ssl_cert_path: String, ssl_key_path: String) -> impl warp::Future<Output = ()> {
         let (_addr, server) = warp::serve(routes(self.tracker.clone()))
             .tls()
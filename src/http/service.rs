@@ -0,0 +1,261 @@
+use std::convert::Infallible;
+use std::io::Write;
+use std::net::SocketAddr;
+use std::sync::Arc;
+
+use log::{debug, error};
+use warp::hyper::{Body, Method, Request, Response, Server, StatusCode};
+use warp::hyper::header::HeaderValue;
+use warp::hyper::server::conn::AddrStream;
+use warp::hyper::service::{make_service_fn, service_fn};
+
+use crate::http::{announce, AnnounceRequest, resolve_peer_addr, scrape, ScrapeRequest, ServerError};
+use crate::tracker::key::AuthKey;
+use crate::tracker::tracker::TorrentTracker;
+
+const NOT_FOUND_BODY: &[u8] = b"d14:failure reason9:not founde";
+
+// Announce and scrape served by hyper directly: the request is routed on its path, the client checked
+// against the rate limit and the query parsed once, and every error is answered with a bencoded failure
+// reason right away, without the filter chains and rejection handling of the warp routes.
+pub async fn serve(tracker: Arc<TorrentTracker>, socket_addr: SocketAddr) {
+    let make_service = make_service_fn(move |connection: &AddrStream| {
+        let tracker = tracker.clone();
+        let remote_addr = connection.remote_addr();
+
+        async move {
+            Ok::<_, Infallible>(service_fn(move |request| handle_request(request, remote_addr, tracker.clone())))
+        }
+    });
+
+    let builder = match Server::try_bind(&socket_addr) {
+        Ok(builder) => builder,
+        Err(e) => {
+            error!("Could not bind HTTP tracker on {}: {}", socket_addr, e);
+            return;
+        }
+    };
+
+    // clients and proxies reuse their connections for the next announce, pipelined responses
+    // are written out together
+    let server = builder
+        .http1_only(true)
+        .http1_keepalive(true)
+        .http1_pipeline_flush(true)
+        .tcp_nodelay(true)
+        .serve(make_service)
+        .with_graceful_shutdown(async move {
+            tokio::signal::ctrl_c()
+                .await
+                .expect("Failed to listen to shutdown signal.");
+        });
+
+    if let Err(e) = server.await {
+        error!("HTTP tracker on {} stopped: {}", socket_addr, e);
+    }
+}
+
+async fn handle_request(request: Request<Body>, remote_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> Result<Response<Body>, Infallible> {
+    if request.method() != Method::GET { return Ok(not_found()); }
+
+    // /announce, /scrape or either followed by /<key>
+    let path = request.uri().path().trim_start_matches('/');
+    let (endpoint, key) = match path.split_once('/') {
+        Some((endpoint, key)) => (endpoint, Some(key)),
+        None => (path, None)
+    };
+
+    if endpoint != "announce" && endpoint != "scrape" { return Ok(not_found()); }
+
+    let x_forwarded_for = request.headers().get("X-Forwarded-For").and_then(|value| value.to_str().ok());
+
+    let peer_addr = match resolve_peer_addr(tracker.config.on_reverse_proxy, Some(remote_addr), x_forwarded_for) {
+        Ok(peer_addr) => peer_addr,
+        Err(e) => return Ok(failure(e))
+    };
+
+    if !tracker.check_rate_limit(peer_addr) {
+        return Ok(failure(ServerError::RateLimited(tracker.config.min_announce_interval)));
+    }
+
+    let auth_key = key.and_then(AuthKey::from_string);
+    let raw_query = request.uri().query().unwrap_or("");
+
+    let result = match endpoint {
+        "announce" => match AnnounceRequest::from_query(raw_query, peer_addr) {
+            Ok(announce_request) => announce(announce_request, auth_key, tracker).await.map(Body::from),
+            Err(e) => Err(e)
+        },
+        _ => match ScrapeRequest::from_query(raw_query, peer_addr) {
+            Ok(scrape_request) => scrape(scrape_request, auth_key, tracker).await.map(Body::from),
+            Err(e) => Err(e)
+        }
+    };
+
+    match result {
+        Ok(body) => Ok(Response::new(body)),
+        Err(e) => Ok(failure(e))
+    }
+}
+
+fn not_found() -> Response<Body> {
+    let mut response = Response::new(Body::from(NOT_FOUND_BODY));
+    *response.status_mut() = StatusCode::NOT_FOUND;
+    response
+}
+
+// Trackers answer errors with status 200 and a bencoded failure reason (BEP 3)
+fn failure(e: ServerError) -> Response<Body> {
+    debug!("{:?}", e);
+
+    let body = match static_failure_body(&e) {
+        Some(body) => Body::from(body),
+        None => {
+            let failure_reason = e.to_string();
+            let mut body: Vec<u8> = Vec::with_capacity(24 + failure_reason.len());
+            let _ = write!(body, "d14:failure reason{}:{}e", failure_reason.len(), failure_reason);
+            Body::from(body)
+        }
+    };
+
+    let mut response = Response::new(body);
+    response.headers_mut().insert("Content-Type", HeaderValue::from_static("text/plain"));
+    response
+}
+
+// The encoded failure of every error without a value, so answering them formats nothing
+fn static_failure_body(e: &ServerError) -> Option<&'static [u8]> {
+    let body: &'static [u8] = match e {
+        ServerError::InternalServerError => b"d14:failure reason21:internal server errore",
+        ServerError::InvalidInfoHash => b"d14:failure reason38:info_hash is either missing or invalide",
+        ServerError::InvalidPeerId => b"d14:failure reason36:peer_id is either missing or invalide",
+        ServerError::AddressNotFound => b"d14:failure reason29:could not find remote addresse",
+        ServerError::NoPeersFound => b"d14:failure reason20:torrent has no peerse",
+        ServerError::TorrentNotWhitelisted => b"d14:failure reason24:torrent not on whiteliste",
+        ServerError::PeerNotAuthenticated => b"d14:failure reason22:peer not authenticatede",
+        ServerError::PeerKeyNotValid => b"d14:failure reason26:invalid authentication keye",
+        ServerError::ExceededInfoHashLimit => b"d14:failure reason24:exceeded info_hash limite",
+        ServerError::InvalidQuery => b"d14:failure reason20:invalid query stringe",
+        ServerError::RateLimited(_) => return None,
+    };
+
+    Some(body)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+    use std::sync::Arc;
+
+    use warp::hyper::{Body, Request, StatusCode};
+    use warp::hyper::body::to_bytes;
+
+    use crate::Configuration;
+    use crate::http::ServerError;
+    use crate::mode::TrackerMode;
+    use crate::tracker::tracker::TorrentTracker;
+
+    use super::{handle_request, static_failure_body};
+
+    const INFO_HASH: &str = "%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA%AA";
+
+    fn tracker(configure: impl FnOnce(&mut Configuration)) -> Arc<TorrentTracker> {
+        let mut config = Configuration::default();
+        // one connection, every pooled in-memory database is a database of its own
+        config.db_path = String::from(":memory:");
+        config.db_pool_size = 1;
+        configure(&mut config);
+        Arc::new(TorrentTracker::new(Arc::new(config)).unwrap())
+    }
+
+    async fn get(tracker: &Arc<TorrentTracker>, uri: &str, x_forwarded_for: Option<&str>) -> (StatusCode, Vec<u8>) {
+        let mut request = Request::get(uri);
+        if let Some(x_forwarded_for) = x_forwarded_for {
+            request = request.header("X-Forwarded-For", x_forwarded_for);
+        }
+
+        let remote_addr = SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 50000);
+        let response = handle_request(request.body(Body::empty()).unwrap(), remote_addr, tracker.clone()).await.unwrap();
+        let status = response.status();
+
+        (status, to_bytes(response.into_body()).await.unwrap().to_vec())
+    }
+
+    fn announce_uri(path: &str, peer_id: &str, port: u16) -> String {
+        format!("{}?info_hash={}&peer_id={}&port={}&left=0&compact=1", path, INFO_HASH, peer_id, port)
+    }
+
+    #[tokio::test]
+    async fn requests_are_routed_on_their_path() {
+        let tracker = tracker(|_| {});
+
+        let (status, body) = get(&tracker, &announce_uri("/announce", "-qB0000-000000000001", 6881), None).await;
+        assert_eq!(status, StatusCode::OK);
+        assert!(body.starts_with(b"d8:interval"));
+
+        let (status, body) = get(&tracker, &format!("/scrape?info_hash={}", INFO_HASH), None).await;
+        assert_eq!(status, StatusCode::OK);
+        assert!(body.starts_with(b"d5:files"));
+
+        let (status, body) = get(&tracker, "/stats", None).await;
+        assert_eq!(status, StatusCode::NOT_FOUND);
+        assert_eq!(body, b"d14:failure reason9:not founde");
+    }
+
+    #[tokio::test]
+    async fn the_key_is_taken_from_the_path() {
+        let tracker = tracker(|config| config.mode = TrackerMode::Private);
+        let auth_key = tracker.generate_auth_key(60).await.unwrap();
+
+        let (_, body) = get(&tracker, &announce_uri("/announce", "-qB0000-000000000001", 6881), None).await;
+        assert_eq!(body, b"d14:failure reason22:peer not authenticatede");
+
+        let (_, body) = get(&tracker, &announce_uri(&format!("/announce/{}", auth_key.key), "-qB0000-000000000001", 6881), None).await;
+        assert!(body.starts_with(b"d8:interval"));
+    }
+
+    #[tokio::test]
+    async fn errors_are_answered_with_a_bencoded_failure_reason() {
+        let tracker = tracker(|_| {});
+
+        let (status, body) = get(&tracker, "/announce?peer_id=-qB0000-000000000001&port=6881", None).await;
+        assert_eq!(status, StatusCode::OK);
+        assert_eq!(body, b"d14:failure reason38:info_hash is either missing or invalide");
+
+        for e in [ServerError::InternalServerError, ServerError::InvalidInfoHash, ServerError::InvalidPeerId, ServerError::AddressNotFound,
+                  ServerError::NoPeersFound, ServerError::TorrentNotWhitelisted, ServerError::PeerNotAuthenticated, ServerError::PeerKeyNotValid,
+                  ServerError::ExceededInfoHashLimit, ServerError::InvalidQuery] {
+            let failure_reason = e.to_string();
+            let expected = format!("d14:failure reason{}:{}e", failure_reason.len(), failure_reason);
+            assert_eq!(static_failure_body(&e), Some(expected.as_bytes()));
+        }
+    }
+
+    #[tokio::test]
+    async fn peers_behind_a_reverse_proxy_are_the_last_forwarded_address() {
+        let tracker = tracker(|config| config.on_reverse_proxy = true);
+
+        let (_, body) = get(&tracker, &announce_uri("/announce", "-qB0000-000000000001", 6881), None).await;
+        assert_eq!(body, b"d14:failure reason29:could not find remote addresse");
+
+        get(&tracker, &announce_uri("/announce", "-qB0000-000000000001", 6881), Some("10.0.0.1, 126.0.0.2")).await;
+        let (_, body) = get(&tracker, &announce_uri("/announce", "-qB0000-000000000002", 6882), Some("126.0.0.3")).await;
+
+        // the first peer, as its compact address
+        assert!(body.windows(6).any(|peer| peer == [126, 0, 0, 2, 0x1a, 0xe1]));
+    }
+
+    #[tokio::test]
+    async fn limited_clients_are_told_when_to_come_back() {
+        let tracker = tracker(|config| {
+            config.rate_limit_per_second = 1;
+            config.rate_limit_burst = 1;
+        });
+
+        get(&tracker, &announce_uri("/announce", "-qB0000-000000000001", 6881), None).await;
+        let (status, body) = get(&tracker, &announce_uri("/announce", "-qB0000-000000000001", 6881), None).await;
+
+        assert_eq!(status, StatusCode::OK);
+        assert_eq!(body, b"d14:failure reason53:too many requests, announce at most every 120 secondse");
+    }
+}
@@ -0,0 +1,183 @@
+use log::{debug, info, warn};
+use tokio::fs::{File, OpenOptions};
+use tokio::io::AsyncWriteExt;
+use tokio::net::{TcpStream, UdpSocket};
+use tokio::sync::mpsc::Receiver;
+use tokio::task::JoinHandle;
+
+use crate::Configuration;
+use crate::protocol::utils::current_time;
+use crate::tracker::announce_events::{ANNOUNCE_EVENT_SIZE, AnnounceEventSink, EncodedAnnounceEvent};
+
+// events taken off the buffer per write
+const EXPORT_BATCH_EVENTS: usize = 1024;
+// events per UDP datagram, keeps a datagram within a 1500 byte MTU
+const DATAGRAM_EVENTS: usize = 15;
+
+// Writes the announce events queued by the trackers to the sink, in batches of whatever is
+// waiting. Events still queued on shutdown are written before the job stops.
+pub fn start_job(config: &Configuration, mut receiver: Receiver<EncodedAnnounceEvent>, sink: AnnounceEventSink) -> JoinHandle<()> {
+    let rotate_bytes = config.announce_export_rotate_bytes;
+
+    tokio::spawn(async move {
+        let mut writer = SinkWriter::new(sink, rotate_bytes);
+        let mut batch: Vec<u8> = Vec::with_capacity(EXPORT_BATCH_EVENTS * ANNOUNCE_EVENT_SIZE);
+
+        loop {
+            tokio::select! {
+                _ = tokio::signal::ctrl_c() => {
+                    info!("Stopping announce export job..");
+                    while let Ok(event) = receiver.try_recv() {
+                        batch.extend_from_slice(&event);
+                        if batch.len() >= EXPORT_BATCH_EVENTS * ANNOUNCE_EVENT_SIZE { writer.write(&mut batch).await; }
+                    }
+                    writer.write(&mut batch).await;
+                    writer.flush().await;
+                    break;
+                }
+                event = receiver.recv() => {
+                    match event {
+                        Some(event) => batch.extend_from_slice(&event),
+                        // the tracker is gone
+                        None => break
+                    }
+
+                    while batch.len() < EXPORT_BATCH_EVENTS * ANNOUNCE_EVENT_SIZE {
+                        match receiver.try_recv() {
+                            Ok(event) => batch.extend_from_slice(&event),
+                            Err(_) => break
+                        }
+                    }
+
+                    writer.write(&mut batch).await;
+                }
+            }
+        }
+    })
+}
+
+enum Connection {
+    Closed,
+    Udp(UdpSocket),
+    Tcp(TcpStream),
+    File(File, u64),
+}
+
+// Opens its connection or file on the first write and again after a failure.
+// A batch that can't be written is dropped, like events the buffer had no room for.
+struct SinkWriter {
+    sink: AnnounceEventSink,
+    rotate_bytes: u64,
+    connection: Connection,
+}
+
+impl SinkWriter {
+    fn new(sink: AnnounceEventSink, rotate_bytes: u64) -> SinkWriter {
+        SinkWriter {
+            sink,
+            rotate_bytes,
+            connection: Connection::Closed,
+        }
+    }
+
+    async fn write(&mut self, batch: &mut Vec<u8>) {
+        if batch.is_empty() { return; }
+
+        if let Connection::Closed = self.connection {
+            match self.open().await {
+                Ok(connection) => self.connection = connection,
+                Err(e) => {
+                    warn!("Could not open announce export sink {:?}: {}", self.sink, e);
+                    batch.clear();
+                    return;
+                }
+            }
+        }
+
+        let result = match &mut self.connection {
+            Connection::Closed => Ok(()),
+            Connection::Udp(socket) => {
+                let mut result = Ok(());
+                for datagram in batch.chunks(DATAGRAM_EVENTS * ANNOUNCE_EVENT_SIZE) {
+                    if let Err(e) = socket.send(datagram).await {
+                        result = Err(e);
+                        break;
+                    }
+                }
+                result
+            }
+            Connection::Tcp(stream) => stream.write_all(batch).await,
+            Connection::File(file, written) => {
+                let result = file.write_all(batch).await;
+                *written += batch.len() as u64;
+                result
+            }
+        };
+
+        batch.clear();
+
+        if let Err(e) = result {
+            debug!("Could not write announce events to {:?}: {}", self.sink, e);
+            self.connection = Connection::Closed;
+            return;
+        }
+
+        let rotate = match &self.connection {
+            Connection::File(_, written) => self.rotate_bytes > 0 && *written >= self.rotate_bytes,
+            _ => false
+        };
+
+        if rotate { self.rotate().await; }
+    }
+
+    async fn flush(&mut self) {
+        if let Connection::File(file, _) = &mut self.connection {
+            let _ = file.flush().await;
+        }
+    }
+
+    async fn open(&self) -> std::io::Result<Connection> {
+        match &self.sink {
+            AnnounceEventSink::Udp(address) => {
+                let socket = UdpSocket::bind(if address.starts_with('[') { "[::]:0" } else { "0.0.0.0:0" }).await?;
+                socket.connect(address).await?;
+                Ok(Connection::Udp(socket))
+            }
+            AnnounceEventSink::Tcp(address) => {
+                let stream = TcpStream::connect(address).await?;
+                stream.set_nodelay(true)?;
+                Ok(Connection::Tcp(stream))
+            }
+            AnnounceEventSink::File(path) => {
+                let file = OpenOptions::new().create(true).append(true).open(path).await?;
+                let written = file.metadata().await?.len();
+                Ok(Connection::File(file, written))
+            }
+        }
+    }
+
+    // Moves the full file aside, the next write starts a new one
+    async fn rotate(&mut self) {
+        let path = match &self.sink {
+            AnnounceEventSink::File(path) => path.clone(),
+            _ => return
+        };
+
+        self.flush().await;
+        self.connection = Connection::Closed;
+
+        // a second rotation within the same second gets a sequence number instead of replacing the first
+        let time = current_time();
+        let mut rotated_path = format!("{}.{}", path, time);
+        let mut sequence = 1;
+        while tokio::fs::metadata(&rotated_path).await.is_ok() {
+            rotated_path = format!("{}.{}.{}", path, time, sequence);
+            sequence += 1;
+        }
+
+        match tokio::fs::rename(&path, &rotated_path).await {
+            Ok(_) => info!("Rotated announce export file to: {}", rotated_path),
+            Err(e) => warn!("Could not rotate announce export file {}: {}", path, e)
+        }
+    }
+}
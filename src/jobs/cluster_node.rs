@@ -0,0 +1,39 @@
+use std::net::{IpAddr, SocketAddr};
+use std::sync::Arc;
+use log::{error, info, warn};
+use tokio::task::JoinHandle;
+use crate::ClusterConfig;
+use crate::cluster::server::ClusterServer;
+use crate::tracker::tracker::TorrentTracker;
+
+pub fn start_job(config: &ClusterConfig, tracker: Arc<TorrentTracker>) -> JoinHandle<()> {
+    // the cluster port writes straight into the swarms, it can't be open to anyone
+    if config.secret.is_empty() && !is_private_address(&config.bind_address) {
+        panic!("Cluster bind_address {} is not a private or loopback address, set a cluster secret.", config.bind_address);
+    }
+
+    let bind_addr = config.bind_address.clone();
+    let secret = config.secret.clone();
+
+    tokio::spawn(async move {
+        match ClusterServer::new(tracker, &bind_addr, &secret).await {
+            Ok(cluster_server) => {
+                info!("Starting cluster node on: {}", bind_addr);
+                cluster_server.start().await;
+            }
+            Err(e) => {
+                warn!("Could not start cluster node on: {}", bind_addr);
+                error!("{}", e);
+            }
+        }
+    })
+}
+
+// Binds to a loopback, private (RFC 1918), unique local or link local address, not a host name or all interfaces
+fn is_private_address(bind_address: &str) -> bool {
+    match bind_address.parse::<SocketAddr>().map(|socket_addr| socket_addr.ip()) {
+        Ok(IpAddr::V4(ip)) => ip.is_loopback() || ip.is_private() || ip.is_link_local(),
+        Ok(IpAddr::V6(ip)) => ip.is_loopback() || (ip.segments()[0] & 0xfe00) == 0xfc00 || (ip.segments()[0] & 0xffc0) == 0xfe80,
+        Err(_) => false
+    }
+}
@@ -1,4 +1,8 @@
 pub mod torrent_cleanup;
+pub mod torrent_persistence;
+pub mod swarm_snapshot;
 pub mod tracker_api;
 pub mod http_tracker;
 pub mod udp_tracker;
+pub mod cluster_node;
+pub mod announce_export;
@@ -0,0 +1,46 @@
+use std::sync::Arc;
+use log::{info, warn};
+use tokio::task::JoinHandle;
+use crate::{Configuration};
+use crate::tracker::tracker::TorrentTracker;
+
+// Saves on every interval (if it is not 0) and once more on shutdown
+pub fn start_job(config: &Configuration, tracker: Arc<TorrentTracker>, path: String) -> JoinHandle<()> {
+    let weak_tracker = std::sync::Arc::downgrade(&tracker);
+    let periodic = config.swarm_snapshot_interval > 0;
+    let interval = config.swarm_snapshot_interval.max(1);
+
+    tokio::spawn(async move {
+        let interval = std::time::Duration::from_secs(interval);
+        let mut interval = tokio::time::interval(interval);
+        interval.tick().await;
+
+        loop {
+            tokio::select! {
+                _ = tokio::signal::ctrl_c() => {
+                    info!("Stopping swarm snapshot job..");
+                    if let Some(tracker) = weak_tracker.upgrade() {
+                        save(&tracker, &path).await;
+                    }
+                    break;
+                }
+                _ = interval.tick(), if periodic => {
+                    if let Some(tracker) = weak_tracker.upgrade() {
+                        save(&tracker, &path).await;
+                    } else {
+                        break;
+                    }
+                }
+            }
+        }
+    })
+}
+
+async fn save(tracker: &TorrentTracker, path: &str) {
+    let start_time = std::time::Instant::now();
+
+    match tracker.save_swarm_snapshot(path).await {
+        Ok(torrents) => info!("Saved {} torrents to swarm snapshot {} in {}ms", torrents, path, start_time.elapsed().as_millis()),
+        Err(e) => warn!("Could not save swarm snapshot {}: {}", path, e)
+    }
+}
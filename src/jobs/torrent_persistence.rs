@@ -0,0 +1,73 @@
+use std::sync::Arc;
+use log::{debug, info, warn};
+use tokio::task::JoinHandle;
+use crate::{Configuration, InfoHash};
+use crate::protocol::hashing::KeyHashMap;
+use crate::tracker::tracker::TorrentTracker;
+
+pub fn start_job(config: &Configuration, tracker: Arc<TorrentTracker>) -> JoinHandle<()> {
+    let weak_tracker = std::sync::Arc::downgrade(&tracker);
+    let interval = config.persistence_flush_interval.max(1);
+    let mut completed_receiver = tracker.take_completed_receiver().expect("Torrent persistence job can only be started once.");
+
+    tokio::spawn(async move {
+        let interval = std::time::Duration::from_secs(interval);
+        let mut interval = tokio::time::interval(interval);
+        interval.tick().await;
+
+        // latest completed counter per torrent, since the last flush
+        let mut pending: KeyHashMap<InfoHash, u32> = KeyHashMap::default();
+        // updates received since the last flush, subtracted from the backlog metric once they are written
+        let mut received: u64 = 0;
+
+        loop {
+            tokio::select! {
+                _ = tokio::signal::ctrl_c() => {
+                    info!("Stopping torrent persistence job..");
+                    while let Ok((info_hash, completed)) = completed_receiver.try_recv() {
+                        merge(&mut pending, info_hash, completed);
+                        received += 1;
+                    }
+                    if let Some(tracker) = weak_tracker.upgrade() {
+                        flush(&tracker, &mut pending, &mut received).await;
+                    }
+                    break;
+                }
+                Some((info_hash, completed)) = completed_receiver.recv() => {
+                    merge(&mut pending, info_hash, completed);
+                    received += 1;
+                }
+                _ = interval.tick() => {
+                    if let Some(tracker) = weak_tracker.upgrade() {
+                        flush(&tracker, &mut pending, &mut received).await;
+                    } else {
+                        break;
+                    }
+                }
+            }
+        }
+    })
+}
+
+// Completed counters only grow, so the highest one seen is the one to write
+fn merge(pending: &mut KeyHashMap<InfoHash, u32>, info_hash: InfoHash, completed: u32) {
+    let pending_completed = pending.entry(info_hash).or_insert(0);
+    *pending_completed = completed.max(*pending_completed);
+}
+
+// Failed batches stay pending and are retried on the next tick
+async fn flush(tracker: &TorrentTracker, pending: &mut KeyHashMap<InfoHash, u32>, received: &mut u64) {
+    if pending.is_empty() { return; }
+
+    let torrents: Vec<(InfoHash, u32)> = pending.iter().map(|(info_hash, completed)| (info_hash.clone(), *completed)).collect();
+
+    match tracker.save_persistent_torrents(&torrents).await {
+        Ok(_) => {
+            debug!("Saved {} torrents to the database", torrents.len());
+            pending.clear();
+            tracker.metrics().persistence_backlog.sub(*received);
+            *received = 0;
+        }
+        Err(e) => warn!("Could not save {} torrents to the database: {}", torrents.len(), e)
+    }
+}
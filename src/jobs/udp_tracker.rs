@@ -6,11 +6,12 @@ use crate::tracker::tracker::TorrentTracker;
 
 pub fn start_job(config: &UdpTrackerConfig, tracker: Arc<TorrentTracker>) -> JoinHandle<()> {
     let bind_addr = config.bind_address.clone();
+    let workers = config.workers;
 
     tokio::spawn(async move {
-        match UdpServer::new(tracker, &bind_addr).await {
+        match UdpServer::new(tracker, &bind_addr, workers).await {
             Ok(udp_server) => {
-                info!("Starting UDP server on: {}", bind_addr);
+                info!("Starting UDP server on: {} ({} workers)", bind_addr, workers);
                 udp_server.start().await;
             }
             Err(e) => {
@@ -12,7 +12,9 @@ pub mod logging;
 pub mod udp;
 pub mod http;
 pub mod setup;
+pub mod runtime;
 pub mod databases;
 pub mod jobs;
 pub mod api;
 pub mod protocol;
+pub mod cluster;
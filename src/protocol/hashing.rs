@@ -0,0 +1,106 @@
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::hash::{BuildHasher, Hasher};
+use std::sync::OnceLock;
+
+// multiplier of the folded multiply, the fractional part of pi
+const MULTIPLE: u64 = 0x243f_6a88_85a3_08d3;
+
+// Maps keyed by info hashes, peer ids and auth keys
+pub type KeyHashMap<K, V> = HashMap<K, V, KeyHashState>;
+
+// Hashing for the tracker's fixed size byte keys: the key is folded in eight bytes at a time with
+// one wide multiply each, four rounds for a 20 byte id and its length, where SipHash runs its
+// rounds for every word and three more to finish.
+// The ids are chosen by clients, so every hash starts from a seed picked at startup, which keeps
+// them from aiming a swarm's peers at the same buckets.
+#[derive(Clone, Copy)]
+pub struct KeyHashState {
+    seed: u64,
+}
+
+impl Default for KeyHashState {
+    fn default() -> Self {
+        static SEED: OnceLock<u64> = OnceLock::new();
+
+        KeyHashState {
+            seed: *SEED.get_or_init(rand::random),
+        }
+    }
+}
+
+impl BuildHasher for KeyHashState {
+    type Hasher = KeyHasher;
+
+    fn build_hasher(&self) -> KeyHasher {
+        KeyHasher {
+            hash: self.seed,
+        }
+    }
+}
+
+pub struct KeyHasher {
+    hash: u64,
+}
+
+impl KeyHasher {
+    fn fold(&mut self, word: u64) {
+        let product = (self.hash ^ word) as u128 * MULTIPLE as u128;
+        self.hash = product as u64 ^ (product >> 64) as u64;
+    }
+}
+
+impl Hasher for KeyHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        let mut words = bytes.chunks_exact(8);
+
+        for word in &mut words {
+            self.fold(u64::from_le_bytes(word.try_into().unwrap()));
+        }
+
+        let rest = words.remainder();
+        if !rest.is_empty() {
+            let mut word = [0u8; 8];
+            word[..rest.len()].copy_from_slice(rest);
+            self.fold(u64::from_le_bytes(word));
+        }
+    }
+
+    fn write_usize(&mut self, value: usize) {
+        self.fold(value as u64);
+    }
+
+    fn finish(&self) -> u64 {
+        self.hash
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::hash::{BuildHasher, Hash, Hasher};
+
+    use super::*;
+
+    fn hash<T: Hash>(state: &KeyHashState, value: &T) -> u64 {
+        let mut hasher = state.build_hasher();
+        value.hash(&mut hasher);
+        hasher.finish()
+    }
+
+    #[test]
+    fn ids_differing_in_any_byte_hash_apart() {
+        let state = KeyHashState::default();
+        let id = [0u8; 20];
+        let mut hashes: Vec<u64> = vec![hash(&state, &id)];
+
+        for byte in 0..20 {
+            let mut other = id;
+            other[byte] = 1;
+            hashes.push(hash(&state, &other));
+        }
+
+        hashes.sort_unstable();
+        hashes.dedup();
+        assert_eq!(hashes.len(), 21);
+    }
+}
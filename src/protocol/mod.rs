@@ -1,2 +1,4 @@
 pub mod common;
 pub mod utils;
+pub mod rate_limiter;
+pub mod hashing;
@@ -0,0 +1,115 @@
+use std::collections::HashMap;
+use std::net::IpAddr;
+use std::sync::Mutex;
+use std::time::Instant;
+
+const SHARD_COUNT: usize = 64;
+// buckets per shard before idle ones are evicted, bounds the memory a flood of addresses can take
+const MAX_BUCKETS_PER_SHARD: usize = 16 * 1024;
+
+struct Bucket {
+    tokens: f32,
+    // milliseconds since the limiter was created
+    updated: u64,
+}
+
+// Token bucket per client network: every ipv4 address or ipv6 prefix may make `burst` requests at once,
+// refilled at `per_second` requests per second. The buckets are sharded like the torrents,
+// so clients on different shards never wait on each other.
+pub struct RateLimiter {
+    shards: Vec<Mutex<HashMap<u128, Bucket>>>,
+    per_millisecond: f32,
+    burst: f32,
+    ipv4_mask: u32,
+    ipv6_mask: u128,
+    start: Instant,
+}
+
+impl RateLimiter {
+    pub fn new(per_second: u32, burst: u32, ipv4_prefix: u8, ipv6_prefix: u8) -> RateLimiter {
+        RateLimiter {
+            shards: (0..SHARD_COUNT).map(|_| Mutex::new(HashMap::new())).collect(),
+            per_millisecond: per_second as f32 / 1000.0,
+            burst: burst.max(1) as f32,
+            ipv4_mask: u32::MAX.checked_shl(32 - ipv4_prefix.min(32) as u32).unwrap_or(0),
+            ipv6_mask: u128::MAX.checked_shl(128 - ipv6_prefix.min(128) as u32).unwrap_or(0),
+            start: Instant::now(),
+        }
+    }
+
+    // Takes a token from the client's bucket, false if it has none left
+    pub fn check(&self, ip: IpAddr) -> bool {
+        let key = self.key(ip);
+        let now = self.start.elapsed().as_millis() as u64;
+
+        let mut buckets = self.shards[shard_index(key)].lock().unwrap();
+
+        if buckets.len() >= MAX_BUCKETS_PER_SHARD && !buckets.contains_key(&key) {
+            self.evict_idle(&mut buckets, now);
+        }
+
+        let bucket = buckets.entry(key).or_insert(Bucket { tokens: self.burst, updated: now });
+
+        bucket.tokens = self.refilled(bucket, now);
+        bucket.updated = now;
+
+        if bucket.tokens >= 1.0 {
+            bucket.tokens -= 1.0;
+            true
+        } else {
+            false
+        }
+    }
+
+    fn refilled(&self, bucket: &Bucket, now: u64) -> f32 {
+        (bucket.tokens + now.saturating_sub(bucket.updated) as f32 * self.per_millisecond).min(self.burst)
+    }
+
+    // Full buckets behave like new ones, so they can go. If every client is still limited, start over.
+    fn evict_idle(&self, buckets: &mut HashMap<u128, Bucket>, now: u64) {
+        buckets.retain(|_, bucket| self.refilled(bucket, now) < self.burst);
+
+        if buckets.len() >= MAX_BUCKETS_PER_SHARD { buckets.clear(); }
+    }
+
+    // ipv4 and ipv4 mapped ipv6 addresses share the ipv4 mapped space
+    fn key(&self, ip: IpAddr) -> u128 {
+        match ip.to_canonical() {
+            IpAddr::V4(ip) => 0xffff_0000_0000 | (u32::from(ip) & self.ipv4_mask) as u128,
+            IpAddr::V6(ip) => u128::from(ip) & self.ipv6_mask,
+        }
+    }
+}
+
+fn shard_index(key: u128) -> usize {
+    let folded = (key as u64) ^ ((key >> 64) as u64);
+    (folded.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> 58) as usize % SHARD_COUNT
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr, Ipv6Addr};
+
+    use crate::protocol::rate_limiter::RateLimiter;
+
+    #[test]
+    fn clients_are_limited_to_their_burst() {
+        let rate_limiter = RateLimiter::new(1, 3, 32, 64);
+        let client = IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1));
+
+        assert_eq!((0..5).filter(|_| rate_limiter.check(client)).count(), 3);
+        assert!(rate_limiter.check(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 2))));
+    }
+
+    #[test]
+    fn networks_share_a_bucket() {
+        let rate_limiter = RateLimiter::new(1, 1, 24, 64);
+
+        assert!(rate_limiter.check(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1))));
+        assert!(!rate_limiter.check(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 2))));
+        assert!(!rate_limiter.check(IpAddr::V6(Ipv4Addr::new(126, 0, 0, 3).to_ipv6_mapped())));
+
+        assert!(rate_limiter.check(IpAddr::V6(Ipv6Addr::new(0x2001, 0xdb8, 0, 0, 0, 0, 0, 1))));
+        assert!(!rate_limiter.check(IpAddr::V6(Ipv6Addr::new(0x2001, 0xdb8, 0, 0, 1, 0, 0, 1))));
+    }
+}
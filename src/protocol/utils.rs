@@ -1,13 +1,88 @@
-use std::net::SocketAddr;
-use std::time::SystemTime;
+use std::hash::Hasher;
+use std::net::{IpAddr, SocketAddr};
+use std::sync::OnceLock;
+use std::time::{Duration, Instant, SystemTime};
 
 use aquatic_udp_protocol::ConnectionId;
 
+// A connection id is accepted in the period it was issued in and the next one,
+// so it stays valid for at least one and at most two periods (BEP 15 asks for two minutes)
+const CONNECTION_ID_PERIOD: u64 = 60;
+
+// SipHash keys, derived from the cluster secret so every node accepts the ids of the others,
+// or drawn once per process
+static CONNECTION_ID_KEYS: OnceLock<(u64, u64)> = OnceLock::new();
+
+// Key the connection ids with `secret`, before the first id is issued
+pub fn set_connection_id_secret(secret: &str) {
+    let _ = CONNECTION_ID_KEYS.set(keys_from_secret(secret, "connection id"));
+}
+
+// Connection ids are a keyed hash of the client ip and the current period, so they can be
+// verified without keeping any state and can't be forged for a spoofed source address
 pub fn get_connection_id(remote_address: &SocketAddr) -> ConnectionId {
-    match std::time::SystemTime::now().duration_since(std::time::UNIX_EPOCH) {
-        Ok(duration) => ConnectionId(((duration.as_secs() / 3600) | ((remote_address.port() as u64) << 36)) as i64),
-        Err(_) => ConnectionId(0x7FFFFFFFFFFFFFFF),
-    }
+    connection_id_for_period(remote_address, connection_id_period())
+}
+
+pub fn verify_connection_id(connection_id: ConnectionId, remote_address: &SocketAddr) -> bool {
+    let period = connection_id_period();
+
+    connection_id == connection_id_for_period(remote_address, period)
+        || connection_id == connection_id_for_period(remote_address, period.wrapping_sub(1))
+}
+
+// In wall clock time, which the nodes of a cluster share
+fn connection_id_period() -> u64 {
+    current_time() / CONNECTION_ID_PERIOD
+}
+
+// Hashes the period and the ip as explicit big endian bytes, the ip behind a byte for its family,
+// so every node computes the same id whatever it was built with
+fn connection_id_for_period(remote_address: &SocketAddr, period: u64) -> ConnectionId {
+    let keys = *CONNECTION_ID_KEYS.get_or_init(|| (rand::random(), rand::random()));
+
+    let mut bytes = [0u8; 25];
+    bytes[..8].copy_from_slice(&period.to_be_bytes());
+    let length = match remote_address.ip() {
+        IpAddr::V4(ip) => {
+            bytes[8] = 4;
+            bytes[9..13].copy_from_slice(&ip.octets());
+            13
+        }
+        IpAddr::V6(ip) => {
+            bytes[8] = 6;
+            bytes[9..25].copy_from_slice(&ip.octets());
+            25
+        }
+    };
+
+    ConnectionId(keyed_hash(keys, &bytes[..length]) as i64)
+}
+
+// SipHash-2-4 keys derived from a configured secret, `domain` separates the uses of one secret.
+// Hashes the domain and the secret, each behind its length as a big endian u64, then the key index.
+pub fn keys_from_secret(secret: &str, domain: &str) -> (u64, u64) {
+    let mut bytes: Vec<u8> = Vec::with_capacity(17 + domain.len() + secret.len());
+    bytes.extend_from_slice(&(domain.len() as u64).to_be_bytes());
+    bytes.extend_from_slice(domain.as_bytes());
+    bytes.extend_from_slice(&(secret.len() as u64).to_be_bytes());
+    bytes.extend_from_slice(secret.as_bytes());
+
+    bytes.push(0);
+    let first = keyed_hash((0, 0), &bytes);
+    *bytes.last_mut().unwrap() = 1;
+    let second = keyed_hash((0, 0), &bytes);
+
+    (first, second)
+}
+
+// SipHash-2-4 of the bytes with the given keys. The algorithm is fixed, and the input is written
+// as plain bytes rather than through std's Hash impls, so every node and build gets the same value.
+#[allow(deprecated)]
+pub fn keyed_hash(keys: (u64, u64), bytes: &[u8]) -> u64 {
+    let mut hasher = std::hash::SipHasher::new_with_keys(keys.0, keys.1);
+    hasher.write(bytes);
+    hasher.finish()
 }
 
 pub fn current_time() -> u64 {
@@ -16,6 +91,68 @@ pub fn current_time() -> u64 {
         .as_secs()
 }
 
+// The clock starts this far before the process, so peers restored from a swarm snapshot
+// can be dated back to when they last announced
+const CLOCK_BACKDATE: Duration = Duration::from_secs(24 * 60 * 60);
+
+static CLOCK_START: OnceLock<Instant> = OnceLock::new();
+
+fn clock_start() -> Instant {
+    *CLOCK_START.get_or_init(|| {
+        let now = Instant::now();
+        now.checked_sub(CLOCK_BACKDATE).unwrap_or(now)
+    })
+}
+
+// Coarse monotonic clock, in whole seconds since the tracker's clock started.
+// Fits in a u32 for over a century of uptime.
+pub fn coarse_time() -> u32 {
+    coarse_time_from_instant(Instant::now())
+}
+
+pub fn coarse_time_from_instant(instant: Instant) -> u32 {
+    instant.saturating_duration_since(clock_start()).as_secs() as u32
+}
+
+pub fn instant_from_coarse_time(coarse_time: u32) -> Instant {
+    clock_start() + Duration::from_secs(coarse_time as u64)
+}
+
 pub fn ser_instant<S: serde::Serializer>(inst: &std::time::Instant, ser: S) -> Result<S::Ok, S::Error> {
     ser.serialize_u64(inst.elapsed().as_millis() as u64)
 }
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+
+    use crate::protocol::utils::{get_connection_id, keyed_hash, keys_from_secret, verify_connection_id};
+
+    #[test]
+    fn connection_id_is_bound_to_the_client_ip() {
+        let client = SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 8080);
+        let same_ip_other_port = SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 8081);
+        let spoofed = SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 2)), 8080);
+
+        let connection_id = get_connection_id(&client);
+
+        assert!(verify_connection_id(connection_id, &client));
+        assert!(verify_connection_id(connection_id, &same_ip_other_port));
+        assert!(!verify_connection_id(connection_id, &spoofed));
+    }
+
+    #[test]
+    fn secret_keys_are_the_same_on_every_node() {
+        let keys = keys_from_secret("cluster secret", "connection id");
+
+        assert_eq!(keys, keys_from_secret("cluster secret", "connection id"));
+        assert_ne!(keys, keys_from_secret("cluster secret", "cluster handshake 1"));
+        assert_eq!(keyed_hash(keys, b"nonce"), keyed_hash(keys_from_secret("cluster secret", "connection id"), b"nonce"));
+    }
+
+    #[test]
+    fn keyed_hash_is_siphash_2_4() {
+        // the empty message test vector of the SipHash paper, key 00 01 .. 0f
+        assert_eq!(keyed_hash((0x0706_0504_0302_0100, 0x0f0e_0d0c_0b0a_0908), b""), 0x726f_db47_dd0e_0e31);
+    }
+}
@@ -0,0 +1,87 @@
+use std::io;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+
+use log::warn;
+use tokio::runtime::{Builder, Runtime};
+
+// A runtime of its own for one of the front ends or the background jobs, so announce handling
+// doesn't share worker threads with API scans and cleanups. With `cpu_cores` set, its worker
+// threads are pinned to those cores in turn (Linux only, elsewhere the cores are ignored).
+// The runtime lives as long as the process: it can't be dropped from within another runtime,
+// and what runs on it only stops at shutdown.
+pub fn dedicated_runtime(name: &str, threads: usize, cpu_cores: &[usize]) -> io::Result<&'static Runtime> {
+    let mut builder = Builder::new_multi_thread();
+    builder.worker_threads(threads.max(1)).thread_name(name).enable_all();
+
+    let cpu_cores = usable_cpu_cores(cpu_cores);
+
+    if !cpu_cores.is_empty() {
+        let cpu_cores: Arc<Vec<usize>> = Arc::new(cpu_cores);
+        let next_core = AtomicUsize::new(0);
+
+        // also pins the runtime's blocking threads, they do its file and database work
+        builder.on_thread_start(move || {
+            let core = cpu_cores[next_core.fetch_add(1, Ordering::Relaxed) % cpu_cores.len()];
+            pin_current_thread(core);
+        });
+    }
+
+    Ok(Box::leak(Box::new(builder.build()?)))
+}
+
+// Runtime for `name`, None (to use the main runtime) when `threads` is 0 or it could not be built
+pub fn optional_runtime(name: &str, threads: usize, cpu_cores: &[usize]) -> Option<&'static Runtime> {
+    if threads == 0 { return None; }
+
+    match dedicated_runtime(name, threads, cpu_cores) {
+        Ok(runtime) => Some(runtime),
+        Err(e) => {
+            warn!("Could not start a dedicated runtime for {}, using the main runtime: {}", name, e);
+            None
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn pin_current_thread(core: usize) {
+    let result = unsafe {
+        let mut cpu_set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_ZERO(&mut cpu_set);
+        libc::CPU_SET(core, &mut cpu_set);
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &cpu_set)
+    };
+
+    if result != 0 {
+        warn!("Could not pin thread to cpu core {}: {}", core, io::Error::last_os_error());
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin_current_thread(_core: usize) {}
+
+// The configured cores this process may run on, the others are skipped with a warning
+#[cfg(target_os = "linux")]
+fn usable_cpu_cores(cpu_cores: &[usize]) -> Vec<usize> {
+    let allowed = unsafe {
+        let mut cpu_set: libc::cpu_set_t = std::mem::zeroed();
+        match libc::sched_getaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &mut cpu_set) {
+            0 => Some(cpu_set),
+            _ => None
+        }
+    };
+
+    cpu_cores.iter()
+        .copied()
+        .filter(|&core| {
+            let usable = core < libc::CPU_SETSIZE as usize && allowed.as_ref().map_or(true, |cpu_set| unsafe { libc::CPU_ISSET(core, cpu_set) });
+            if !usable { warn!("Could not pin thread to cpu core {}: not a core this process may run on", core); }
+            usable
+        })
+        .collect()
+}
+
+#[cfg(not(target_os = "linux"))]
+fn usable_cpu_cores(cpu_cores: &[usize]) -> Vec<usize> {
+    cpu_cores.to_vec()
+}
@@ -1,8 +1,12 @@
 use std::sync::Arc;
-use log::{warn};
+use std::io;
+use log::{info, warn};
+use tokio::runtime::Runtime;
 use tokio::task::JoinHandle;
 use crate::{Configuration};
-use crate::jobs::{http_tracker, torrent_cleanup, tracker_api, udp_tracker};
+use crate::runtime::optional_runtime;
+use crate::tracker::announce_events::AnnounceEventSink;
+use crate::jobs::{announce_export, cluster_node, http_tracker, torrent_cleanup, swarm_snapshot, torrent_persistence, tracker_api, udp_tracker};
 use crate::tracker::tracker::TorrentTracker;
 
 pub async fn setup(config: &Configuration, tracker: Arc<TorrentTracker>) -> Vec<JoinHandle<()>>{
@@ -15,35 +19,89 @@ pub async fn setup(config: &Configuration, tracker: Arc<TorrentTracker>) -> Vec<
 
     // Load whitelisted torrents
     if tracker.is_whitelisted() {
-        tracker.load_whitelist().await.expect("Could not load whitelist from database.");
+        match config.get_whitelist_path() {
+            Some(path) => {
+                let torrents = tracker.load_whitelist_file(path).await.expect("Could not load whitelist file.");
+                info!("Whitelisted {} torrents from: {}", torrents, path);
+            }
+            None => tracker.load_whitelist().await.expect("Could not load whitelist from database.")
+        }
+    }
+
+    // Restore torrents and peers from the last swarm snapshot
+    if let Some(path) = config.get_swarm_snapshot_path() {
+        match tracker.load_swarm_snapshot(path).await {
+            Ok(torrents) => info!("Restored {} torrents from swarm snapshot: {}", torrents, path),
+            Err(e) if e.kind() == io::ErrorKind::NotFound => info!("No swarm snapshot found at: {}", path),
+            Err(e) => warn!("Could not restore swarm snapshot {}: {}", path, e),
+        }
+    }
+
+    // Serve the announces and scrapes other cluster nodes forward to this one
+    if config.cluster.enabled {
+        jobs.push(cluster_node::start_job(&config.cluster, tracker.clone()));
     }
 
     // Start the UDP blocks
-    for udp_tracker_config in &config.udp_trackers {
+    for (index, udp_tracker_config) in config.udp_trackers.iter().enumerate() {
         if !udp_tracker_config.enabled { continue; }
 
         if tracker.is_private() {
             warn!("Could not start UDP tracker on: {} while in {:?}. UDP is not safe for private trackers!", udp_tracker_config.bind_address, config.mode);
         } else {
-            jobs.push(udp_tracker::start_job(&udp_tracker_config, tracker.clone()))
+            let runtime = optional_runtime(&format!("udp-tracker-{}", index), udp_tracker_config.threads, &udp_tracker_config.cpu_cores);
+            jobs.push(start_on(runtime, || udp_tracker::start_job(&udp_tracker_config, tracker.clone())));
         }
     }
 
     // Start the HTTP blocks
-    for http_tracker_config in &config.http_trackers {
+    for (index, http_tracker_config) in config.http_trackers.iter().enumerate() {
         if !http_tracker_config.enabled { continue; }
-        jobs.push(http_tracker::start_job(&http_tracker_config, tracker.clone()));
+
+        let runtime = optional_runtime(&format!("http-tracker-{}", index), http_tracker_config.threads, &http_tracker_config.cpu_cores);
+        jobs.push(start_on(runtime, || http_tracker::start_job(&http_tracker_config, tracker.clone())));
     }
 
+    // The API and the jobs below don't have to answer clients, they can run apart from the trackers
+    let background_runtime = optional_runtime("background", config.background_threads, &config.background_cpu_cores);
+
     // Start HTTP API server
     if config.http_api.enabled {
-        jobs.push(tracker_api::start_job(&config, tracker.clone()));
+        jobs.push(start_on(background_runtime, || tracker_api::start_job(&config, tracker.clone())));
+    }
+
+    // Write completed counters to the database, every interval
+    if config.persistent_torrent_completed_stat {
+        jobs.push(start_on(background_runtime, || torrent_persistence::start_job(&config, tracker.clone())));
+    }
+
+    // Save a swarm snapshot every interval and on shutdown
+    if let Some(path) = config.get_swarm_snapshot_path() {
+        jobs.push(start_on(background_runtime, || swarm_snapshot::start_job(&config, tracker.clone(), path.to_owned())));
+    }
+
+    // Write the announces queued by the trackers to the export sink
+    if let Some(sink) = config.get_announce_export_sink() {
+        if let Some(receiver) = tracker.take_announce_event_receiver() {
+            jobs.push(start_on(background_runtime, || announce_export::start_job(&config, receiver, AnnounceEventSink::parse(sink))));
+        }
     }
 
     // Remove torrents without peers, every interval
     if config.inactive_peer_cleanup_interval > 0 {
-        jobs.push(torrent_cleanup::start_job(&config, tracker.clone()));
+        jobs.push(start_on(background_runtime, || torrent_cleanup::start_job(&config, tracker.clone())));
     }
 
     jobs
 }
+
+// Starts a job on `runtime`, or on the current runtime when None. Everything the job spawns stays on its runtime.
+fn start_on<F: FnOnce() -> JoinHandle<()>>(runtime: Option<&'static Runtime>, start_job: F) -> JoinHandle<()> {
+    match runtime {
+        Some(runtime) => {
+            let _guard = runtime.enter();
+            start_job()
+        }
+        None => start_job()
+    }
+}
@@ -0,0 +1,91 @@
+use rand::{Rng, thread_rng};
+
+use crate::peer::{COMPACT_ADDR_LEN_V4, COMPACT_ADDR_LEN_V6};
+use crate::tracker::peer_list::PeerList;
+
+// When and how compact announces of hot swarms are served from a cached compact peer string
+#[derive(Clone, Copy, Debug)]
+pub struct AnnounceCachePolicy {
+    // swarms with fewer peers of the client's ip family are sampled directly, 0 disables the cache
+    pub min_peers: usize,
+    // peers in the cached string, every announce gets a random window of it
+    pub cached_peers: usize,
+    // seconds a string is served for
+    pub ttl: u32,
+    // peers joining or leaving the swarm before a string is rebuilt early
+    pub max_mutations: u32,
+}
+
+impl AnnounceCachePolicy {
+    pub fn is_enabled(&self) -> bool {
+        self.min_peers > 0 && self.cached_peers > 0
+    }
+}
+
+#[derive(Clone, Default)]
+pub struct AnnounceCache {
+    pub v4: CachedPeers<COMPACT_ADDR_LEN_V4>,
+    pub v6: CachedPeers<COMPACT_ADDR_LEN_V6>,
+}
+
+// A random selection of one ip family's peers, encoded once as a single compact peer string
+// (BEP 23 / BEP 7), so announces copy their window of it into the response as it is
+#[derive(Clone, Default)]
+pub struct CachedPeers<const N: usize> {
+    compact_peers: Vec<u8>,
+    built_at: u32,
+    mutations: u32,
+}
+
+impl<const N: usize> CachedPeers<N> {
+    pub fn mutated(&mut self) {
+        self.mutations = self.mutations.saturating_add(1);
+    }
+
+    pub fn invalidate(&mut self) {
+        self.compact_peers.clear();
+    }
+
+    // Frees the string, for swarms that cooled down
+    pub fn release(&mut self) {
+        self.compact_peers = Vec::new();
+    }
+
+    // Passes up to `limit` cached compact addresses to `write_peers` as a few contiguous runs of the string,
+    // starting at a random peer and wrapping around, skipping peers on `client_ip` (the octets of the
+    // client's ip). An expired string is rebuilt from `peer_list` first.
+    pub fn sample<F: FnMut(&[u8])>(&mut self, peer_list: &PeerList<N>, policy: &AnnounceCachePolicy, now: u32, client_ip: &[u8], limit: usize, mut write_peers: F) {
+        if self.compact_peers.is_empty() || now.saturating_sub(self.built_at) >= policy.ttl || self.mutations >= policy.max_mutations {
+            self.compact_peers.clear();
+            for peer in peer_list.sample(policy.cached_peers, None) { self.compact_peers.extend_from_slice(&peer.addr); }
+            self.built_at = now;
+            self.mutations = 0;
+        }
+
+        let peers_len = self.compact_peers.len() / N;
+        let start = if peers_len > limit { thread_rng().gen_range(0..peers_len) } else { 0 };
+        let mut remaining = limit;
+
+        for (from, to) in [(start, peers_len), (0, start)] {
+            let mut index = from;
+
+            while index < to && remaining > 0 {
+                let end = (index + remaining).min(to);
+                let run = &self.compact_peers[index * N..end * N];
+
+                match run.chunks_exact(N).position(|compact_addr| compact_addr[..N - 2] == *client_ip) {
+                    Some(client) => {
+                        if client > 0 { write_peers(&run[..client * N]); }
+                        remaining -= client;
+                        index += client + 1;
+                    }
+                    None => {
+                        write_peers(run);
+                        remaining -= end - index;
+                        index = end;
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,92 @@
+use std::net::IpAddr;
+
+use crate::peer::{event_to_u8, TorrentPeer};
+use crate::protocol::common::InfoHash;
+
+// An exported announce, big endian like BEP 15:
+// unix time (8), info hash (20), peer id (20), ip, v4 mapped for IPv4 peers (16), port (2),
+// event as in BEP 15 (1), reserved (1), uploaded (8), downloaded (8), left (8)
+pub const ANNOUNCE_EVENT_SIZE: usize = 92;
+
+pub type EncodedAnnounceEvent = [u8; ANNOUNCE_EVENT_SIZE];
+
+// Where the export job writes the events to
+#[derive(Debug, PartialEq)]
+pub enum AnnounceEventSink {
+    // datagrams of whole events
+    Udp(String),
+    // one stream of events, reconnected when it breaks
+    Tcp(String),
+    // appended to the file, which is moved aside to `<path>.<unix time>` once it grows past the rotation size
+    File(String),
+}
+
+impl AnnounceEventSink {
+    // `udp://host:port`, `tcp://host:port` or else the path of a file
+    pub fn parse(sink: &str) -> AnnounceEventSink {
+        if let Some(address) = sink.strip_prefix("udp://") {
+            AnnounceEventSink::Udp(address.to_string())
+        } else if let Some(address) = sink.strip_prefix("tcp://") {
+            AnnounceEventSink::Tcp(address.to_string())
+        } else {
+            AnnounceEventSink::File(sink.to_string())
+        }
+    }
+}
+
+pub fn encode(info_hash: &InfoHash, peer: &TorrentPeer, time: u64) -> EncodedAnnounceEvent {
+    let mut event = [0u8; ANNOUNCE_EVENT_SIZE];
+
+    let ip = match peer.peer_addr.ip() {
+        IpAddr::V4(ip) => ip.to_ipv6_mapped(),
+        IpAddr::V6(ip) => ip
+    };
+
+    event[0..8].copy_from_slice(&time.to_be_bytes());
+    event[8..28].copy_from_slice(&info_hash.0);
+    event[28..48].copy_from_slice(&peer.peer_id.0);
+    event[48..64].copy_from_slice(&ip.octets());
+    event[64..66].copy_from_slice(&peer.peer_addr.port().to_be_bytes());
+    event[66] = event_to_u8(peer.event);
+    event[68..76].copy_from_slice(&peer.uploaded.0.to_be_bytes());
+    event[76..84].copy_from_slice(&peer.downloaded.0.to_be_bytes());
+    event[84..92].copy_from_slice(&peer.left.0.to_be_bytes());
+
+    event
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{Ipv4Addr, SocketAddr};
+    use std::time::Instant;
+
+    use aquatic_udp_protocol::{AnnounceEvent, NumberOfBytes};
+
+    use crate::PeerId;
+
+    use super::*;
+
+    #[test]
+    fn ipv4_peers_are_exported_v4_mapped() {
+        let peer = TorrentPeer {
+            peer_id: PeerId([2u8; 20]),
+            peer_addr: SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 6881),
+            updated: Instant::now(),
+            uploaded: NumberOfBytes(1),
+            downloaded: NumberOfBytes(2),
+            left: NumberOfBytes(3),
+            event: AnnounceEvent::Started,
+        };
+
+        let event = encode(&InfoHash([1u8; 20]), &peer, 1_650_000_000);
+
+        assert_eq!(&event[0..8], &1_650_000_000u64.to_be_bytes());
+        assert_eq!(&event[8..28], &[1u8; 20]);
+        assert_eq!(&event[28..48], &[2u8; 20]);
+        assert_eq!(&event[48..64], &[0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 126, 0, 0, 1]);
+        assert_eq!(&event[64..66], &6881u16.to_be_bytes());
+        assert_eq!(event[66], 2);
+        assert_eq!(&event[84..92], &3i64.to_be_bytes());
+        assert_eq!(AnnounceEventSink::parse("udp://127.0.0.1:9000"), AnnounceEventSink::Udp("127.0.0.1:9000".to_string()));
+    }
+}
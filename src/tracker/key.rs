@@ -1,9 +1,13 @@
+use std::convert::TryInto;
+use std::sync::Arc;
+
 use derive_more::{Display, Error};
 use log::debug;
 use rand::{Rng, thread_rng};
 use rand::distributions::Alphanumeric;
 use serde::Serialize;
 
+use crate::protocol::hashing::KeyHashMap;
 use crate::protocol::utils::current_time;
 
 use crate::AUTH_KEY_LENGTH;
@@ -24,9 +28,13 @@ pub fn generate_auth_key(seconds_valid: u64) -> AuthKey {
 }
 
 pub fn verify_auth_key(auth_key: &AuthKey) -> Result<(), Error> {
+    verify_valid_until(auth_key.valid_until)
+}
+
+pub fn verify_valid_until(valid_until: Option<u64>) -> Result<(), Error> {
     let current_time = current_time();
-    if auth_key.valid_until.is_none() { return Err(Error::KeyInvalid); }
-    if auth_key.valid_until.unwrap() < current_time { return Err(Error::KeyExpired); }
+    if valid_until.is_none() { return Err(Error::KeyInvalid); }
+    if valid_until.unwrap() < current_time { return Err(Error::KeyExpired); }
 
     Ok(())
 }
@@ -49,6 +57,11 @@ impl AuthKey {
         }
     }
 
+    // The key as the fixed size array it is stored under, None if it has the wrong length
+    pub fn to_bytes(&self) -> Option<[u8; AUTH_KEY_LENGTH]> {
+        self.key.as_bytes().try_into().ok()
+    }
+
     pub fn from_string(key: &str) -> Option<AuthKey> {
         if key.len() != AUTH_KEY_LENGTH {
             None
@@ -61,6 +74,62 @@ impl AuthKey {
     }
 }
 
+// keys added and removed before they are merged into a new base map
+pub const MAX_KEY_CHANGES: usize = 1024;
+
+// The keys as served, kept like the whitelist: a large immutable base map shared between snapshots,
+// and the keys changed since it was built. A single change copies only those, the base is rebuilt
+// with them once `MAX_KEY_CHANGES` have piled up.
+#[derive(Clone, Default)]
+pub struct AuthKeys {
+    base: Arc<KeyHashMap<[u8; AUTH_KEY_LENGTH], Option<u64>>>,
+    // the expiry of an added key, None for a removed one
+    changes: KeyHashMap<[u8; AUTH_KEY_LENGTH], Option<Option<u64>>>,
+}
+
+impl AuthKeys {
+    pub fn new(base: KeyHashMap<[u8; AUTH_KEY_LENGTH], Option<u64>>) -> AuthKeys {
+        AuthKeys {
+            base: Arc::new(base),
+            changes: KeyHashMap::default(),
+        }
+    }
+
+    // The expiry of the key, None if there is no such key
+    pub fn get(&self, key: &[u8; AUTH_KEY_LENGTH]) -> Option<Option<u64>> {
+        match self.changes.get(key) {
+            Some(change) => *change,
+            None => self.base.get(key).copied()
+        }
+    }
+
+    // keys added or removed since the base was built
+    pub fn changes(&self) -> usize {
+        self.changes.len()
+    }
+
+    // A new snapshot with the keys added, or removed where their expiry is None
+    pub fn with_changes<I: IntoIterator<Item = ([u8; AUTH_KEY_LENGTH], Option<Option<u64>>)>>(&self, changes: I) -> AuthKeys {
+        let mut keys = self.clone();
+        keys.changes.extend(changes);
+        keys
+    }
+
+    // The same keys with the changes folded into a new base, takes a copy of the whole map
+    pub fn merged(&self) -> AuthKeys {
+        let mut base = KeyHashMap::clone(&self.base);
+
+        for (key, change) in &self.changes {
+            match change {
+                Some(valid_until) => base.insert(*key, *valid_until),
+                None => base.remove(key)
+            };
+        }
+
+        Self::new(base)
+    }
+}
+
 #[derive(Debug, Display, PartialEq, Error)]
 #[allow(dead_code)]
 pub enum Error {
@@ -81,6 +150,7 @@ impl From<r2d2_sqlite::rusqlite::Error> for Error {
 
 #[cfg(test)]
 mod tests {
+    use crate::protocol::hashing::KeyHashMap;
     use crate::tracker::key;
 
     #[test]
@@ -110,6 +180,14 @@ mod tests {
         assert_eq!(auth_key.unwrap().key, key_string);
     }
 
+    #[test]
+    fn auth_key_to_bytes() {
+        let auth_key = key::AuthKey::from_string("YZSl4lMZupRuOpSRC3krIKR5BPB14nrJ").unwrap();
+
+        assert_eq!(&auth_key.to_bytes().unwrap(), b"YZSl4lMZupRuOpSRC3krIKR5BPB14nrJ");
+        assert!(key::AuthKey { key: String::from("short"), valid_until: None }.to_bytes().is_none());
+    }
+
     #[test]
     fn generate_valid_auth_key() {
         let auth_key = key::generate_auth_key(9999);
@@ -124,4 +202,22 @@ mod tests {
 
         assert!(key::verify_auth_key(&auth_key).is_err());
     }
+
+    #[test]
+    fn key_changes_are_seen_before_and_after_they_are_merged() {
+        let mut base = KeyHashMap::default();
+        base.insert([1u8; 32], Some(10));
+        base.insert([2u8; 32], None);
+
+        let keys = key::AuthKeys::new(base).with_changes([([3u8; 32], Some(Some(30))), ([1u8; 32], None), ([2u8; 32], Some(Some(20)))]);
+        assert_eq!(keys.changes(), 3);
+
+        for keys in [&keys, &keys.merged()] {
+            assert_eq!(keys.get(&[1u8; 32]), None);
+            assert_eq!(keys.get(&[2u8; 32]), Some(Some(20)));
+            assert_eq!(keys.get(&[3u8; 32]), Some(Some(30)));
+            assert_eq!(keys.get(&[4u8; 32]), None);
+        }
+        assert_eq!(keys.merged().changes(), 0);
+    }
 }
@@ -0,0 +1,284 @@
+use std::fmt::Write;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use crate::tracker::statistics::{SwarmStatistics, TrackerStatistics};
+
+// Upper bounds in seconds, for request handling and lock times
+const FAST_BUCKETS: &[f64] = &[0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1.0];
+// for cleanup passes and database writes
+const SLOW_BUCKETS: &[f64] = &[0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 5.0, 10.0, 30.0, 60.0];
+
+#[derive(Clone, Copy)]
+pub enum TrackerRequest {
+    UdpConnect,
+    UdpAnnounce,
+    UdpScrape,
+    HttpAnnounce,
+    HttpScrape,
+}
+
+impl TrackerRequest {
+    const ALL: [TrackerRequest; 5] = [TrackerRequest::UdpConnect, TrackerRequest::UdpAnnounce, TrackerRequest::UdpScrape, TrackerRequest::HttpAnnounce, TrackerRequest::HttpScrape];
+
+    fn labels(&self) -> &'static str {
+        match self {
+            TrackerRequest::UdpConnect => "protocol=\"udp\",request=\"connect\"",
+            TrackerRequest::UdpAnnounce => "protocol=\"udp\",request=\"announce\"",
+            TrackerRequest::UdpScrape => "protocol=\"udp\",request=\"scrape\"",
+            TrackerRequest::HttpAnnounce => "protocol=\"http\",request=\"announce\"",
+            TrackerRequest::HttpScrape => "protocol=\"http\",request=\"scrape\"",
+        }
+    }
+}
+
+// Cumulative histogram over fixed buckets, recorded with relaxed atomics like the statistics counters
+pub struct Histogram {
+    bounds: &'static [f64],
+    // one per bound and a last one for everything above
+    buckets: Vec<AtomicU64>,
+    sum_nanos: AtomicU64,
+}
+
+impl Histogram {
+    fn new(bounds: &'static [f64]) -> Histogram {
+        Histogram {
+            bounds,
+            buckets: (0..=bounds.len()).map(|_| AtomicU64::new(0)).collect(),
+            sum_nanos: AtomicU64::new(0),
+        }
+    }
+
+    pub fn observe(&self, duration: Duration) {
+        let seconds = duration.as_secs_f64();
+        let index = self.bounds.iter().position(|bound| seconds <= *bound).unwrap_or(self.bounds.len());
+
+        self.buckets[index].fetch_add(1, Ordering::Relaxed);
+        self.sum_nanos.fetch_add(duration.as_nanos() as u64, Ordering::Relaxed);
+    }
+
+    // Records the time since `start`, nothing if metrics are disabled (see `Metrics::now`)
+    pub fn observe_since(&self, start: Option<Instant>) {
+        if let Some(start) = start { self.observe(start.elapsed()); }
+    }
+
+    fn write(&self, out: &mut String, name: &str, labels: &str) {
+        let separator = if labels.is_empty() { "" } else { "," };
+        let mut count = 0;
+
+        for (index, bucket) in self.buckets.iter().enumerate() {
+            count += bucket.load(Ordering::Relaxed);
+
+            match self.bounds.get(index) {
+                Some(bound) => { let _ = writeln!(out, "{}_bucket{{{}{}le=\"{}\"}} {}", name, labels, separator, bound, count); }
+                None => { let _ = writeln!(out, "{}_bucket{{{}{}le=\"+Inf\"}} {}", name, labels, separator, count); }
+            }
+        }
+
+        let sum = self.sum_nanos.load(Ordering::Relaxed) as f64 / 1e9;
+
+        if labels.is_empty() {
+            let _ = writeln!(out, "{}_sum {}", name, sum);
+            let _ = writeln!(out, "{}_count {}", name, count);
+        } else {
+            let _ = writeln!(out, "{}_sum{{{}}} {}", name, labels, sum);
+            let _ = writeln!(out, "{}_count{{{}}} {}", name, labels, count);
+        }
+    }
+}
+
+#[derive(Default)]
+pub struct Gauge(AtomicU64);
+
+impl Gauge {
+    pub fn add(&self, value: u64) {
+        self.0.fetch_add(value, Ordering::Relaxed);
+    }
+
+    pub fn sub(&self, value: u64) {
+        self.0.fetch_sub(value, Ordering::Relaxed);
+    }
+
+    pub fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+// Latency histograms and gauges for the Prometheus /metrics endpoint.
+// Timings are only taken with `tracker_usage_statistics` enabled.
+pub struct Metrics {
+    enabled: bool,
+    requests: [Histogram; 5],
+    pub shard_lock_wait: Histogram,
+    pub shard_lock_hold: Histogram,
+    pub cleanup_duration: Histogram,
+    pub database_write_duration: Histogram,
+    // completed counter updates not written to the database yet
+    pub persistence_backlog: Gauge,
+    pub udp_receive_failures: Gauge,
+    pub rate_limited_requests: Gauge,
+    // UDP announces and scrapes dropped for a connection id not issued to their source address
+    pub invalid_connection_ids: Gauge,
+    // announce events the export buffer had no room for
+    pub announce_events_dropped: Gauge,
+}
+
+impl Metrics {
+    pub fn new(enabled: bool) -> Metrics {
+        Metrics {
+            enabled,
+            requests: TrackerRequest::ALL.map(|_| Histogram::new(FAST_BUCKETS)),
+            shard_lock_wait: Histogram::new(FAST_BUCKETS),
+            shard_lock_hold: Histogram::new(FAST_BUCKETS),
+            cleanup_duration: Histogram::new(SLOW_BUCKETS),
+            database_write_duration: Histogram::new(SLOW_BUCKETS),
+            persistence_backlog: Gauge::default(),
+            udp_receive_failures: Gauge::default(),
+            rate_limited_requests: Gauge::default(),
+            invalid_connection_ids: Gauge::default(),
+            announce_events_dropped: Gauge::default(),
+        }
+    }
+
+    // The start of a timing, None when metrics are disabled so the clock isn't read at all
+    pub fn now(&self) -> Option<Instant> {
+        if self.enabled { Some(Instant::now()) } else { None }
+    }
+
+    pub fn observe_request(&self, request: TrackerRequest, start: Option<Instant>) {
+        self.requests[request as usize].observe_since(start);
+    }
+
+    // Prometheus text exposition format (version 0.0.4)
+    pub fn render(&self, stats: &TrackerStatistics, swarm_stats: &SwarmStatistics) -> String {
+        let mut out = String::with_capacity(16 * 1024);
+
+        write_family(&mut out, "torrust_requests_total", "counter", "Requests handled, by protocol and ip version.");
+        for (labels, value) in [
+            ("protocol=\"tcp4\",request=\"announce\"", stats.tcp4_announces_handled),
+            ("protocol=\"tcp4\",request=\"scrape\"", stats.tcp4_scrapes_handled),
+            ("protocol=\"tcp6\",request=\"announce\"", stats.tcp6_announces_handled),
+            ("protocol=\"tcp6\",request=\"scrape\"", stats.tcp6_scrapes_handled),
+            ("protocol=\"udp4\",request=\"connect\"", stats.udp4_connections_handled),
+            ("protocol=\"udp4\",request=\"announce\"", stats.udp4_announces_handled),
+            ("protocol=\"udp4\",request=\"scrape\"", stats.udp4_scrapes_handled),
+            ("protocol=\"udp6\",request=\"connect\"", stats.udp6_connections_handled),
+            ("protocol=\"udp6\",request=\"announce\"", stats.udp6_announces_handled),
+            ("protocol=\"udp6\",request=\"scrape\"", stats.udp6_scrapes_handled),
+        ] {
+            let _ = writeln!(out, "torrust_requests_total{{{}}} {}", labels, value);
+        }
+
+        write_family(&mut out, "torrust_swarm", "gauge", "Torrents and their peers.");
+        let _ = writeln!(out, "torrust_swarm{{kind=\"torrents\"}} {}", swarm_stats.torrents);
+        let _ = writeln!(out, "torrust_swarm{{kind=\"seeders\"}} {}", swarm_stats.seeders);
+        let _ = writeln!(out, "torrust_swarm{{kind=\"leechers\"}} {}", swarm_stats.leechers);
+        let _ = writeln!(out, "torrust_swarm{{kind=\"completed\"}} {}", swarm_stats.completed);
+
+        write_family(&mut out, "torrust_request_duration_seconds", "histogram", "Time to handle a request, from parsed request to written response.");
+        for request in TrackerRequest::ALL {
+            self.requests[request as usize].write(&mut out, "torrust_request_duration_seconds", request.labels());
+        }
+
+        write_family(&mut out, "torrust_shard_lock_wait_seconds", "histogram", "Time announces wait for a torrent shard write lock.");
+        self.shard_lock_wait.write(&mut out, "torrust_shard_lock_wait_seconds", "");
+
+        write_family(&mut out, "torrust_shard_lock_hold_seconds", "histogram", "Time announces hold a torrent shard write lock.");
+        self.shard_lock_hold.write(&mut out, "torrust_shard_lock_hold_seconds", "");
+
+        write_family(&mut out, "torrust_cleanup_duration_seconds", "histogram", "Time of a full inactive peer and torrent cleanup pass.");
+        self.cleanup_duration.write(&mut out, "torrust_cleanup_duration_seconds", "");
+
+        write_family(&mut out, "torrust_database_write_duration_seconds", "histogram", "Time to write a batch of completed counters to the database.");
+        self.database_write_duration.write(&mut out, "torrust_database_write_duration_seconds", "");
+
+        write_family(&mut out, "torrust_persistence_backlog", "gauge", "Completed counter updates not written to the database yet.");
+        let _ = writeln!(out, "torrust_persistence_backlog {}", self.persistence_backlog.get());
+
+        write_family(&mut out, "torrust_udp_receive_failures_total", "counter", "Failed receive calls on the UDP tracker sockets.");
+        let _ = writeln!(out, "torrust_udp_receive_failures_total {}", self.udp_receive_failures.get());
+
+        write_family(&mut out, "torrust_rate_limited_requests_total", "counter", "Requests rejected or dropped by the per client rate limit.");
+        let _ = writeln!(out, "torrust_rate_limited_requests_total {}", self.rate_limited_requests.get());
+
+        write_family(&mut out, "torrust_udp_invalid_connection_ids_total", "counter", "UDP announces and scrapes dropped for an invalid connection id.");
+        let _ = writeln!(out, "torrust_udp_invalid_connection_ids_total {}", self.invalid_connection_ids.get());
+
+        write_family(&mut out, "torrust_announce_events_dropped_total", "counter", "Announce events dropped because the export buffer was full.");
+        let _ = writeln!(out, "torrust_announce_events_dropped_total {}", self.announce_events_dropped.get());
+
+        if let Some((receive_errors, receive_buffer_errors)) = udp_receive_errors() {
+            write_family(&mut out, "torrust_host_udp_receive_errors_total", "counter", "Datagrams the host's kernel dropped on receive (all sockets, from /proc/net/snmp).");
+            let _ = writeln!(out, "torrust_host_udp_receive_errors_total{{kind=\"in_errors\"}} {}", receive_errors);
+            let _ = writeln!(out, "torrust_host_udp_receive_errors_total{{kind=\"receive_buffer_errors\"}} {}", receive_buffer_errors);
+        }
+
+        out
+    }
+}
+
+fn write_family(out: &mut String, name: &str, kind: &str, help: &str) {
+    let _ = writeln!(out, "# HELP {} {}", name, help);
+    let _ = writeln!(out, "# TYPE {} {}", name, kind);
+}
+
+// InErrors and RcvbufErrors of the Udp line in /proc/net/snmp, which has a header line followed by a value line
+#[cfg(target_os = "linux")]
+fn udp_receive_errors() -> Option<(u64, u64)> {
+    let snmp = std::fs::read_to_string("/proc/net/snmp").ok()?;
+    let mut udp_lines = snmp.lines().filter(|line| line.starts_with("Udp: "));
+
+    let names = udp_lines.next()?.split_whitespace();
+    let values = udp_lines.next()?.split_whitespace();
+
+    let mut in_errors = None;
+    let mut receive_buffer_errors = None;
+
+    for (name, value) in names.zip(values) {
+        match name {
+            "InErrors" => in_errors = value.parse().ok(),
+            "RcvbufErrors" => receive_buffer_errors = value.parse().ok(),
+            _ => {}
+        }
+    }
+
+    Some((in_errors?, receive_buffer_errors?))
+}
+
+#[cfg(not(target_os = "linux"))]
+fn udp_receive_errors() -> Option<(u64, u64)> {
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use crate::tracker::metrics::{Histogram, Metrics, TrackerRequest};
+    use crate::tracker::statistics::{SwarmStatistics, TrackerStatistics};
+
+    #[test]
+    fn histogram_buckets_are_cumulative() {
+        let histogram = Histogram::new(&[0.001, 0.01]);
+
+        histogram.observe(Duration::from_micros(500));
+        histogram.observe(Duration::from_millis(5));
+        histogram.observe(Duration::from_secs(1));
+
+        let mut out = String::new();
+        histogram.write(&mut out, "test", "");
+
+        assert_eq!(out, "test_bucket{le=\"0.001\"} 1\ntest_bucket{le=\"0.01\"} 2\ntest_bucket{le=\"+Inf\"} 3\ntest_sum 1.0055\ntest_count 3\n");
+    }
+
+    #[test]
+    fn disabled_metrics_record_nothing() {
+        let metrics = Metrics::new(false);
+        metrics.observe_request(TrackerRequest::UdpAnnounce, metrics.now());
+
+        let swarm_stats = SwarmStatistics { torrents: 0, seeders: 0, completed: 0, leechers: 0 };
+        let out = metrics.render(&TrackerStatistics::new(), &swarm_stats);
+
+        assert!(out.contains("torrust_request_duration_seconds_count{protocol=\"udp\",request=\"announce\"} 0\n"));
+    }
+}
@@ -1,6 +1,13 @@
 pub mod tracker;
 pub mod statistics;
+pub mod metrics;
 pub mod peer;
+pub mod peer_list;
 pub mod torrent;
+pub mod announce_cache;
+pub mod announce_events;
+pub mod repository;
+pub mod snapshot;
+pub mod whitelist;
 pub mod key;
 pub mod mode;
@@ -0,0 +1,134 @@
+use std::net::IpAddr;
+
+use rand::{Rng, thread_rng};
+
+use crate::PeerId;
+use crate::peer::CompactPeer;
+use crate::protocol::hashing::KeyHashMap;
+
+// Peers of one ip family, packed contiguously with an index by peer id.
+// Removal swaps the last peer into the freed slot, so the vector never has holes
+// and a random window of it can be handed out without scanning the whole swarm.
+#[derive(Clone, Default)]
+pub struct PeerList<const N: usize> {
+    peers: Vec<CompactPeer<N>>,
+    index: KeyHashMap<PeerId, u32>,
+}
+
+impl<const N: usize> PeerList<N> {
+    pub fn len(&self) -> usize {
+        self.peers.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.peers.is_empty()
+    }
+
+    pub fn iter(&self) -> std::slice::Iter<'_, CompactPeer<N>> {
+        self.peers.iter()
+    }
+
+    // Insert or replace a peer, returning the replaced peer
+    pub fn insert(&mut self, peer: CompactPeer<N>) -> Option<CompactPeer<N>> {
+        match self.index.get(&peer.peer_id) {
+            Some(&index) => Some(std::mem::replace(&mut self.peers[index as usize], peer)),
+            None => {
+                self.index.insert(peer.peer_id.clone(), self.peers.len() as u32);
+                self.peers.push(peer);
+                None
+            }
+        }
+    }
+
+    pub fn remove(&mut self, peer_id: &PeerId) -> Option<CompactPeer<N>> {
+        let index = *self.index.get(peer_id)?;
+        Some(self.swap_remove(index as usize))
+    }
+
+    pub fn retain<F: FnMut(&CompactPeer<N>) -> bool>(&mut self, mut keep: F) {
+        let mut index = 0;
+
+        while index < self.peers.len() {
+            if keep(&self.peers[index]) {
+                index += 1;
+            } else {
+                self.swap_remove(index);
+            }
+        }
+    }
+
+    // Up to `limit` peers, starting at a random position and wrapping around.
+    // Peers on `excluded_ip` (the requesting client) are skipped.
+    pub fn sample(&self, limit: usize, excluded_ip: Option<IpAddr>) -> impl Iterator<Item=&CompactPeer<N>> {
+        let start = if self.peers.len() > limit { thread_rng().gen_range(0..self.peers.len()) } else { 0 };
+
+        self.peers[start..].iter()
+            .chain(self.peers[..start].iter())
+            .filter(move |peer| Some(peer.ip()) != excluded_ip)
+            .take(limit)
+    }
+
+    // Removes the peer at `index` and points the index entry of the peer moved into its slot
+    fn swap_remove(&mut self, index: usize) -> CompactPeer<N> {
+        let peer = self.peers.swap_remove(index);
+        self.index.remove(&peer.peer_id);
+
+        if let Some(moved_peer) = self.peers.get(index) {
+            self.index.insert(moved_peer.peer_id.clone(), index as u32);
+        }
+
+        peer
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+
+    use aquatic_udp_protocol::{AnnounceEvent, NumberOfBytes};
+
+    use crate::PeerId;
+    use crate::peer::{CompactPeerV4, TorrentPeer};
+    use crate::tracker::peer_list::PeerList;
+
+    fn peer(id: u8) -> CompactPeerV4 {
+        CompactPeerV4::from_torrent_peer(&TorrentPeer {
+            peer_id: PeerId([id; 20]),
+            peer_addr: SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, id)), 8080),
+            updated: std::time::Instant::now(),
+            uploaded: NumberOfBytes(0),
+            downloaded: NumberOfBytes(0),
+            left: NumberOfBytes(0),
+            event: AnnounceEvent::Started,
+        }).unwrap()
+    }
+
+    #[test]
+    fn removing_a_peer_keeps_the_index_consistent() {
+        let mut peer_list: PeerList<6> = PeerList::default();
+
+        for id in 0..5 { peer_list.insert(peer(id)); }
+
+        assert!(peer_list.remove(&peer(1).peer_id).is_some());
+        let removed_peer_id = peer(3).peer_id;
+        peer_list.retain(|torrent_peer| torrent_peer.peer_id != removed_peer_id);
+
+        assert_eq!(peer_list.len(), 3);
+        for id in [0, 2, 4] {
+            assert!(peer_list.remove(&peer(id).peer_id).is_some());
+        }
+        assert!(peer_list.is_empty());
+    }
+
+    #[test]
+    fn sample_is_bounded_and_skips_the_client() {
+        let mut peer_list: PeerList<6> = PeerList::default();
+
+        for id in 0..100 { peer_list.insert(peer(id)); }
+
+        let client_ip = peer(7).ip();
+
+        assert_eq!(peer_list.sample(10, Some(client_ip)).count(), 10);
+        assert_eq!(peer_list.sample(200, Some(client_ip)).count(), 99);
+    }
+}
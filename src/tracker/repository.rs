@@ -0,0 +1,115 @@
+use std::collections::BTreeMap;
+
+use tokio::sync::{RwLock, RwLockReadGuard, RwLockWriteGuard};
+
+use crate::protocol::common::InfoHash;
+use crate::tracker::torrent::{TorrentEntry, TorrentStats};
+
+const MAX_SHARD_BITS: u32 = 16;
+
+pub type TorrentShard = BTreeMap<InfoHash, TorrentEntry>;
+
+// Torrents split over independently locked shards, so announces for different
+// torrents don't have to wait on each other.
+pub struct TorrentRepository {
+    shards: Vec<RwLock<TorrentShard>>,
+    shard_bits: u32,
+}
+
+impl TorrentRepository {
+    pub fn new(shard_count: usize) -> TorrentRepository {
+        // round up to a power of two, so a shard can be picked from the info hash prefix
+        let shard_bits = (shard_count.max(1).next_power_of_two().trailing_zeros()).min(MAX_SHARD_BITS);
+        let shards = (0..1usize << shard_bits).map(|_| RwLock::new(BTreeMap::new())).collect();
+
+        TorrentRepository {
+            shards,
+            shard_bits,
+        }
+    }
+
+    pub fn shard_count(&self) -> usize {
+        self.shards.len()
+    }
+
+    // Info hashes are SHA-1 output, so their leading bits are uniformly distributed.
+    // Using the leading bits also keeps the shards in info hash order:
+    // every hash in shard n sorts before every hash in shard n + 1.
+    pub fn shard_index(&self, info_hash: &InfoHash) -> usize {
+        let prefix = u32::from_be_bytes([info_hash.0[0], info_hash.0[1], info_hash.0[2], info_hash.0[3]]) as u64;
+        (prefix >> (32 - self.shard_bits)) as usize
+    }
+
+    pub async fn read_shard(&self, index: usize) -> RwLockReadGuard<'_, TorrentShard> {
+        self.shards[index].read().await
+    }
+
+    pub async fn write_shard(&self, index: usize) -> RwLockWriteGuard<'_, TorrentShard> {
+        self.shards[index].write().await
+    }
+
+    pub async fn get_shard(&self, info_hash: &InfoHash) -> RwLockReadGuard<'_, TorrentShard> {
+        self.read_shard(self.shard_index(info_hash)).await
+    }
+
+    pub async fn get_shard_mut(&self, info_hash: &InfoHash) -> RwLockWriteGuard<'_, TorrentShard> {
+        self.write_shard(self.shard_index(info_hash)).await
+    }
+
+    // Stats of every torrent in `info_hashes`, in the same order, None for unknown torrents.
+    // The hashes are grouped by shard, so every shard is read locked once, and only while its counters are read.
+    pub async fn get_torrents_stats(&self, info_hashes: &[InfoHash]) -> Vec<Option<TorrentStats>> {
+        let mut torrents_stats: Vec<Option<TorrentStats>> = info_hashes.iter().map(|_| None).collect();
+
+        let mut by_shard: Vec<(usize, usize)> = info_hashes.iter().enumerate()
+            .map(|(position, info_hash)| (self.shard_index(info_hash), position))
+            .collect();
+        by_shard.sort_unstable();
+
+        for shard_hashes in by_shard.chunk_by(|(a, _), (b, _)| a == b) {
+            let torrents = self.read_shard(shard_hashes[0].0).await;
+
+            for (_, position) in shard_hashes {
+                torrents_stats[*position] = torrents.get(&info_hashes[*position]).map(|torrent_entry| {
+                    let (seeders, completed, leechers) = torrent_entry.get_stats();
+
+                    TorrentStats {
+                        seeders,
+                        leechers,
+                        completed,
+                    }
+                });
+            }
+        }
+
+        torrents_stats
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::protocol::common::InfoHash;
+    use crate::tracker::repository::TorrentRepository;
+
+    #[test]
+    fn shard_count_is_rounded_up_to_a_power_of_two() {
+        assert_eq!(TorrentRepository::new(0).shard_count(), 1);
+        assert_eq!(TorrentRepository::new(1).shard_count(), 1);
+        assert_eq!(TorrentRepository::new(24).shard_count(), 32);
+        assert_eq!(TorrentRepository::new(64).shard_count(), 64);
+    }
+
+    #[test]
+    fn shards_follow_info_hash_order() {
+        let repository = TorrentRepository::new(16);
+
+        let mut low = [0u8; 20];
+        low[0] = 0x0f;
+        let mut high = [0u8; 20];
+        high[0] = 0xf0;
+
+        assert_eq!(repository.shard_index(&InfoHash(low)), 0);
+        assert_eq!(repository.shard_index(&InfoHash(high)), 15);
+        assert_eq!(TorrentRepository::new(1).shard_index(&InfoHash(high)), 0);
+    }
+}
@@ -0,0 +1,265 @@
+use std::convert::TryInto;
+use std::fs::File;
+use std::io;
+use std::io::{BufWriter, Write};
+use std::ops::Range;
+
+use crate::PeerId;
+use crate::peer::CompactPeer;
+use crate::protocol::common::InfoHash;
+use crate::protocol::utils::coarse_time;
+use crate::tracker::torrent::TorrentEntry;
+
+// Swarm snapshot file layout, all integers little endian:
+//
+//   header   magic "TRKSWRM1", saved at (u64 unix seconds), section count (u32)
+//   table    per section: byte length (u64), torrent count (u64), followed by the sections back to back
+//   torrent  info hash (20), completed (u32), ipv4 peer count (u32), ipv6 peer count (u32), then its peers
+//   peer     peer id (20), compact address (6 or 18), uploaded, downloaded, left (i64), age in seconds (u32), event (u8)
+//
+// Every record has a fixed size and the table gives the offset of every section, so the file can be
+// mapped or read as is and its sections (one per shard when saved) decoded independently of each other.
+const SNAPSHOT_MAGIC: &[u8; 8] = b"TRKSWRM1";
+const HEADER_LEN: usize = 8 + 8 + 4;
+const TABLE_ENTRY_LEN: usize = 8 + 8;
+const TORRENT_HEADER_LEN: usize = 20 + 4 + 4 + 4;
+
+#[derive(Default)]
+pub struct SnapshotSection {
+    pub torrents: u64,
+    pub data: Vec<u8>,
+}
+
+impl SnapshotSection {
+    // Append a torrent and its peers, peer timestamps are stored as their age at `now` (coarse time)
+    pub fn push_torrent(&mut self, info_hash: &InfoHash, torrent_entry: &TorrentEntry, now: u32) {
+        let peers_v4 = torrent_entry.peers_v4();
+        let peers_v6 = torrent_entry.peers_v6();
+
+        self.data.extend_from_slice(&info_hash.0);
+        self.data.extend_from_slice(&torrent_entry.completed.to_le_bytes());
+        self.data.extend_from_slice(&(peers_v4.len() as u32).to_le_bytes());
+        self.data.extend_from_slice(&(peers_v6.len() as u32).to_le_bytes());
+
+        for peer in peers_v4.iter() { encode_peer(&mut self.data, peer, now); }
+        for peer in peers_v6.iter() { encode_peer(&mut self.data, peer, now); }
+
+        self.torrents += 1;
+    }
+}
+
+// Write the snapshot next to `path` and move it into place once it is complete,
+// so a crash while saving never leaves a truncated snapshot behind
+pub fn write_snapshot_file(path: &str, saved_at: u64, sections: &[SnapshotSection]) -> io::Result<()> {
+    let temporary_path = format!("{}.tmp", path);
+    let file = File::create(&temporary_path)?;
+    let mut writer = BufWriter::new(file);
+
+    write_snapshot(&mut writer, saved_at, sections)?;
+
+    let file = writer.into_inner().map_err(|e| e.into_error())?;
+    file.sync_all()?;
+
+    std::fs::rename(&temporary_path, path)
+}
+
+pub fn write_snapshot<W: Write>(writer: &mut W, saved_at: u64, sections: &[SnapshotSection]) -> io::Result<()> {
+    writer.write_all(SNAPSHOT_MAGIC)?;
+    writer.write_all(&saved_at.to_le_bytes())?;
+    writer.write_all(&(sections.len() as u32).to_le_bytes())?;
+
+    for section in sections {
+        writer.write_all(&(section.data.len() as u64).to_le_bytes())?;
+        writer.write_all(&section.torrents.to_le_bytes())?;
+    }
+
+    for section in sections {
+        writer.write_all(&section.data)?;
+    }
+
+    Ok(())
+}
+
+// The time the snapshot was saved at and the byte range of every section
+pub fn read_sections(data: &[u8]) -> io::Result<(u64, Vec<Range<usize>>)> {
+    let mut header = data;
+
+    if take::<8>(&mut header)? != *SNAPSHOT_MAGIC { return Err(invalid_data("not a swarm snapshot")); }
+
+    let saved_at = u64::from_le_bytes(take(&mut header)?);
+    let section_count = u32::from_le_bytes(take(&mut header)?) as usize;
+
+    let mut offset = HEADER_LEN + section_count.saturating_mul(TABLE_ENTRY_LEN);
+    let mut sections = Vec::with_capacity(section_count.min(header.len() / TABLE_ENTRY_LEN));
+
+    for _ in 0..section_count {
+        let section_len = u64::from_le_bytes(take(&mut header)?) as usize;
+        let _torrents = u64::from_le_bytes(take(&mut header)?);
+
+        let end = offset.checked_add(section_len).filter(|end| *end <= data.len())
+            .ok_or_else(|| invalid_data("truncated swarm snapshot"))?;
+
+        sections.push(offset..end);
+        offset = end;
+    }
+
+    Ok((saved_at, sections))
+}
+
+// Decode the torrents of a section. `elapsed` is the time in seconds since the snapshot was saved,
+// peers that would have timed out by now are dropped and so are torrents left with nothing to keep.
+pub fn decode_section(mut section: &[u8], elapsed: u32, max_peer_timeout: u32) -> io::Result<Vec<(InfoHash, TorrentEntry)>> {
+    let now = coarse_time();
+    let mut torrents = Vec::with_capacity(section.len() / TORRENT_HEADER_LEN);
+
+    while !section.is_empty() {
+        let info_hash = InfoHash(take(&mut section)?);
+        let completed = u32::from_le_bytes(take(&mut section)?);
+        let peers_v4 = u32::from_le_bytes(take(&mut section)?);
+        let peers_v6 = u32::from_le_bytes(take(&mut section)?);
+
+        let mut torrent_entry = TorrentEntry::new();
+        torrent_entry.completed = completed;
+
+        for _ in 0..peers_v4 {
+            let (peer, age) = decode_peer(&mut section, elapsed, now)?;
+            if age < max_peer_timeout { torrent_entry.restore_peer_v4(peer); }
+        }
+
+        for _ in 0..peers_v6 {
+            let (peer, age) = decode_peer(&mut section, elapsed, now)?;
+            if age < max_peer_timeout { torrent_entry.restore_peer_v6(peer); }
+        }
+
+        if torrent_entry.completed > 0 || torrent_entry.get_peers_len() > 0 {
+            torrents.push((info_hash, torrent_entry));
+        }
+    }
+
+    Ok(torrents)
+}
+
+fn encode_peer<const N: usize>(data: &mut Vec<u8>, peer: &CompactPeer<N>, now: u32) {
+    data.extend_from_slice(&peer.peer_id.0);
+    data.extend_from_slice(&peer.addr);
+    data.extend_from_slice(&peer.uploaded.to_le_bytes());
+    data.extend_from_slice(&peer.downloaded.to_le_bytes());
+    data.extend_from_slice(&peer.left.to_le_bytes());
+    data.extend_from_slice(&now.saturating_sub(peer.updated).to_le_bytes());
+    data.push(peer.event);
+}
+
+// A peer and its current age, dated back from `now` by that age
+fn decode_peer<const N: usize>(data: &mut &[u8], elapsed: u32, now: u32) -> io::Result<(CompactPeer<N>, u32)> {
+    let peer_id = PeerId(take(data)?);
+    let addr = take::<N>(data)?;
+    let uploaded = i64::from_le_bytes(take(data)?);
+    let downloaded = i64::from_le_bytes(take(data)?);
+    let left = i64::from_le_bytes(take(data)?);
+    let age = u32::from_le_bytes(take(data)?).saturating_add(elapsed);
+    let [event] = take::<1>(data)?;
+
+    let peer = CompactPeer {
+        uploaded,
+        downloaded,
+        left,
+        updated: now.saturating_sub(age),
+        peer_id,
+        addr,
+        event,
+    };
+
+    Ok((peer, age))
+}
+
+fn take<const L: usize>(data: &mut &[u8]) -> io::Result<[u8; L]> {
+    if data.len() < L { return Err(invalid_data("truncated swarm snapshot")); }
+
+    let (bytes, rest) = data.split_at(L);
+    *data = rest;
+
+    Ok(bytes.try_into().unwrap())
+}
+
+fn invalid_data(message: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
+
+    use aquatic_udp_protocol::{AnnounceEvent, NumberOfBytes};
+
+    use crate::PeerId;
+    use crate::peer::TorrentPeer;
+    use crate::protocol::common::InfoHash;
+    use crate::protocol::utils::coarse_time;
+    use crate::tracker::snapshot::{decode_section, read_sections, SnapshotSection, write_snapshot};
+    use crate::tracker::torrent::TorrentEntry;
+
+    fn peer(id: u8, ip: IpAddr, left: i64) -> TorrentPeer {
+        TorrentPeer {
+            peer_id: PeerId([id; 20]),
+            peer_addr: SocketAddr::new(ip, 6881),
+            updated: std::time::Instant::now(),
+            uploaded: NumberOfBytes(0),
+            downloaded: NumberOfBytes(0),
+            left: NumberOfBytes(left),
+            event: AnnounceEvent::Started,
+        }
+    }
+
+    fn snapshot() -> Vec<u8> {
+        let mut torrent_entry = TorrentEntry::new();
+        torrent_entry.completed = 3;
+        torrent_entry.update_peer(&peer(1, IpAddr::V4(Ipv4Addr::new(126, 0, 0, 1)), 0));
+        torrent_entry.update_peer(&peer(2, IpAddr::V4(Ipv4Addr::new(126, 0, 0, 2)), 100));
+        torrent_entry.update_peer(&peer(3, IpAddr::V6(Ipv6Addr::LOCALHOST), 100));
+
+        let mut section = SnapshotSection::default();
+        section.push_torrent(&InfoHash([1; 20]), &torrent_entry, coarse_time());
+        section.push_torrent(&InfoHash([2; 20]), &TorrentEntry::new(), coarse_time());
+
+        let mut data = Vec::new();
+        write_snapshot(&mut data, 1_000, &[SnapshotSection::default(), section]).unwrap();
+        data
+    }
+
+    #[test]
+    fn snapshot_round_trip() {
+        let data = snapshot();
+        let (saved_at, sections) = read_sections(&data).unwrap();
+
+        assert_eq!(saved_at, 1_000);
+        assert_eq!(sections.len(), 2);
+        assert!(decode_section(&data[sections[0].clone()], 0, 900).unwrap().is_empty());
+
+        // the empty torrent has nothing worth restoring
+        let torrents = decode_section(&data[sections[1].clone()], 0, 900).unwrap();
+        assert_eq!(torrents.len(), 1);
+
+        let (info_hash, torrent_entry) = &torrents[0];
+        assert_eq!(*info_hash, InfoHash([1; 20]));
+        assert_eq!(torrent_entry.get_stats(), (1, 3, 2));
+        assert_eq!(torrent_entry.get_peers(10).iter().map(|peer| peer.peer_id.clone()).collect::<Vec<PeerId>>(),
+                   vec![PeerId([1; 20]), PeerId([2; 20]), PeerId([3; 20])]);
+    }
+
+    #[test]
+    fn snapshot_peers_age_out() {
+        let data = snapshot();
+        let (_, sections) = read_sections(&data).unwrap();
+
+        let torrents = decode_section(&data[sections[1].clone()], 900, 900).unwrap();
+        assert_eq!(torrents[0].1.get_stats(), (0, 3, 0));
+    }
+
+    #[test]
+    fn truncated_snapshot_is_rejected() {
+        let data = snapshot();
+
+        assert!(read_sections(&data[..data.len() - 1]).is_err());
+        assert!(read_sections(b"not a snapshot at all").is_err());
+    }
+}
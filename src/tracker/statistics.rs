@@ -1,10 +1,4 @@
-use std::sync::Arc;
-
-use tokio::sync::{mpsc, RwLock, RwLockReadGuard};
-use tokio::sync::mpsc::Sender;
-use tokio::sync::mpsc::error::SendError;
-
-const CHANNEL_BUFFER_SIZE: usize = 65_535;
+use std::sync::atomic::{AtomicU64, Ordering};
 
 #[derive(Debug)]
 pub enum TrackerStatisticsEvent {
@@ -55,82 +49,177 @@ impl TrackerStatistics {
     }
 }
 
+// A counter on its own cache line, so handlers on different cores bumping
+// different counters don't invalidate each other's caches
+#[repr(align(64))]
+#[derive(Default)]
+struct Counter(AtomicU64);
+
+impl Counter {
+    fn increment(&self) {
+        self.0.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn change(&self, before: u32, after: u32) {
+        if after >= before {
+            self.0.fetch_add((after - before) as u64, Ordering::Relaxed);
+        } else {
+            self.0.fetch_sub((before - after) as u64, Ordering::Relaxed);
+        }
+    }
+
+    fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+// Counters are bumped in place by the handlers, without a channel or a lock.
+// Reading them only happens when the stats are requested.
+#[derive(Default)]
 pub struct StatsTracker {
-    channel_sender: Option<Sender<TrackerStatisticsEvent>>,
-    pub stats: Arc<RwLock<TrackerStatistics>>,
+    enabled: bool,
+    tcp4_connections_handled: Counter,
+    tcp4_announces_handled: Counter,
+    tcp4_scrapes_handled: Counter,
+    tcp6_connections_handled: Counter,
+    tcp6_announces_handled: Counter,
+    tcp6_scrapes_handled: Counter,
+    udp4_connections_handled: Counter,
+    udp4_announces_handled: Counter,
+    udp4_scrapes_handled: Counter,
+    udp6_connections_handled: Counter,
+    udp6_announces_handled: Counter,
+    udp6_scrapes_handled: Counter,
 }
 
 impl StatsTracker {
-    pub fn new() -> Self {
+    pub fn new(enabled: bool) -> Self {
         Self {
-            channel_sender: None,
-            stats: Arc::new(RwLock::new(TrackerStatistics::new())),
+            enabled,
+            ..Default::default()
         }
     }
 
-    pub async fn get_stats(&self) -> RwLockReadGuard<'_, TrackerStatistics> {
-        self.stats.read().await
+    pub fn get_stats(&self) -> TrackerStatistics {
+        TrackerStatistics {
+            tcp4_connections_handled: self.tcp4_connections_handled.get(),
+            tcp4_announces_handled: self.tcp4_announces_handled.get(),
+            tcp4_scrapes_handled: self.tcp4_scrapes_handled.get(),
+            tcp6_connections_handled: self.tcp6_connections_handled.get(),
+            tcp6_announces_handled: self.tcp6_announces_handled.get(),
+            tcp6_scrapes_handled: self.tcp6_scrapes_handled.get(),
+            udp4_connections_handled: self.udp4_connections_handled.get(),
+            udp4_announces_handled: self.udp4_announces_handled.get(),
+            udp4_scrapes_handled: self.udp4_scrapes_handled.get(),
+            udp6_connections_handled: self.udp6_connections_handled.get(),
+            udp6_announces_handled: self.udp6_announces_handled.get(),
+            udp6_scrapes_handled: self.udp6_scrapes_handled.get(),
+        }
     }
 
-    pub async fn send_event(&self, event: TrackerStatisticsEvent) -> Option<Result<(), SendError<TrackerStatisticsEvent>>> {
-        if let Some(tx) = &self.channel_sender {
-            Some(tx.send(event).await)
-        } else {
-            None
+    pub fn send_event(&self, event: TrackerStatisticsEvent) {
+        if !self.enabled { return; }
+
+        match event {
+            TrackerStatisticsEvent::Tcp4Announce => {
+                self.tcp4_announces_handled.increment();
+                self.tcp4_connections_handled.increment();
+            }
+            TrackerStatisticsEvent::Tcp4Scrape => {
+                self.tcp4_scrapes_handled.increment();
+                self.tcp4_connections_handled.increment();
+            }
+            TrackerStatisticsEvent::Tcp6Announce => {
+                self.tcp6_announces_handled.increment();
+                self.tcp6_connections_handled.increment();
+            }
+            TrackerStatisticsEvent::Tcp6Scrape => {
+                self.tcp6_scrapes_handled.increment();
+                self.tcp6_connections_handled.increment();
+            }
+            TrackerStatisticsEvent::Udp4Connect => {
+                self.udp4_connections_handled.increment();
+            }
+            TrackerStatisticsEvent::Udp4Announce => {
+                self.udp4_announces_handled.increment();
+            }
+            TrackerStatisticsEvent::Udp4Scrape => {
+                self.udp4_scrapes_handled.increment();
+            }
+            TrackerStatisticsEvent::Udp6Connect => {
+                self.udp6_connections_handled.increment();
+            }
+            TrackerStatisticsEvent::Udp6Announce => {
+                self.udp6_announces_handled.increment();
+            }
+            TrackerStatisticsEvent::Udp6Scrape => {
+                self.udp6_scrapes_handled.increment();
+            }
         }
     }
+}
 
-    pub fn run_worker(&mut self) {
-        let (tx, mut rx) = mpsc::channel::<TrackerStatisticsEvent>(CHANNEL_BUFFER_SIZE);
-
-        // set send channel on stats_tracker
-        self.channel_sender = Some(tx);
-
-        let stats = self.stats.clone();
-
-        tokio::spawn(async move {
-            while let Some(event) = rx.recv().await {
-                let mut stats_lock = stats.write().await;
-
-                match event {
-                    TrackerStatisticsEvent::Tcp4Announce => {
-                        stats_lock.tcp4_announces_handled += 1;
-                        stats_lock.tcp4_connections_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Tcp4Scrape => {
-                        stats_lock.tcp4_scrapes_handled += 1;
-                        stats_lock.tcp4_connections_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Tcp6Announce => {
-                        stats_lock.tcp6_announces_handled += 1;
-                        stats_lock.tcp6_connections_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Tcp6Scrape => {
-                        stats_lock.tcp6_scrapes_handled += 1;
-                        stats_lock.tcp6_connections_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Udp4Connect => {
-                        stats_lock.udp4_connections_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Udp4Announce => {
-                        stats_lock.udp4_announces_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Udp4Scrape => {
-                        stats_lock.udp4_scrapes_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Udp6Connect => {
-                        stats_lock.udp6_connections_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Udp6Announce => {
-                        stats_lock.udp6_announces_handled += 1;
-                    }
-                    TrackerStatisticsEvent::Udp6Scrape => {
-                        stats_lock.udp6_scrapes_handled += 1;
-                    }
-                }
-
-                drop(stats_lock);
-            }
-        });
+#[derive(Debug)]
+pub struct SwarmStatistics {
+    pub torrents: u64,
+    pub seeders: u64,
+    pub completed: u64,
+    pub leechers: u64,
+}
+
+// Totals over all torrents, kept up to date from the change in a torrent's stats on every
+// update, so reading them doesn't need a scan of the torrents. Stats are passed as the
+// (seeders, completed, leechers) of TorrentEntry::get_stats.
+#[derive(Default)]
+pub struct SwarmTotals {
+    torrents: Counter,
+    seeders: Counter,
+    completed: Counter,
+    leechers: Counter,
+}
+
+impl SwarmTotals {
+    pub fn add_torrent(&self, stats: (u32, u32, u32)) {
+        self.torrents.increment();
+        self.update_torrent((0, 0, 0), stats);
+    }
+
+    pub fn remove_torrent(&self, stats: (u32, u32, u32)) {
+        self.torrents.change(1, 0);
+        self.update_torrent(stats, (0, 0, 0));
+    }
+
+    pub fn update_torrent(&self, before: (u32, u32, u32), after: (u32, u32, u32)) {
+        self.seeders.change(before.0, after.0);
+        self.completed.change(before.1, after.1);
+        self.leechers.change(before.2, after.2);
+    }
+
+    pub fn get_stats(&self) -> SwarmStatistics {
+        SwarmStatistics {
+            torrents: self.torrents.get(),
+            seeders: self.seeders.get(),
+            completed: self.completed.get(),
+            leechers: self.leechers.get(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::tracker::statistics::SwarmTotals;
+
+    #[test]
+    fn swarm_totals_follow_torrent_changes() {
+        let swarm_totals = SwarmTotals::default();
+
+        swarm_totals.add_torrent((0, 3, 0));
+        swarm_totals.add_torrent((0, 0, 0));
+        swarm_totals.update_torrent((0, 0, 0), (2, 1, 5));
+        swarm_totals.update_torrent((2, 1, 5), (1, 1, 2));
+        swarm_totals.remove_torrent((0, 3, 0));
+
+        let stats = swarm_totals.get_stats();
+        assert_eq!((stats.torrents, stats.seeders, stats.completed, stats.leechers), (1, 1, 1, 2));
     }
 }
@@ -3,21 +3,35 @@ use std::net::{IpAddr, SocketAddr};
 use aquatic_udp_protocol::{AnnounceEvent};
 use serde::{Deserialize, Serialize};
 
-use crate::{MAX_SCRAPE_TORRENTS, PeerId};
-use crate::peer::TorrentPeer;
+use crate::PeerId;
+use crate::peer::{COMPACT_ADDR_LEN_V4, COMPACT_ADDR_LEN_V6, CompactPeerV4, CompactPeerV6, TorrentPeer};
+use crate::protocol::utils::coarse_time;
+use crate::tracker::announce_cache::{AnnounceCache, AnnounceCachePolicy};
+use crate::tracker::peer_list::PeerList;
 
 #[derive(Serialize, Deserialize, Clone)]
 pub struct TorrentEntry {
     #[serde(skip)]
-    pub peers: std::collections::BTreeMap<PeerId, TorrentPeer>,
+    peers_v4: PeerList<COMPACT_ADDR_LEN_V4>,
+    #[serde(skip)]
+    peers_v6: PeerList<COMPACT_ADDR_LEN_V6>,
     pub completed: u32,
+    // kept up to date on every peer change, leechers are the remaining peers
+    #[serde(skip)]
+    seeders: u32,
+    // only allocated once the swarm is hot enough to serve announces from it
+    #[serde(skip)]
+    announce_cache: Option<Box<AnnounceCache>>,
 }
 
 impl TorrentEntry {
     pub fn new() -> TorrentEntry {
         TorrentEntry {
-            peers: std::collections::BTreeMap::new(),
+            peers_v4: PeerList::default(),
+            peers_v6: PeerList::default(),
             completed: 0,
+            seeders: 0,
+            announce_cache: None,
         }
     }
 
@@ -27,58 +41,180 @@ impl TorrentEntry {
 
         match peer.event {
             AnnounceEvent::Stopped => {
-                let _ = self.peers.remove(&peer.peer_id);
+                let peer_old_was_seeder = self.remove_peer(&peer.peer_id);
+                if peer_old_was_seeder.is_some() { self.peers_changed(&peer.peer_addr); }
+                if let Some(true) = peer_old_was_seeder {
+                    self.seeders -= 1;
+                }
             }
             AnnounceEvent::Completed => {
-                let peer_old = self.peers.insert(peer.peer_id.clone(), peer.clone());
+                let peer_old_was_seeder = self.insert_peer(peer);
+                if peer_old_was_seeder.is_none() { self.peers_changed(&peer.peer_addr); }
+                if peer.is_seeder() { self.seeders += 1; }
                 // Don't count if peer was not previously known
-                if let Some(old_peer) = peer_old {
-                    // Don't double count
-                    if !old_peer.is_seeder() {
+                if let Some(old_peer_was_seeder) = peer_old_was_seeder {
+                    if old_peer_was_seeder {
+                        self.seeders -= 1;
+                    } else {
+                        // Don't double count
                         self.completed += 1;
                         did_torrent_stats_change = true;
                     }
                 }
             }
             _ => {
-                let _ = self.peers.insert(peer.peer_id.clone(), peer.clone());
+                if peer.is_seeder() { self.seeders += 1; }
+                let peer_old_was_seeder = self.insert_peer(peer);
+                if peer_old_was_seeder.is_none() { self.peers_changed(&peer.peer_addr); }
+                if let Some(true) = peer_old_was_seeder {
+                    self.seeders -= 1;
+                }
             }
         }
 
         did_torrent_stats_change
     }
 
-    pub fn get_peers(&self, client_addr: Option<&SocketAddr>) -> Vec<&TorrentPeer> {
-        self.peers
-            .values()
-            .filter(|peer| match client_addr {
-                // Don't filter on ip_version
-                None => true,
-                // Filter out different ip_version from remote_addr
-                Some(remote_addr) => {
-                    // Skip ip address of client
-                    if peer.peer_addr.ip() == remote_addr.ip() { return false; }
-
-                    match peer.peer_addr.ip() {
-                        IpAddr::V4(_) => { remote_addr.is_ipv4() }
-                        IpAddr::V6(_) => { remote_addr.is_ipv6() }
-                    }
-                }
-            })
-            .take(MAX_SCRAPE_TORRENTS as usize)
+    // A peer joined or left, which counts against the cached compact peer string of its ip family
+    fn peers_changed(&mut self, peer_addr: &SocketAddr) {
+        if let Some(announce_cache) = &mut self.announce_cache {
+            match peer_addr {
+                SocketAddr::V4(_) => announce_cache.v4.mutated(),
+                SocketAddr::V6(_) => announce_cache.v6.mutated(),
+            }
+        }
+    }
+
+    // Insert or replace a peer, returning whether the replaced peer was a seeder.
+    // A peer that switched ip family replaces its entry in the other family.
+    fn insert_peer(&mut self, peer: &TorrentPeer) -> Option<bool> {
+        match CompactPeerV4::from_torrent_peer(peer) {
+            Some(compact_peer) => {
+                self.peers_v4.insert(compact_peer).map(|old_peer| old_peer.is_seeder())
+                    .or_else(|| self.peers_v6.remove(&peer.peer_id).map(|old_peer| old_peer.is_seeder()))
+            }
+            None => {
+                let compact_peer = CompactPeerV6::from_torrent_peer(peer)?;
+                self.peers_v6.insert(compact_peer).map(|old_peer| old_peer.is_seeder())
+                    .or_else(|| self.peers_v4.remove(&peer.peer_id).map(|old_peer| old_peer.is_seeder()))
+            }
+        }
+    }
+
+    // Remove a peer, returning whether it was a seeder
+    fn remove_peer(&mut self, peer_id: &PeerId) -> Option<bool> {
+        self.peers_v4.remove(peer_id).map(|old_peer| old_peer.is_seeder())
+            .or_else(|| self.peers_v6.remove(peer_id).map(|old_peer| old_peer.is_seeder()))
+    }
+
+    // Peers of both ip families in storage order
+    pub fn get_peers(&self, limit: usize) -> Vec<TorrentPeer> {
+        self.peers_v4.iter().map(|peer| peer.to_torrent_peer())
+            .chain(self.peers_v6.iter().map(|peer| peer.to_torrent_peer()))
+            .take(limit)
             .collect()
     }
 
+    // A random selection of up to `limit` peers of the client's ip family, excluding the client.
+    // Each peer is passed to `write_peer` as its id and its stored compact address,
+    // so response writers can copy the address bytes as they are.
+    pub fn sample_peers<F: FnMut(&PeerId, &[u8])>(&self, client_addr: &SocketAddr, limit: usize, mut write_peer: F) {
+        match client_addr {
+            SocketAddr::V4(_) => {
+                for peer in self.peers_v4.sample(limit, Some(client_addr.ip())) { write_peer(&peer.peer_id, &peer.addr); }
+            }
+            SocketAddr::V6(_) => {
+                for peer in self.peers_v6.sample(limit, Some(client_addr.ip())) { write_peer(&peer.peer_id, &peer.addr); }
+            }
+        }
+    }
+
+    // As `sample_peers` for compact responses, passing only compact addresses to `write_peers`, as one
+    // or more records per call. Swarms with at least `policy.min_peers` peers of the client's ip family
+    // are served from a cached compact peer string, rebuilt every `policy.ttl` seconds or once
+    // `policy.max_mutations` peers joined or left, so hot swarms copy their response peers in a few runs.
+    pub fn sample_compact_peers_cached<F: FnMut(&[u8])>(&mut self, client_addr: &SocketAddr, limit: usize, policy: &AnnounceCachePolicy, mut write_peers: F) {
+        let family_len = match client_addr {
+            SocketAddr::V4(_) => self.peers_v4.len(),
+            SocketAddr::V6(_) => self.peers_v6.len(),
+        };
+
+        if !policy.is_enabled() || family_len < policy.min_peers {
+            if let Some(announce_cache) = &mut self.announce_cache {
+                match client_addr {
+                    SocketAddr::V4(_) => announce_cache.v4.release(),
+                    SocketAddr::V6(_) => announce_cache.v6.release(),
+                }
+            }
+
+            return self.sample_peers(client_addr, limit, |_peer_id, compact_addr| write_peers(compact_addr));
+        }
+
+        let announce_cache = self.announce_cache.get_or_insert_with(Box::default);
+        let now = coarse_time();
+
+        match client_addr.ip() {
+            IpAddr::V4(ip) => announce_cache.v4.sample(&self.peers_v4, policy, now, &ip.octets(), limit, write_peers),
+            IpAddr::V6(ip) => announce_cache.v6.sample(&self.peers_v6, policy, now, &ip.octets(), limit, write_peers),
+        }
+    }
+
+    pub fn peers_v4(&self) -> &PeerList<COMPACT_ADDR_LEN_V4> {
+        &self.peers_v4
+    }
+
+    pub fn peers_v6(&self) -> &PeerList<COMPACT_ADDR_LEN_V6> {
+        &self.peers_v6
+    }
+
+    // Insert a stored peer as it is, used when restoring a swarm snapshot
+    pub fn restore_peer_v4(&mut self, peer: CompactPeerV4) {
+        if peer.is_seeder() { self.seeders += 1; }
+        if let Some(true) = self.peers_v4.insert(peer).map(|old_peer| old_peer.is_seeder()) {
+            self.seeders -= 1;
+        }
+    }
+
+    pub fn restore_peer_v6(&mut self, peer: CompactPeerV6) {
+        if peer.is_seeder() { self.seeders += 1; }
+        if let Some(true) = self.peers_v6.insert(peer).map(|old_peer| old_peer.is_seeder()) {
+            self.seeders -= 1;
+        }
+    }
+
+    pub fn get_peers_len(&self) -> usize {
+        self.peers_v4.len() + self.peers_v6.len()
+    }
+
     pub fn get_stats(&self) -> (u32, u32, u32) {
-        let seeders: u32 = self.peers.values().filter(|peer| peer.is_seeder()).count() as u32;
-        let leechers: u32 = self.peers.len() as u32 - seeders;
-        (seeders, self.completed, leechers)
+        let leechers: u32 = self.get_peers_len() as u32 - self.seeders;
+        (self.seeders, self.completed, leechers)
     }
 
     pub fn remove_inactive_peers(&mut self, max_peer_timeout: u32) {
-        self.peers.retain(|_, peer| {
-            peer.updated.elapsed() < std::time::Duration::from_secs(max_peer_timeout as u64)
+        let now = coarse_time();
+        let peers_len = self.get_peers_len();
+        let seeders = &mut self.seeders;
+
+        self.peers_v4.retain(|peer| {
+            let is_active = now.saturating_sub(peer.updated) < max_peer_timeout;
+            if !is_active && peer.is_seeder() { *seeders -= 1; }
+            is_active
         });
+
+        self.peers_v6.retain(|peer| {
+            let is_active = now.saturating_sub(peer.updated) < max_peer_timeout;
+            if !is_active && peer.is_seeder() { *seeders -= 1; }
+            is_active
+        });
+
+        // removed peers must not be handed out any more
+        if self.get_peers_len() != peers_len {
+            if let Some(announce_cache) = &mut self.announce_cache {
+                announce_cache.v4.invalidate();
+                announce_cache.v6.invalidate();
+            }
+        }
     }
 }
 
@@ -98,3 +234,92 @@ pub enum TorrentError {
     CouldNotSendResponse,
     InvalidInfoHash,
 }
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+
+    use aquatic_udp_protocol::{AnnounceEvent, NumberOfBytes};
+
+    use crate::PeerId;
+    use crate::peer::TorrentPeer;
+    use crate::tracker::announce_cache::AnnounceCachePolicy;
+    use crate::tracker::torrent::TorrentEntry;
+
+    fn peer(id: u8, left: i64, event: AnnounceEvent) -> TorrentPeer {
+        TorrentPeer {
+            peer_id: PeerId([id; 20]),
+            peer_addr: SocketAddr::new(IpAddr::V4(Ipv4Addr::new(126, 0, 0, id)), 8080),
+            updated: std::time::Instant::now(),
+            uploaded: NumberOfBytes(0),
+            downloaded: NumberOfBytes(0),
+            left: NumberOfBytes(left),
+            event,
+        }
+    }
+
+    #[test]
+    fn seeders_and_leechers_follow_peer_updates() {
+        let mut torrent_entry = TorrentEntry::new();
+
+        torrent_entry.update_peer(&peer(1, 100, AnnounceEvent::Started));
+        torrent_entry.update_peer(&peer(2, 0, AnnounceEvent::Started));
+        assert_eq!(torrent_entry.get_stats(), (1, 0, 1));
+
+        // a leecher completing becomes a seeder
+        assert!(torrent_entry.update_peer(&peer(1, 0, AnnounceEvent::Completed)));
+        assert_eq!(torrent_entry.get_stats(), (2, 1, 0));
+
+        // announcing completed again is not counted twice
+        assert!(!torrent_entry.update_peer(&peer(1, 0, AnnounceEvent::Completed)));
+        assert_eq!(torrent_entry.get_stats(), (2, 1, 0));
+
+        torrent_entry.update_peer(&peer(2, 0, AnnounceEvent::Stopped));
+        assert_eq!(torrent_entry.get_stats(), (1, 1, 0));
+
+        torrent_entry.remove_inactive_peers(0);
+        assert_eq!(torrent_entry.get_stats(), (0, 1, 0));
+    }
+
+    #[test]
+    fn hot_swarms_are_served_from_the_announce_cache() {
+        let policy = AnnounceCachePolicy { min_peers: 10, cached_peers: 20, ttl: 60, max_mutations: 2 };
+        let mut torrent_entry = TorrentEntry::new();
+
+        for id in 1..=30 { torrent_entry.update_peer(&peer(id, 0, AnnounceEvent::Started)); }
+
+        // the ids of the sampled peers, the last octet of their ips
+        let sample_limit = |torrent_entry: &mut TorrentEntry, client: u8, limit: usize| {
+            let mut compact_peers = Vec::new();
+            torrent_entry.sample_compact_peers_cached(&peer(client, 0, AnnounceEvent::None).peer_addr, limit, &policy, |compact_addrs| compact_peers.extend_from_slice(compact_addrs));
+            let mut ids: Vec<u8> = compact_peers.chunks_exact(6).map(|compact_addr| compact_addr[3]).collect();
+            ids.sort_unstable();
+            ids
+        };
+        let sample = |torrent_entry: &mut TorrentEntry, client: u8| sample_limit(torrent_entry, client, 50);
+
+        // the cached string is bounded, skips the client and is served again until it expires
+        let cached = sample(&mut torrent_entry, 100);
+        assert_eq!(cached.len(), 20);
+        assert_eq!(sample(&mut torrent_entry, 100), cached);
+        assert_eq!(sample(&mut torrent_entry, cached[0]).len(), 19);
+
+        // a window skipping the client still holds `limit` peers
+        for _ in 0..20 {
+            let window = sample_limit(&mut torrent_entry, cached[0], 19);
+            assert_eq!(window.len(), 19);
+            assert!(!window.contains(&cached[0]));
+        }
+
+        // peers joining count against the cached string until it is rebuilt
+        torrent_entry.update_peer(&peer(31, 0, AnnounceEvent::Started));
+        assert_eq!(sample(&mut torrent_entry, 100), cached);
+        torrent_entry.update_peer(&peer(32, 0, AnnounceEvent::Started));
+        assert_eq!(sample(&mut torrent_entry, 100).len(), 20);
+
+        // cold swarms are sampled directly
+        let mut torrent_entry = TorrentEntry::new();
+        for id in 1..=5 { torrent_entry.update_peer(&peer(id, 0, AnnounceEvent::Started)); }
+        assert_eq!(sample(&mut torrent_entry, 100).len(), 5);
+    }
+}
@@ -1,48 +1,141 @@
 use std::collections::btree_map::Entry;
-use std::collections::BTreeMap;
-use std::net::SocketAddr;
+use std::convert::TryFrom;
+use std::io;
+use std::net::IpAddr;
+use std::ops::Bound;
 use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
 
-use tokio::sync::{RwLock, RwLockReadGuard};
-use tokio::sync::mpsc::error::SendError;
+use arc_swap::ArcSwap;
+use log::warn;
+use tokio::sync::mpsc;
+use tokio::sync::mpsc::{Receiver, Sender, UnboundedReceiver, UnboundedSender};
 
-use crate::Configuration;
+use crate::{AUTH_KEY_LENGTH, Configuration, PeerId};
+use crate::cluster::Cluster;
 use crate::protocol::common::InfoHash;
 use crate::databases::database::Database;
 use crate::databases::database;
 use crate::mode::TrackerMode;
 use crate::peer::TorrentPeer;
-use crate::tracker::key::AuthKey;
-use crate::statistics::{StatsTracker, TrackerStatistics, TrackerStatisticsEvent};
+use crate::tracker::key::{AuthKey, AuthKeys, MAX_KEY_CHANGES};
+use crate::tracker::metrics::Metrics;
+use crate::statistics::{StatsTracker, SwarmStatistics, SwarmTotals, TrackerStatistics, TrackerStatisticsEvent};
 use crate::tracker::key;
+use crate::protocol::hashing::KeyHashMap;
+use crate::protocol::rate_limiter::RateLimiter;
+use crate::protocol::utils::{coarse_time, current_time, set_connection_id_secret};
+use crate::tracker::repository::{TorrentRepository, TorrentShard};
+use crate::tracker::announce_cache::AnnounceCachePolicy;
+use crate::tracker::announce_events;
+use crate::tracker::announce_events::EncodedAnnounceEvent;
+use crate::tracker::snapshot;
+use crate::tracker::snapshot::SnapshotSection;
 use crate::tracker::torrent::{TorrentEntry, TorrentError, TorrentStats};
+use crate::tracker::whitelist::{InfoHashSet, MAX_WHITELIST_CHANGES, Whitelist};
+
+// torrents cleaned per shard lock acquisition
+const CLEANUP_BATCH_SIZE: usize = 1024;
+// keys and info hashes written per database transaction by the bulk imports
+const IMPORT_BATCH_SIZE: usize = 10_000;
+// a cached compact peer string holds this many times the most peers an announce gets
+const ANNOUNCE_CACHE_SELECTIONS: usize = 4;
+
+// Holds a merge flag, cleared on drop even when the request waiting for the merge goes away
+struct Merging<'a>(&'a AtomicBool);
+
+impl<'a> Merging<'a> {
+    // None while another merge is running
+    fn claim(flag: &'a AtomicBool) -> Option<Merging<'a>> {
+        if flag.swap(true, Ordering::Acquire) { None } else { Some(Merging(flag)) }
+    }
+}
+
+impl Drop for Merging<'_> {
+    fn drop(&mut self) {
+        self.0.store(false, Ordering::Release);
+    }
+}
 
 pub struct TorrentTracker {
     pub config: Arc<Configuration>,
     mode: TrackerMode,
-    keys: RwLock<std::collections::HashMap<String, AuthKey>>,
-    whitelist: RwLock<std::collections::HashSet<InfoHash>>,
-    torrents: RwLock<std::collections::BTreeMap<InfoHash, TorrentEntry>>,
+    // immutable snapshots, replaced as a whole on every change so readers never take a lock
+    keys: ArcSwap<AuthKeys>,
+    // set while the key changes are merged into a new base
+    keys_merging: AtomicBool,
+    whitelist: ArcSwap<Whitelist>,
+    // set while the whitelist changes are merged into a new base
+    whitelist_merging: AtomicBool,
+    torrents: TorrentRepository,
     stats_tracker: StatsTracker,
-    database: Box<dyn Database>
+    swarm_totals: SwarmTotals,
+    metrics: Metrics,
+    announce_cache: AnnounceCachePolicy,
+    // None when rate limiting is disabled
+    rate_limiter: Option<RateLimiter>,
+    database: Box<dyn Database>,
+    // None when not clustered, every torrent is then local
+    cluster: Option<Cluster>,
+    // completed counters waiting to be written by the torrent persistence job
+    completed_sender: UnboundedSender<(InfoHash, u32)>,
+    completed_receiver: std::sync::Mutex<Option<UnboundedReceiver<(InfoHash, u32)>>>,
+    // announces waiting for the export job, None when announces are not exported
+    announce_event_sender: Option<Sender<EncodedAnnounceEvent>>,
+    announce_event_receiver: std::sync::Mutex<Option<Receiver<EncodedAnnounceEvent>>>,
 }
 
 impl TorrentTracker {
     pub fn new(config: Arc<Configuration>) -> Result<TorrentTracker, r2d2::Error> {
-        let database = database::connect_database(&config.db_driver, &config.db_path)?;
-        let mut stats_tracker = StatsTracker::new();
+        let database = database::connect_database(&config.db_driver, &config.db_path, config.db_pool_size)?;
+        let stats_tracker = StatsTracker::new(config.tracker_usage_statistics);
+
+        // a client may connect through one node and announce through another
+        if config.cluster.enabled {
+            if config.cluster.secret.is_empty() {
+                warn!("No cluster secret set, UDP connection ids are only accepted by the node that issued them.");
+            } else {
+                set_connection_id_secret(&config.cluster.secret);
+            }
+        }
 
-        // starts a thread for updating tracker stats
-        if config.tracker_usage_statistics { stats_tracker.run_worker(); }
+        let (completed_sender, completed_receiver) = mpsc::unbounded_channel();
+        let (announce_event_sender, announce_event_receiver) = match config.get_announce_export_sink() {
+            Some(_) => {
+                let (sender, receiver) = mpsc::channel(config.announce_export_buffer.max(1));
+                (Some(sender), Some(receiver))
+            }
+            None => (None, None)
+        };
 
         Ok(TorrentTracker {
             config: config.clone(),
             mode: config.mode,
-            keys: RwLock::new(std::collections::HashMap::new()),
-            whitelist: RwLock::new(std::collections::HashSet::new()),
-            torrents: RwLock::new(std::collections::BTreeMap::new()),
+            keys: ArcSwap::from_pointee(AuthKeys::default()),
+            keys_merging: AtomicBool::new(false),
+            whitelist: ArcSwap::from_pointee(Whitelist::new(InfoHashSet::new())),
+            whitelist_merging: AtomicBool::new(false),
+            torrents: TorrentRepository::new(config.torrent_shards),
             stats_tracker,
-            database
+            swarm_totals: SwarmTotals::default(),
+            metrics: Metrics::new(config.tracker_usage_statistics),
+            announce_cache: AnnounceCachePolicy {
+                min_peers: config.announce_cache_min_peers as usize,
+                cached_peers: config.max_peers_per_announce as usize * ANNOUNCE_CACHE_SELECTIONS,
+                ttl: config.announce_cache_ttl,
+                max_mutations: config.announce_cache_max_mutations,
+            },
+            rate_limiter: if config.rate_limit_per_second > 0 {
+                Some(RateLimiter::new(config.rate_limit_per_second, config.rate_limit_burst, config.rate_limit_ipv4_prefix, config.rate_limit_ipv6_prefix))
+            } else {
+                None
+            },
+            database,
+            cluster: if config.cluster.enabled { Some(Cluster::new(&config.cluster)) } else { None },
+            completed_sender,
+            completed_receiver: std::sync::Mutex::new(Some(completed_receiver)),
+            announce_event_sender,
+            announce_event_receiver: std::sync::Mutex::new(announce_event_receiver),
         })
     }
 
@@ -61,32 +154,81 @@ impl TorrentTracker {
     pub async fn generate_auth_key(&self, seconds_valid: u64) -> Result<AuthKey, database::Error> {
         let auth_key = key::generate_auth_key(seconds_valid);
         self.database.add_key_to_keys(&auth_key).await?;
-        self.keys.write().await.insert(auth_key.key.clone(), auth_key.clone());
+
+        if let Some(key) = auth_key.to_bytes() {
+            self.keys.rcu(|keys| keys.with_changes([(key, Some(auth_key.valid_until))]));
+            self.merge_key_changes().await;
+        }
+
         Ok(auth_key)
     }
 
     pub async fn remove_auth_key(&self, key: &str) -> Result<(), database::Error> {
         self.database.remove_key_from_keys(&key).await?;
-        self.keys.write().await.remove(key);
+
+        if let Ok(key) = <[u8; AUTH_KEY_LENGTH]>::try_from(key.as_bytes()) {
+            self.keys.rcu(|keys| keys.with_changes([(key, None)]));
+            self.merge_key_changes().await;
+        }
+
         Ok(())
     }
 
-    pub async fn verify_auth_key(&self, auth_key: &AuthKey) -> Result<(), key::Error> {
-        match self.keys.read().await.get(&auth_key.key) {
+    // Add keys in batches, then swap them into the key map at once: a large import rebuilds the map only once.
+    // Keys written before a failing batch are added still, they are in the database.
+    pub async fn add_auth_keys(&self, auth_keys: &[AuthKey]) -> Result<usize, database::Error> {
+        let mut imported = 0;
+        let mut result = Ok(());
+
+        for batch in auth_keys.chunks(IMPORT_BATCH_SIZE) {
+            if let Err(e) = self.database.add_keys_to_keys(batch).await {
+                result = Err(e);
+                break;
+            }
+            imported += batch.len();
+        }
+
+        if imported > 0 {
+            self.keys.rcu(|keys| keys.with_changes(auth_keys[..imported].iter().filter_map(|auth_key| auth_key.to_bytes().map(|key| (key, Some(auth_key.valid_until))))));
+            self.merge_key_changes().await;
+        }
+
+        result.map(|_| imported)
+    }
+
+    // Once enough changes have piled up they are merged into a new base on the blocking pool, like the whitelist's
+    async fn merge_key_changes(&self) {
+        let keys = self.keys.load_full();
+        if keys.changes() < MAX_KEY_CHANGES { return; }
+        let _merging = match Merging::claim(&self.keys_merging) {
+            Some(merging) => merging,
+            None => return
+        };
+
+        let changed = keys.clone();
+        if let Ok(merged) = tokio::task::spawn_blocking(move || changed.merged()).await {
+            self.keys.compare_and_swap(&keys, Arc::new(merged));
+        }
+    }
+
+    pub fn verify_auth_key(&self, auth_key: &AuthKey) -> Result<(), key::Error> {
+        let key = auth_key.to_bytes().ok_or(key::Error::KeyInvalid)?;
+
+        match self.keys.load().get(&key) {
             None => Err(key::Error::KeyInvalid),
-            Some(key) => key::verify_auth_key(key)
+            Some(valid_until) => key::verify_valid_until(valid_until)
         }
     }
 
+    // The new key map is built aside and swapped in, requests keep using the old one until then
     pub async fn load_keys(&self) -> Result<(), database::Error> {
         let keys_from_database = self.database.load_keys().await?;
-        let mut keys = self.keys.write().await;
 
-        keys.clear();
+        let keys: KeyHashMap<[u8; AUTH_KEY_LENGTH], Option<u64>> = keys_from_database.iter()
+            .filter_map(|auth_key| auth_key.to_bytes().map(|key| (key, auth_key.valid_until)))
+            .collect();
 
-        for key in keys_from_database {
-            let _ = keys.insert(key.key.clone(), key);
-        }
+        self.keys.store(Arc::new(AuthKeys::new(keys)));
 
         Ok(())
     }
@@ -94,34 +236,85 @@ impl TorrentTracker {
     // Adding torrents is not relevant to public trackers.
     pub async fn add_torrent_to_whitelist(&self, info_hash: &InfoHash) -> Result<(), database::Error> {
         self.database.add_info_hash_to_whitelist(info_hash.clone()).await?;
-        self.whitelist.write().await.insert(info_hash.clone());
+        self.whitelist.rcu(|whitelist| whitelist.with_added(std::slice::from_ref(info_hash)));
+        self.merge_whitelist_changes().await;
         Ok(())
     }
 
+    // Whitelist torrents in batches, then swap them into the whitelist at once: a large import rebuilds the set only once.
+    // Hashes written before a failing batch are whitelisted still, they are in the database.
+    pub async fn add_torrents_to_whitelist(&self, info_hashes: &[InfoHash]) -> Result<usize, database::Error> {
+        let mut imported = 0;
+        let mut result = Ok(());
+
+        for batch in info_hashes.chunks(IMPORT_BATCH_SIZE) {
+            if let Err(e) = self.database.add_info_hashes_to_whitelist(batch).await {
+                result = Err(e);
+                break;
+            }
+            imported += batch.len();
+        }
+
+        if imported > 0 {
+            self.whitelist.rcu(|whitelist| whitelist.with_added(&info_hashes[..imported]));
+            self.merge_whitelist_changes().await;
+        }
+
+        result.map(|_| imported)
+    }
+
     // Removing torrents is not relevant to public trackers.
     pub async fn remove_torrent_from_whitelist(&self, info_hash: &InfoHash) -> Result<(), database::Error> {
         self.database.remove_info_hash_from_whitelist(info_hash.clone()).await?;
-        self.whitelist.write().await.remove(info_hash);
+        self.whitelist.rcu(|whitelist| whitelist.without(info_hash));
+        self.merge_whitelist_changes().await;
         Ok(())
     }
 
-    pub async fn is_info_hash_whitelisted(&self, info_hash: &InfoHash) -> bool {
-        self.whitelist.read().await.contains(info_hash)
+    // Once enough changes have piled up they are merged into a new base on the blocking pool. The result
+    // only replaces the snapshot it was built from: after a concurrent change the next one merges again.
+    async fn merge_whitelist_changes(&self) {
+        let whitelist = self.whitelist.load_full();
+        if whitelist.changes() < MAX_WHITELIST_CHANGES { return; }
+        let _merging = match Merging::claim(&self.whitelist_merging) {
+            Some(merging) => merging,
+            None => return
+        };
+
+        let changed = whitelist.clone();
+        if let Ok(merged) = tokio::task::spawn_blocking(move || changed.merged()).await {
+            self.whitelist.compare_and_swap(&whitelist, Arc::new(merged));
+        }
+    }
+
+    pub fn is_info_hash_whitelisted(&self, info_hash: &InfoHash) -> bool {
+        self.whitelist.load().contains(info_hash)
     }
 
+    // The new whitelist is built aside and swapped in, requests keep using the old one until then
     pub async fn load_whitelist(&self) -> Result<(), database::Error> {
         let whitelisted_torrents_from_database = self.database.load_whitelist().await?;
-        let mut whitelist = self.whitelist.write().await;
-
-        whitelist.clear();
+        let whitelist = tokio::task::spawn_blocking(move || Whitelist::new(InfoHashSet::from_vec(whitelisted_torrents_from_database))).await
+            .map_err(|_| database::Error::DatabaseError)?;
 
-        for info_hash in whitelisted_torrents_from_database {
-            let _ = whitelist.insert(info_hash);
-        }
+        self.whitelist.store(Arc::new(whitelist));
 
         Ok(())
     }
 
+    // Load the whitelist from a prebuilt file of raw 20 byte info hashes instead of the database,
+    // returns the number of whitelisted torrents
+    pub async fn load_whitelist_file(&self, path: &str) -> io::Result<usize> {
+        let path = path.to_owned();
+        let whitelist = tokio::task::spawn_blocking(move || InfoHashSet::from_file_contents(&std::fs::read(path)?)).await
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))??;
+        let whitelisted_torrents = whitelist.len();
+
+        self.whitelist.store(Arc::new(Whitelist::new(whitelist)));
+
+        Ok(whitelisted_torrents)
+    }
+
     pub async fn authenticate_request(&self, info_hash: &InfoHash, key: &Option<AuthKey>) -> Result<(), TorrentError> {
         // no authentication needed in public mode
         if self.is_public() { return Ok(()); }
@@ -130,7 +323,7 @@ impl TorrentTracker {
         if self.is_private() {
             match key {
                 Some(key) => {
-                    if self.verify_auth_key(key).await.is_err() {
+                    if self.verify_auth_key(key).is_err() {
                         return Err(TorrentError::PeerKeyNotValid);
                     }
                 }
@@ -142,7 +335,7 @@ impl TorrentTracker {
 
         // check if info_hash is whitelisted
         if self.is_whitelisted() {
-            if !self.is_info_hash_whitelisted(info_hash).await {
+            if !self.is_info_hash_whitelisted(info_hash) {
                 return Err(TorrentError::TorrentNotWhitelisted);
             }
         }
@@ -150,42 +343,243 @@ impl TorrentTracker {
         Ok(())
     }
 
+    // Stats of every torrent in `info_hashes`, in the same order, for a scrape. Torrents that are unknown
+    // or that the request is not authorized for are None. The key is verified once for the whole batch and
+    // every hash is checked against the same whitelist snapshot.
+    pub async fn scrape_torrents(&self, info_hashes: &[InfoHash], key: &Option<AuthKey>) -> Vec<Option<TorrentStats>> {
+        if self.is_private() && !key.as_ref().map_or(false, |key| self.verify_auth_key(key).is_ok()) {
+            return info_hashes.iter().map(|_| None).collect();
+        }
+
+        let whitelist = if self.is_whitelisted() { Some(self.whitelist.load_full()) } else { None };
+        let is_authorized = |info_hash: &InfoHash| whitelist.as_ref().map_or(true, |whitelist| whitelist.contains(info_hash));
+
+        if let Some(cluster) = &self.cluster {
+            let authorized: Vec<usize> = (0..info_hashes.len()).filter(|&position| is_authorized(&info_hashes[position])).collect();
+            let authorized_info_hashes: Vec<InfoHash> = authorized.iter().map(|&position| info_hashes[position].clone()).collect();
+
+            // the torrents no other node answered for are this node's
+            let forwarded = cluster.scrape(&authorized_info_hashes).await;
+            let local_info_hashes: Vec<InfoHash> = authorized_info_hashes.iter().zip(&forwarded)
+                .filter(|(_, torrent_stats)| torrent_stats.is_none())
+                .map(|(info_hash, _)| info_hash.clone())
+                .collect();
+            let mut local = self.torrents.get_torrents_stats(&local_info_hashes).await.into_iter();
+
+            let mut torrents_stats: Vec<Option<TorrentStats>> = info_hashes.iter().map(|_| None).collect();
+            for (position, torrent_stats) in authorized.into_iter().zip(forwarded) {
+                torrents_stats[position] = match torrent_stats {
+                    Some(torrent_stats) => torrent_stats,
+                    None => local.next().flatten()
+                };
+            }
+
+            return torrents_stats;
+        }
+
+        let mut torrents_stats = self.torrents.get_torrents_stats(info_hashes).await;
+
+        for (info_hash, torrent_stats) in info_hashes.iter().zip(torrents_stats.iter_mut()) {
+            if !is_authorized(info_hash) { *torrent_stats = None; }
+        }
+
+        torrents_stats
+    }
+
     // Loading the torrents from database into memory
     pub async fn load_persistent_torrents(&self) -> Result<(), database::Error> {
         let persistent_torrents = self.database.load_persistent_torrents().await?;
-        let mut torrents = self.torrents.write().await;
 
         for (info_hash, completed) in persistent_torrents {
+            let mut torrents = self.torrents.get_shard_mut(&info_hash).await;
+
             // Skip if torrent entry already exists
             if torrents.contains_key(&info_hash) { continue; }
 
-            let torrent_entry = TorrentEntry {
-                peers: Default::default(),
-                completed,
-            };
+            let mut torrent_entry = TorrentEntry::new();
+            torrent_entry.completed = completed;
 
+            self.swarm_totals.add_torrent(torrent_entry.get_stats());
             torrents.insert(info_hash.clone(), torrent_entry);
         }
 
         Ok(())
     }
 
-    pub async fn get_torrent_peers(&self, info_hash: &InfoHash, client_addr: &SocketAddr, ) -> Vec<TorrentPeer> {
-        let read_lock = self.torrents.read().await;
+    // Write every torrent and its peers to a snapshot file, one section per shard.
+    // A shard is only locked while its section is encoded, the file is written on the blocking pool.
+    pub async fn save_swarm_snapshot(&self, path: &str) -> io::Result<u64> {
+        let now = coarse_time();
+        let mut sections: Vec<SnapshotSection> = Vec::with_capacity(self.torrents.shard_count());
+
+        for index in 0..self.torrents.shard_count() {
+            let mut section = SnapshotSection::default();
+
+            for (info_hash, torrent_entry) in self.torrents.read_shard(index).await.iter() {
+                section.push_torrent(info_hash, torrent_entry, now);
+            }
+
+            sections.push(section);
+            tokio::task::yield_now().await;
+        }
+
+        let torrents = sections.iter().map(|section| section.torrents).sum();
+        let path = path.to_owned();
+
+        tokio::task::spawn_blocking(move || snapshot::write_snapshot_file(&path, current_time(), &sections)).await
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))??;
+
+        Ok(torrents)
+    }
+
+    // Restore torrents and their peers from a snapshot file, decoding its sections in parallel on the
+    // blocking pool. Peers that have timed out since the snapshot was saved are left out.
+    pub async fn load_swarm_snapshot(&self, path: &str) -> io::Result<u64> {
+        let path = path.to_owned();
+        let data = tokio::task::spawn_blocking(move || std::fs::read(path)).await
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))??;
+
+        let (saved_at, sections) = snapshot::read_sections(&data)?;
+        let elapsed = current_time().saturating_sub(saved_at).min(u32::MAX as u64) as u32;
+        let max_peer_timeout = self.config.max_peer_timeout;
+        let data = Arc::new(data);
+
+        let decoders: Vec<_> = sections.into_iter().map(|section| {
+            let data = data.clone();
+            tokio::task::spawn_blocking(move || snapshot::decode_section(&data[section], elapsed, max_peer_timeout))
+        }).collect();
+
+        let mut restored_torrents = 0;
+
+        for decoder in decoders {
+            let torrents = decoder.await.map_err(|e| io::Error::new(io::ErrorKind::Other, e))??;
+            let mut torrents = torrents.into_iter().peekable();
+
+            // sections are in info hash order, so consecutive torrents mostly share a shard
+            while let Some((info_hash, torrent_entry)) = torrents.next() {
+                let index = self.torrents.shard_index(&info_hash);
+                let mut shard = self.torrents.write_shard(index).await;
+
+                self.restore_torrent(&mut shard, info_hash, torrent_entry);
+                restored_torrents += 1;
+
+                while let Some((info_hash, torrent_entry)) = torrents.next_if(|(info_hash, _)| self.torrents.shard_index(info_hash) == index) {
+                    self.restore_torrent(&mut shard, info_hash, torrent_entry);
+                    restored_torrents += 1;
+                }
+            }
+        }
+
+        Ok(restored_torrents)
+    }
+
+    // Keeps the higher completed counter if the torrent is already known, e.g. loaded from the database
+    fn restore_torrent(&self, torrents: &mut TorrentShard, info_hash: InfoHash, mut torrent_entry: TorrentEntry) {
+        match torrents.entry(info_hash) {
+            Entry::Vacant(vacant) => {
+                self.swarm_totals.add_torrent(torrent_entry.get_stats());
+                vacant.insert(torrent_entry);
+            }
+            Entry::Occupied(mut entry) => {
+                let existing_entry = entry.get_mut();
+                let stats_before = existing_entry.get_stats();
 
-        match read_lock.get(info_hash) {
-            None => vec![],
-            Some(entry) => {
-                entry.get_peers(Some(client_addr)).into_iter().cloned().collect()
+                torrent_entry.completed = torrent_entry.completed.max(existing_entry.completed);
+                *existing_entry = torrent_entry;
+
+                self.swarm_totals.update_torrent(stats_before, existing_entry.get_stats());
             }
         }
     }
 
+    // Whether a request from `ip` is within the rate limit, checked before a request touches any torrent
+    pub fn check_rate_limit(&self, ip: IpAddr) -> bool {
+        match &self.rate_limiter {
+            Some(rate_limiter) => {
+                let allowed = rate_limiter.check(ip);
+                if !allowed { self.metrics.rate_limited_requests.add(1); }
+                allowed
+            }
+            None => true
+        }
+    }
+
+    // The number of peers to return for an announce, the client's numwant capped by the configured maximum
+    pub fn get_numwant(&self, numwant: Option<u32>) -> usize {
+        match numwant {
+            Some(numwant) => numwant.min(self.config.max_peers_per_announce) as usize,
+            None => self.config.max_peers_per_announce as usize
+        }
+    }
+
     pub async fn update_torrent_with_peer_and_get_stats(&self, info_hash: &InfoHash, peer: &TorrentPeer) -> TorrentStats {
-        let mut torrents = self.torrents.write().await;
+        if self.cluster.is_some() {
+            return self.update_torrent_with_peer_and_get_peers(info_hash, peer, Some(0), |_peer_id, _compact_addr| {}).await;
+        }
+
+        self.export_announce(info_hash, peer);
+
+        self.update_local_torrent(info_hash, peer, |_torrent_entry| {}).await
+    }
+
+    // Update the torrent with the announcing peer and pass up to `numwant` random peers for the
+    // announce response (excluding the announcing peer's ip) to `write_peer`, all under a single shard lock.
+    // Peers are passed as their id and compact address (BEP 23 / BEP 7 encoding).
+    // When clustered, this is done by the node owning the torrent.
+    pub async fn update_torrent_with_peer_and_get_peers<F>(&self, info_hash: &InfoHash, peer: &TorrentPeer, numwant: Option<u32>, mut write_peer: F) -> TorrentStats
+        where F: FnMut(&PeerId, &[u8])
+    {
+        self.export_announce(info_hash, peer);
+
+        if let Some(cluster) = &self.cluster {
+            if let Some(torrent_stats) = cluster.announce(info_hash, peer, self.get_numwant(numwant) as u32, &mut write_peer).await {
+                return torrent_stats;
+            }
+        }
+
+        self.update_local_torrent_with_peer_and_get_peers(info_hash, peer, numwant, write_peer).await
+    }
+
+    // As `update_torrent_with_peer_and_get_peers` for compact responses: only the compact addresses are
+    // passed to `write_peers`, as one or more records per call, so hot swarms can be served from their
+    // cached compact peer string
+    pub async fn update_torrent_with_peer_and_get_compact_peers<F>(&self, info_hash: &InfoHash, peer: &TorrentPeer, numwant: Option<u32>, mut write_peers: F) -> TorrentStats
+        where F: FnMut(&[u8])
+    {
+        self.export_announce(info_hash, peer);
+
+        if let Some(cluster) = &self.cluster {
+            if let Some(torrent_stats) = cluster.announce(info_hash, peer, self.get_numwant(numwant) as u32, |_peer_id, compact_addr| write_peers(compact_addr)).await {
+                return torrent_stats;
+            }
+        }
+
+        let numwant = self.get_numwant(numwant);
+
+        self.update_local_torrent(info_hash, peer, |torrent_entry| {
+            torrent_entry.sample_compact_peers_cached(&peer.peer_addr, numwant, &self.announce_cache, write_peers)
+        }).await
+    }
+
+    // As `update_torrent_with_peer_and_get_peers`, on this node's own swarm
+    pub async fn update_local_torrent_with_peer_and_get_peers<F>(&self, info_hash: &InfoHash, peer: &TorrentPeer, numwant: Option<u32>, write_peer: F) -> TorrentStats
+        where F: FnMut(&PeerId, &[u8])
+    {
+        let numwant = self.get_numwant(numwant);
+
+        self.update_local_torrent(info_hash, peer, |torrent_entry| torrent_entry.sample_peers(&peer.peer_addr, numwant, write_peer)).await
+    }
+
+    // Update this node's swarm with the announcing peer and `sample` its peers, under a single shard lock
+    async fn update_local_torrent<S: FnOnce(&mut TorrentEntry)>(&self, info_hash: &InfoHash, peer: &TorrentPeer, sample: S) -> TorrentStats {
+        let wait_start = self.metrics.now();
+        let mut torrents = self.torrents.get_shard_mut(info_hash).await;
+        self.metrics.shard_lock_wait.observe_since(wait_start);
+        let locked_at = self.metrics.now();
 
         let torrent_entry = match torrents.entry(info_hash.clone()) {
             Entry::Vacant(vacant) => {
+                self.swarm_totals.add_torrent((0, 0, 0));
                 vacant.insert(TorrentEntry::new())
             }
             Entry::Occupied(entry) => {
@@ -193,15 +587,40 @@ impl TorrentTracker {
             }
         };
 
+        let torrent_stats = self.update_torrent_entry(info_hash, torrent_entry, peer);
+
+        sample(torrent_entry);
+
+        self.metrics.shard_lock_hold.observe_since(locked_at);
+
+        torrent_stats
+    }
+
+    // Queue the announce for the export job. The event is dropped when the buffer is full,
+    // an announce never waits for the export.
+    fn export_announce(&self, info_hash: &InfoHash, peer: &TorrentPeer) {
+        if let Some(sender) = &self.announce_event_sender {
+            if sender.try_send(announce_events::encode(info_hash, peer, current_time())).is_err() {
+                self.metrics.announce_events_dropped.add(1);
+            }
+        }
+    }
+
+    fn update_torrent_entry(&self, info_hash: &InfoHash, torrent_entry: &mut TorrentEntry, peer: &TorrentPeer) -> TorrentStats {
+        let stats_before = torrent_entry.get_stats();
         let stats_updated = torrent_entry.update_peer(peer);
 
-        // todo: move this action to a separate worker
+        // written behind by the torrent persistence job, never while holding the shard lock
         if self.config.persistent_torrent_completed_stat && stats_updated {
-            let _ = self.database.save_persistent_torrent(&info_hash, torrent_entry.completed).await;
+            if self.completed_sender.send((info_hash.clone(), torrent_entry.completed)).is_ok() {
+                self.metrics.persistence_backlog.add(1);
+            }
         }
 
         let (seeders, completed, leechers) = torrent_entry.get_stats();
 
+        self.swarm_totals.update_torrent(stats_before, (seeders, completed, leechers));
+
         TorrentStats {
             seeders,
             leechers,
@@ -209,36 +628,110 @@ impl TorrentTracker {
         }
     }
 
-    pub async fn get_torrents(&self) -> RwLockReadGuard<'_, BTreeMap<InfoHash, TorrentEntry>> {
-        self.torrents.read().await
+    // When clustered, from the node owning the torrent
+    pub async fn get_local_torrent_stats(&self, info_hash: &InfoHash) -> Option<TorrentStats> {
+        let read_lock = self.torrents.get_shard(info_hash).await;
+
+        read_lock.get(info_hash).map(|torrent_entry| {
+            let (seeders, completed, leechers) = torrent_entry.get_stats();
+
+            TorrentStats {
+                seeders,
+                leechers,
+                completed,
+            }
+        })
     }
 
-    pub async fn get_stats(&self) -> RwLockReadGuard<'_, TrackerStatistics> {
-        self.stats_tracker.get_stats().await
+    // The receiving end of the completed counter updates, can only be taken once
+    pub fn take_completed_receiver(&self) -> Option<UnboundedReceiver<(InfoHash, u32)>> {
+        self.completed_receiver.lock().unwrap().take()
     }
 
-    pub async fn send_stats_event(&self, event: TrackerStatisticsEvent) -> Option<Result<(), SendError<TrackerStatisticsEvent>>> {
-        self.stats_tracker.send_event(event).await
+    // The announces to export, for the announce export job
+    pub fn take_announce_event_receiver(&self) -> Option<Receiver<EncodedAnnounceEvent>> {
+        self.announce_event_receiver.lock().unwrap().take()
     }
 
-    // Remove inactive peers and (optionally) peerless torrents
-    pub async fn cleanup_torrents(&self) {
-        let mut torrents_lock = self.torrents.write().await;
+    // Write a batch of completed counters in a single transaction
+    pub async fn save_persistent_torrents(&self, torrents: &[(InfoHash, u32)]) -> Result<(), database::Error> {
+        let start_time = self.metrics.now();
+        let result = self.database.save_persistent_torrents(torrents).await;
+        self.metrics.database_write_duration.observe_since(start_time);
+        result
+    }
+
+    pub fn get_torrents(&self) -> &TorrentRepository {
+        &self.torrents
+    }
+
+    pub fn metrics(&self) -> &Metrics {
+        &self.metrics
+    }
+
+    pub fn get_stats(&self) -> TrackerStatistics {
+        self.stats_tracker.get_stats()
+    }
+
+    pub fn send_stats_event(&self, event: TrackerStatisticsEvent) {
+        self.stats_tracker.send_event(event)
+    }
 
-        // If we don't need to remove torrents we will use the faster iter
-        if self.config.remove_peerless_torrents {
-            torrents_lock.retain(|_, torrent_entry| {
-                torrent_entry.remove_inactive_peers(self.config.max_peer_timeout);
+    // Torrent, seeder, completed and leecher totals over all torrents
+    pub fn get_swarm_stats(&self) -> SwarmStatistics {
+        self.swarm_totals.get_stats()
+    }
 
-                match self.config.persistent_torrent_completed_stat {
-                    true => { torrent_entry.completed > 0 || torrent_entry.peers.len() > 0 }
-                    false => { torrent_entry.peers.len() > 0 }
+    // Remove inactive peers and (optionally) peerless torrents.
+    // A shard lock is only held for CLEANUP_BATCH_SIZE torrents at a time, then released and the
+    // task yields so waiting announces get through, and the next batch resumes after the last info hash.
+    pub async fn cleanup_torrents(&self) {
+        let start_time = self.metrics.now();
+
+        for index in 0..self.torrents.shard_count() {
+            let mut last_info_hash: Option<InfoHash> = None;
+
+            loop {
+                let mut torrents_lock = self.torrents.write_shard(index).await;
+                let mut peerless_torrents: Vec<InfoHash> = Vec::new();
+                let mut cleaned_torrents = 0;
+
+                let lower_bound = match last_info_hash {
+                    Some(info_hash) => Bound::Excluded(info_hash),
+                    None => Bound::Unbounded
+                };
+
+                for (info_hash, torrent_entry) in torrents_lock.range_mut((lower_bound, Bound::Unbounded)).take(CLEANUP_BATCH_SIZE) {
+                    cleaned_torrents += 1;
+                    last_info_hash = Some(*info_hash);
+
+                    let stats_before = torrent_entry.get_stats();
+                    torrent_entry.remove_inactive_peers(self.config.max_peer_timeout);
+
+                    let keep = !self.config.remove_peerless_torrents || match self.config.persistent_torrent_completed_stat {
+                        true => { torrent_entry.completed > 0 || torrent_entry.get_peers_len() > 0 }
+                        false => { torrent_entry.get_peers_len() > 0 }
+                    };
+
+                    if keep {
+                        self.swarm_totals.update_torrent(stats_before, torrent_entry.get_stats());
+                    } else {
+                        self.swarm_totals.remove_torrent(stats_before);
+                        peerless_torrents.push(*info_hash);
+                    }
                 }
-            });
-        } else {
-            for (_, torrent_entry) in torrents_lock.iter_mut() {
-                torrent_entry.remove_inactive_peers(self.config.max_peer_timeout);
+
+                for info_hash in peerless_torrents.iter() {
+                    torrents_lock.remove(info_hash);
+                }
+
+                drop(torrents_lock);
+                tokio::task::yield_now().await;
+
+                if cleaned_torrents < CLEANUP_BATCH_SIZE { break; }
             }
         }
+
+        self.metrics.cleanup_duration.observe_since(start_time);
     }
 }
@@ -0,0 +1,224 @@
+use std::io;
+use std::sync::Arc;
+
+use crate::protocol::common::InfoHash;
+
+// lookups are narrowed down to the hashes sharing their first two bytes
+const PREFIX_BUCKETS: usize = 1 << 16;
+const INFO_HASH_LENGTH: usize = 20;
+// hashes added and removed before they are merged into a new base set
+pub const MAX_WHITELIST_CHANGES: usize = 4096;
+
+// The whitelisted info hashes as one sorted array, 20 bytes per torrent and no per entry overhead.
+// A table of where every two byte prefix starts cuts a lookup down to a binary search over a
+// handful of hashes, and turns a hash whose prefix is not listed away without touching the array.
+// The set is immutable: changes are kept beside it in a `Whitelist` until they are merged into a new one.
+pub struct InfoHashSet {
+    info_hashes: Vec<InfoHash>,
+    // the hashes starting with prefix p are info_hashes[bucket_starts[p]..bucket_starts[p + 1]],
+    // empty for an empty set
+    bucket_starts: Vec<u32>,
+}
+
+impl InfoHashSet {
+    pub fn new() -> InfoHashSet {
+        InfoHashSet {
+            info_hashes: Vec::new(),
+            bucket_starts: Vec::new(),
+        }
+    }
+
+    pub fn from_vec(mut info_hashes: Vec<InfoHash>) -> InfoHashSet {
+        // sorting takes linear time when the hashes are already in order, as in a prebuilt file
+        info_hashes.sort_unstable();
+        info_hashes.dedup();
+        Self::from_sorted(info_hashes)
+    }
+
+    // A prebuilt whitelist file: the info hashes as raw 20 byte values, back to back, preferably sorted
+    pub fn from_file_contents(data: &[u8]) -> io::Result<InfoHashSet> {
+        if data.len() % INFO_HASH_LENGTH != 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "whitelist file is not a sequence of 20 byte info hashes"));
+        }
+
+        Ok(Self::from_vec(data.chunks_exact(INFO_HASH_LENGTH).map(InfoHash::from).collect()))
+    }
+
+    fn from_sorted(mut info_hashes: Vec<InfoHash>) -> InfoHashSet {
+        if info_hashes.is_empty() { return InfoHashSet::new(); }
+
+        info_hashes.shrink_to_fit();
+
+        let mut bucket_starts: Vec<u32> = Vec::with_capacity(PREFIX_BUCKETS + 1);
+        let mut position = 0;
+
+        for prefix in 0..PREFIX_BUCKETS {
+            while position < info_hashes.len() && Self::prefix(&info_hashes[position]) < prefix {
+                position += 1;
+            }
+            bucket_starts.push(position as u32);
+        }
+        bucket_starts.push(info_hashes.len() as u32);
+
+        InfoHashSet {
+            info_hashes,
+            bucket_starts,
+        }
+    }
+
+    fn prefix(info_hash: &InfoHash) -> usize {
+        (info_hash.0[0] as usize) << 8 | info_hash.0[1] as usize
+    }
+
+    pub fn contains(&self, info_hash: &InfoHash) -> bool {
+        if self.info_hashes.is_empty() { return false; }
+
+        let prefix = Self::prefix(info_hash);
+        let bucket = &self.info_hashes[self.bucket_starts[prefix] as usize..self.bucket_starts[prefix + 1] as usize];
+
+        bucket.binary_search(info_hash).is_ok()
+    }
+
+    pub fn len(&self) -> usize {
+        self.info_hashes.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.info_hashes.is_empty()
+    }
+
+    // A new set with the given sorted hashes added and removed, merged in one pass over the current ones
+    fn with_changes(&self, added: &[InfoHash], removed: &[InfoHash]) -> InfoHashSet {
+        Self::from_sorted(merge_sorted(&self.info_hashes, added, removed))
+    }
+}
+
+// The whitelist as served: a large immutable base set shared between snapshots, and the few hashes
+// added and removed since it was built. A single change copies only those, the base is rebuilt
+// with them once `MAX_WHITELIST_CHANGES` have piled up.
+#[derive(Clone)]
+pub struct Whitelist {
+    base: Arc<InfoHashSet>,
+    // sorted and disjoint
+    added: Vec<InfoHash>,
+    removed: Vec<InfoHash>,
+}
+
+impl Whitelist {
+    pub fn new(base: InfoHashSet) -> Whitelist {
+        Whitelist {
+            base: Arc::new(base),
+            added: Vec::new(),
+            removed: Vec::new(),
+        }
+    }
+
+    pub fn contains(&self, info_hash: &InfoHash) -> bool {
+        if !self.removed.is_empty() && self.removed.binary_search(info_hash).is_ok() { return false; }
+
+        (!self.added.is_empty() && self.added.binary_search(info_hash).is_ok()) || self.base.contains(info_hash)
+    }
+
+    // hashes added or removed since the base was built
+    pub fn changes(&self) -> usize {
+        self.added.len() + self.removed.len()
+    }
+
+    pub fn with_added(&self, info_hashes: &[InfoHash]) -> Whitelist {
+        let mut info_hashes = info_hashes.to_vec();
+        info_hashes.sort_unstable();
+        info_hashes.dedup();
+
+        Whitelist {
+            base: self.base.clone(),
+            added: merge_sorted(&self.added, &info_hashes, &[]),
+            removed: merge_sorted(&self.removed, &[], &info_hashes),
+        }
+    }
+
+    pub fn without(&self, info_hash: &InfoHash) -> Whitelist {
+        let info_hash = std::slice::from_ref(info_hash);
+
+        Whitelist {
+            base: self.base.clone(),
+            added: merge_sorted(&self.added, &[], info_hash),
+            removed: merge_sorted(&self.removed, info_hash, &[]),
+        }
+    }
+
+    // The same whitelist with the changes folded into a new base, takes a pass over the whole set
+    pub fn merged(&self) -> Whitelist {
+        Self::new(self.base.with_changes(&self.added, &self.removed))
+    }
+}
+
+// The sorted hashes of `current` and `added` without those in `removed`, all three sorted
+fn merge_sorted(current: &[InfoHash], added: &[InfoHash], removed: &[InfoHash]) -> Vec<InfoHash> {
+    let mut merged: Vec<InfoHash> = Vec::with_capacity(current.len() + added.len());
+    let mut current = current.iter().peekable();
+
+    for info_hash in added {
+        while let Some(existing) = current.next_if(|existing| *existing < info_hash) {
+            merged.push(*existing);
+        }
+        if current.peek() != Some(&info_hash) {
+            merged.push(*info_hash);
+        }
+    }
+    merged.extend(current);
+
+    if !removed.is_empty() {
+        // retain visits the hashes in order, so one walk over the removed ones does
+        let mut removed = removed.iter().peekable();
+        merged.retain(|info_hash| {
+            while removed.next_if(|removed| *removed < info_hash).is_some() {}
+            removed.peek() != Some(&info_hash)
+        });
+    }
+
+    merged
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn info_hash(first: u8, second: u8, last: u8) -> InfoHash {
+        let mut bytes = [0u8; 20];
+        bytes[0] = first;
+        bytes[1] = second;
+        bytes[19] = last;
+        InfoHash(bytes)
+    }
+
+    #[test]
+    fn inserted_and_removed_hashes_are_found_in_their_prefix_bucket() {
+        let set = InfoHashSet::from_vec(vec![info_hash(0xff, 0xff, 1), info_hash(0, 0, 1), info_hash(0x12, 0x34, 2), info_hash(0, 0, 1)]);
+        assert_eq!(set.len(), 3);
+
+        let set = set.with_changes(&[info_hash(0x12, 0x34, 1), info_hash(0xff, 0xff, 1)], &[info_hash(0, 0, 1)]);
+        assert_eq!(set.len(), 3);
+        assert!(set.contains(&info_hash(0x12, 0x34, 1)));
+        assert!(set.contains(&info_hash(0xff, 0xff, 1)));
+        assert!(!set.contains(&info_hash(0, 0, 1)));
+        assert!(!set.contains(&info_hash(0x12, 0x34, 3)));
+        assert!(!set.contains(&info_hash(0x12, 0x35, 1)));
+        assert!(set.with_changes(&[], &[info_hash(0x12, 0x34, 1), info_hash(0x12, 0x34, 2), info_hash(0xff, 0xff, 1)]).is_empty());
+    }
+
+    #[test]
+    fn changes_are_seen_before_and_after_they_are_merged() {
+        let whitelist = Whitelist::new(InfoHashSet::from_vec(vec![info_hash(0, 0, 1), info_hash(0x12, 0x34, 2)]));
+
+        let whitelist = whitelist.with_added(&[info_hash(0x12, 0x34, 1), info_hash(0, 0, 1)]).without(&info_hash(0x12, 0x34, 2));
+        let whitelist = whitelist.without(&info_hash(0, 0, 1)).with_added(&[info_hash(0, 0, 1)]).without(&info_hash(0x12, 0x34, 1));
+        assert_eq!(whitelist.changes(), 3);
+
+        for whitelist in [&whitelist, &whitelist.merged()] {
+            assert!(whitelist.contains(&info_hash(0, 0, 1)));
+            assert!(!whitelist.contains(&info_hash(0x12, 0x34, 1)));
+            assert!(!whitelist.contains(&info_hash(0x12, 0x34, 2)));
+        }
+        assert_eq!(whitelist.merged().changes(), 0);
+    }
+}
@@ -0,0 +1,174 @@
+use std::io;
+use std::net::{Ipv4Addr, Ipv6Addr, SocketAddr, SocketAddrV4, SocketAddrV6};
+use std::os::unix::io::AsRawFd;
+
+use log::debug;
+use tokio::io::Interest;
+use tokio::net::UdpSocket;
+
+use crate::udp::MAX_PACKET_SIZE;
+
+pub const BATCH_SIZE: usize = 32;
+
+// A fixed ring of packet buffers, received or sent with a single recvmmsg/sendmmsg call.
+// The buffers and the message headers pointing into them are allocated once per worker.
+pub struct PacketBatch {
+    buffers: Vec<[u8; MAX_PACKET_SIZE]>,
+    addresses: Vec<libc::sockaddr_storage>,
+    iovecs: Vec<libc::iovec>,
+    headers: Vec<libc::mmsghdr>,
+    lengths: Vec<usize>,
+    len: usize,
+}
+
+// The raw pointers in `iovecs` and `headers` only ever point into the heap allocations
+// owned by the batch itself, which are never resized.
+unsafe impl Send for PacketBatch {}
+
+impl PacketBatch {
+    pub fn new() -> PacketBatch {
+        let mut batch = PacketBatch {
+            buffers: vec![[0u8; MAX_PACKET_SIZE]; BATCH_SIZE],
+            addresses: vec![unsafe { std::mem::zeroed() }; BATCH_SIZE],
+            iovecs: Vec::with_capacity(BATCH_SIZE),
+            headers: Vec::with_capacity(BATCH_SIZE),
+            lengths: vec![0; BATCH_SIZE],
+            len: 0,
+        };
+
+        for i in 0..BATCH_SIZE {
+            batch.iovecs.push(libc::iovec {
+                iov_base: batch.buffers[i].as_mut_ptr() as *mut libc::c_void,
+                iov_len: MAX_PACKET_SIZE,
+            });
+        }
+
+        for i in 0..BATCH_SIZE {
+            let mut header: libc::mmsghdr = unsafe { std::mem::zeroed() };
+            header.msg_hdr.msg_name = &mut batch.addresses[i] as *mut libc::sockaddr_storage as *mut libc::c_void;
+            header.msg_hdr.msg_namelen = std::mem::size_of::<libc::sockaddr_storage>() as libc::socklen_t;
+            header.msg_hdr.msg_iov = &mut batch.iovecs[i] as *mut libc::iovec;
+            header.msg_hdr.msg_iovlen = 1;
+            batch.headers.push(header);
+        }
+
+        batch
+    }
+
+    pub fn clear(&mut self) {
+        self.len = 0;
+    }
+
+    pub fn payload(&self, index: usize) -> &[u8] {
+        &self.buffers[index][..self.lengths[index]]
+    }
+
+    pub fn remote_addr(&self, index: usize) -> Option<SocketAddr> {
+        sockaddr_to_socket_addr(&self.addresses[index])
+    }
+
+    // Waits for at least one datagram and receives as many as fit in the batch
+    pub async fn recv(&mut self, socket: &UdpSocket) -> io::Result<usize> {
+        loop {
+            socket.readable().await?;
+
+            match socket.try_io(Interest::READABLE, || self.recvmmsg(socket.as_raw_fd())) {
+                Ok(received) => return Ok(received),
+                Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => continue,
+                Err(e) => return Err(e),
+            }
+        }
+    }
+
+    fn recvmmsg(&mut self, fd: libc::c_int) -> io::Result<usize> {
+        for i in 0..BATCH_SIZE {
+            self.iovecs[i].iov_len = MAX_PACKET_SIZE;
+            self.headers[i].msg_hdr.msg_namelen = std::mem::size_of::<libc::sockaddr_storage>() as libc::socklen_t;
+            self.headers[i].msg_len = 0;
+        }
+
+        let received = unsafe {
+            libc::recvmmsg(fd, self.headers.as_mut_ptr(), BATCH_SIZE as libc::c_uint, libc::MSG_DONTWAIT as _, std::ptr::null_mut())
+        };
+
+        if received < 0 { return Err(io::Error::last_os_error()); }
+
+        let received = received as usize;
+
+        for i in 0..received {
+            self.lengths[i] = self.headers[i].msg_len as usize;
+        }
+
+        self.len = received;
+
+        Ok(received)
+    }
+
+    // The next free buffer, for a response to be written into before it is pushed
+    pub fn response_buffer(&mut self) -> &mut [u8] {
+        &mut self.buffers[self.len][..]
+    }
+
+    // Queues the `len` bytes written into `response_buffer`, addressed to the sender of packet `index` in `request_batch`
+    pub fn push_response(&mut self, request_batch: &PacketBatch, index: usize, len: usize) {
+        let slot = self.len;
+
+        self.lengths[slot] = len;
+        self.addresses[slot] = request_batch.addresses[index];
+        self.headers[slot].msg_hdr.msg_namelen = request_batch.headers[index].msg_hdr.msg_namelen;
+        self.len += 1;
+    }
+
+    // Sends every buffered datagram, then empties the batch
+    pub async fn send(&mut self, socket: &UdpSocket) -> io::Result<()> {
+        let mut sent = 0;
+
+        while sent < self.len {
+            socket.writable().await?;
+
+            match socket.try_io(Interest::WRITABLE, || self.sendmmsg(socket.as_raw_fd(), sent)) {
+                Ok(count) => sent += count,
+                Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => continue,
+                Err(e) => {
+                    // doesn't matter if it reaches or not, skip the datagram that failed
+                    debug!("could not send datagram: {}", e);
+                    sent += 1;
+                }
+            }
+        }
+
+        self.clear();
+
+        Ok(())
+    }
+
+    fn sendmmsg(&mut self, fd: libc::c_int, offset: usize) -> io::Result<usize> {
+        for i in offset..self.len {
+            self.iovecs[i].iov_len = self.lengths[i];
+        }
+
+        let sent = unsafe {
+            libc::sendmmsg(fd, self.headers[offset..].as_mut_ptr(), (self.len - offset) as libc::c_uint, libc::MSG_DONTWAIT as _)
+        };
+
+        if sent < 0 { return Err(io::Error::last_os_error()); }
+
+        Ok(sent as usize)
+    }
+}
+
+fn sockaddr_to_socket_addr(address: &libc::sockaddr_storage) -> Option<SocketAddr> {
+    match address.ss_family as libc::c_int {
+        libc::AF_INET => {
+            let address = unsafe { &*(address as *const libc::sockaddr_storage as *const libc::sockaddr_in) };
+            let ip = Ipv4Addr::from(u32::from_be(address.sin_addr.s_addr));
+            Some(SocketAddr::V4(SocketAddrV4::new(ip, u16::from_be(address.sin_port))))
+        }
+        libc::AF_INET6 => {
+            let address = unsafe { &*(address as *const libc::sockaddr_storage as *const libc::sockaddr_in6) };
+            let ip = Ipv6Addr::from(address.sin6_addr.s6_addr);
+            Some(SocketAddr::V6(SocketAddrV6::new(ip, u16::from_be(address.sin6_port), address.sin6_flowinfo, address.sin6_scope_id)))
+        }
+        _ => None
+    }
+}
@@ -28,4 +28,10 @@ pub enum ServerError {
 
     #[error("bad request")]
     BadRequest,
+
+    #[error("connection id could not be verified")]
+    InvalidConnectionId,
+
+    #[error("too many requests, announce at most every {0} seconds")]
+    RateLimited(u32),
 }
@@ -1,16 +1,19 @@
-use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
+use std::io;
+use std::io::Cursor;
+use std::net::SocketAddr;
 use std::sync::Arc;
 
-use aquatic_udp_protocol::{AnnounceInterval, AnnounceRequest, AnnounceResponse, ConnectRequest, ConnectResponse, ErrorResponse, NumberOfDownloads, NumberOfPeers, Port, Request, Response, ResponsePeer, ScrapeRequest, ScrapeResponse, TorrentScrapeStatistics, TransactionId};
+use aquatic_udp_protocol::{AnnounceRequest, ConnectRequest, ConnectResponse, ErrorResponse, NumberOfDownloads, NumberOfPeers, Request, Response, ScrapeRequest, ScrapeResponse, TorrentScrapeStatistics, TransactionId};
 
 use crate::{InfoHash, MAX_SCRAPE_TORRENTS};
-use crate::peer::TorrentPeer;
+use crate::peer::{compact_addr_len, TorrentPeer};
 use crate::tracker::torrent::{TorrentError};
 use crate::udp::errors::ServerError;
 use crate::udp::request::AnnounceRequestWrapper;
+use crate::tracker::metrics::TrackerRequest;
 use crate::tracker::statistics::TrackerStatisticsEvent;
 use crate::tracker::tracker::TorrentTracker;
-use crate::protocol::utils::get_connection_id;
+use crate::protocol::utils::{get_connection_id, verify_connection_id};
 
 pub async fn authenticate(info_hash: &InfoHash, tracker: Arc<TorrentTracker>) -> Result<(), ServerError> {
     match tracker.authenticate_request(info_hash, &None).await {
@@ -30,45 +33,92 @@ pub async fn authenticate(info_hash: &InfoHash, tracker: Arc<TorrentTracker>) ->
     }
 }
 
-pub async fn handle_packet(remote_addr: SocketAddr, payload: Vec<u8>, tracker: Arc<TorrentTracker>) -> Response {
-    match Request::from_bytes(&payload[..payload.len()], MAX_SCRAPE_TORRENTS).map_err(|_| ServerError::InternalServerError) {
+// action, transaction id, interval, leechers and seeders, followed by the compact peers (BEP 15)
+const ANNOUNCE_RESPONSE_HEADER_LEN: usize = 20;
+const ANNOUNCE_ACTION: i32 = 1;
+
+// Handles one datagram and writes the response into `response_buffer`, returning the response length.
+// A length of 0 means the datagram is dropped without an answer.
+pub async fn handle_packet(remote_addr: SocketAddr, payload: &[u8], tracker: Arc<TorrentTracker>, response_buffer: &mut [u8]) -> io::Result<usize> {
+    match Request::from_bytes(payload, MAX_SCRAPE_TORRENTS).map_err(|_| ServerError::InternalServerError) {
         Ok(request) => {
-            let transaction_id = match &request {
+            let start_time = tracker.metrics().now();
+
+            let (transaction_id, tracker_request) = match &request {
                 Request::Connect(connect_request) => {
-                    connect_request.transaction_id
+                    (connect_request.transaction_id, TrackerRequest::UdpConnect)
                 }
                 Request::Announce(announce_request) => {
-                    announce_request.transaction_id
+                    (announce_request.transaction_id, TrackerRequest::UdpAnnounce)
                 }
                 Request::Scrape(scrape_request) => {
-                    scrape_request.transaction_id
+                    (scrape_request.transaction_id, TrackerRequest::UdpScrape)
                 }
             };
 
-            match handle_request(request, remote_addr, tracker).await {
-                Ok(response) => response,
-                Err(e) => handle_error(e, transaction_id)
-            }
+            let result = match handle_request(request, remote_addr, tracker.clone(), response_buffer).await {
+                Ok(response_len) => Ok(response_len),
+                Err(e) => write_response(&handle_error(e, transaction_id), response_buffer)
+            };
+
+            tracker.metrics().observe_request(tracker_request, start_time);
+
+            result
         }
         // bad request
-        Err(_) => handle_error(ServerError::BadRequest, TransactionId(0))
+        Err(_) => write_response(&handle_error(ServerError::BadRequest, TransactionId(0)), response_buffer)
     }
 }
 
-pub async fn handle_request(request: Request, remote_addr: SocketAddr, tracker: Arc<TorrentTracker>) -> Result<Response, ServerError> {
-    match request {
+pub async fn handle_request(request: Request, remote_addr: SocketAddr, tracker: Arc<TorrentTracker>, response_buffer: &mut [u8]) -> Result<usize, ServerError> {
+    let response = match request {
         Request::Connect(connect_request) => {
-            handle_connect(remote_addr, &connect_request, tracker).await
+            // the sender's address is not proven yet, so a limited connect is never answered:
+            // the reply could be aimed at a spoofed address
+            if !tracker.check_rate_limit(remote_addr.ip()) { return Ok(0); }
+
+            handle_connect(remote_addr, &connect_request, tracker).await?
         }
         Request::Announce(announce_request) => {
-            handle_announce(remote_addr, &announce_request, tracker).await
+            // checked before anything else, so spoofed packets never reach the torrents
+            if !verify_connection_id(announce_request.connection_id, &remote_addr) { return invalid_connection_id(&tracker); }
+            if !tracker.check_rate_limit(remote_addr.ip()) { return rate_limited(&tracker); }
+
+            return handle_announce(remote_addr, &announce_request, tracker, response_buffer).await;
         }
         Request::Scrape(scrape_request) => {
-            handle_scrape(remote_addr, &scrape_request, tracker).await
+            if !verify_connection_id(scrape_request.connection_id, &remote_addr) { return invalid_connection_id(&tracker); }
+            if !tracker.check_rate_limit(remote_addr.ip()) { return rate_limited(&tracker); }
+
+            handle_scrape(remote_addr, &scrape_request, tracker).await?
         }
+    };
+
+    write_response(&response, response_buffer).map_err(|_| ServerError::InternalServerError)
+}
+
+// An announce or scrape whose connection id was not issued to its source address. The source is
+// unproven, so it's dropped without an answer, which could be aimed at a spoofed address.
+fn invalid_connection_id(tracker: &TorrentTracker) -> Result<usize, ServerError> {
+    tracker.metrics().invalid_connection_ids.add(1);
+    Ok(0)
+}
+
+// A limited announce or scrape, whose connection id has proven the sender's address
+fn rate_limited(tracker: &TorrentTracker) -> Result<usize, ServerError> {
+    if tracker.config.rate_limit_silent_drop {
+        Ok(0)
+    } else {
+        Err(ServerError::RateLimited(tracker.config.min_announce_interval))
     }
 }
 
+pub fn write_response(response: &Response, response_buffer: &mut [u8]) -> io::Result<usize> {
+    let mut cursor = Cursor::new(response_buffer);
+    response.write(&mut cursor)?;
+    Ok(cursor.position() as usize)
+}
+
 pub async fn handle_connect(remote_addr: SocketAddr, request: &ConnectRequest, tracker: Arc<TorrentTracker>) -> Result<Response, ServerError> {
     let connection_id = get_connection_id(&remote_addr);
 
@@ -79,117 +129,82 @@ pub async fn handle_connect(remote_addr: SocketAddr, request: &ConnectRequest, t
 
     // send stats event
     match remote_addr {
-        SocketAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp4Connect).await; }
-        SocketAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp6Connect).await; }
+        SocketAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp4Connect); }
+        SocketAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp6Connect); }
     }
 
     Ok(response)
 }
 
-pub async fn handle_announce(remote_addr: SocketAddr, announce_request: &AnnounceRequest, tracker: Arc<TorrentTracker>) -> Result<Response, ServerError> {
+// Announce responses are written straight into `response_buffer`: the compact peer addresses are
+// copied from the swarm behind a fixed size header, without building a Response first
+pub async fn handle_announce(remote_addr: SocketAddr, announce_request: &AnnounceRequest, tracker: Arc<TorrentTracker>, response_buffer: &mut [u8]) -> Result<usize, ServerError> {
     let wrapped_announce_request = AnnounceRequestWrapper::new(announce_request.clone());
 
     authenticate(&wrapped_announce_request.info_hash, tracker.clone()).await?;
 
     let peer = TorrentPeer::from_udp_announce_request(&wrapped_announce_request.announce_request, remote_addr.ip(), tracker.config.get_ext_ip());
 
-    //let torrent_stats = tracker.update_torrent_with_peer_and_get_stats(&wrapped_announce_request.info_hash, &peer).await;
-
-    let torrent_stats = tracker.update_torrent_with_peer_and_get_stats(&wrapped_announce_request.info_hash, &peer).await;
-
-    // get all peers excluding the client_addr
-    let peers = tracker.get_torrent_peers(&wrapped_announce_request.info_hash, &peer.peer_addr).await;
-
-    let announce_response = if remote_addr.is_ipv4() {
-        Response::from(AnnounceResponse {
-            transaction_id: wrapped_announce_request.announce_request.transaction_id,
-            announce_interval: AnnounceInterval(tracker.config.announce_interval as i32),
-            leechers: NumberOfPeers(torrent_stats.leechers as i32),
-            seeders: NumberOfPeers(torrent_stats.seeders as i32),
-            peers: peers.iter()
-                .filter_map(|peer| if let IpAddr::V4(ip) = peer.peer_addr.ip() {
-                    Some(ResponsePeer::<Ipv4Addr> {
-                        ip_address: ip,
-                        port: Port(peer.peer_addr.port()),
-                    })
-                } else {
-                    None
-                }
-                ).collect(),
-        })
-    } else {
-        Response::from(AnnounceResponse {
-            transaction_id: wrapped_announce_request.announce_request.transaction_id,
-            announce_interval: AnnounceInterval(tracker.config.announce_interval as i32),
-            leechers: NumberOfPeers(torrent_stats.leechers as i32),
-            seeders: NumberOfPeers(torrent_stats.seeders as i32),
-            peers: peers.iter()
-                .filter_map(|peer| if let IpAddr::V6(ip) = peer.peer_addr.ip() {
-                    Some(ResponsePeer::<Ipv6Addr> {
-                        ip_address: ip,
-                        port: Port(peer.peer_addr.port()),
-                    })
-                } else {
-                    None
-                }
-                ).collect(),
-        })
+    // a negative or zero peers_wanted means the client leaves it to the tracker
+    let numwant = match wrapped_announce_request.announce_request.peers_wanted.0 {
+        peers_wanted if peers_wanted > 0 => Some(peers_wanted as u32),
+        _ => None
     };
 
+    if response_buffer.len() < ANNOUNCE_RESPONSE_HEADER_LEN { return Err(ServerError::InternalServerError); }
+
+    // never hand out more peers than fit in the datagram
+    let max_peers = (response_buffer.len() - ANNOUNCE_RESPONSE_HEADER_LEN) / compact_addr_len(&peer.peer_addr);
+    let numwant = Some(tracker.get_numwant(numwant).min(max_peers) as u32);
+
+    let mut response_len = ANNOUNCE_RESPONSE_HEADER_LEN;
+
+    // get peers excluding the client_addr
+    let torrent_stats = tracker.update_torrent_with_peer_and_get_compact_peers(&wrapped_announce_request.info_hash, &peer, numwant, |compact_peers| {
+        if let Some(slot) = response_buffer.get_mut(response_len..response_len + compact_peers.len()) {
+            slot.copy_from_slice(compact_peers);
+            response_len += compact_peers.len();
+        }
+    }).await;
+
+    response_buffer[0..4].copy_from_slice(&ANNOUNCE_ACTION.to_be_bytes());
+    response_buffer[4..8].copy_from_slice(&wrapped_announce_request.announce_request.transaction_id.0.to_be_bytes());
+    response_buffer[8..12].copy_from_slice(&(tracker.config.announce_interval as i32).to_be_bytes());
+    response_buffer[12..16].copy_from_slice(&(torrent_stats.leechers as i32).to_be_bytes());
+    response_buffer[16..20].copy_from_slice(&(torrent_stats.seeders as i32).to_be_bytes());
+
     // send stats event
     match remote_addr {
-        SocketAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp4Announce).await; }
-        SocketAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp6Announce).await; }
+        SocketAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp4Announce); }
+        SocketAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp6Announce); }
     }
 
-    Ok(announce_response)
+    Ok(response_len)
 }
 
-// todo: refactor this, db lock can be a lot shorter
 pub async fn handle_scrape(remote_addr: SocketAddr, request: &ScrapeRequest, tracker: Arc<TorrentTracker>) -> Result<Response, ServerError> {
-    let db = tracker.get_torrents().await;
-
-    let mut torrent_stats: Vec<TorrentScrapeStatistics> = Vec::new();
-
-    for info_hash in request.info_hashes.iter() {
-        let info_hash = InfoHash(info_hash.0);
-
-        let scrape_entry = match db.get(&info_hash) {
-            Some(torrent_info) => {
-                if authenticate(&info_hash, tracker.clone()).await.is_ok() {
-                    let (seeders, completed, leechers) = torrent_info.get_stats();
-
-                    TorrentScrapeStatistics {
-                        seeders: NumberOfPeers(seeders as i32),
-                        completed: NumberOfDownloads(completed as i32),
-                        leechers: NumberOfPeers(leechers as i32),
-                    }
-                } else {
-                    TorrentScrapeStatistics {
-                        seeders: NumberOfPeers(0),
-                        completed: NumberOfDownloads(0),
-                        leechers: NumberOfPeers(0),
-                    }
-                }
-            }
-            None => {
-                TorrentScrapeStatistics {
-                    seeders: NumberOfPeers(0),
-                    completed: NumberOfDownloads(0),
-                    leechers: NumberOfPeers(0),
-                }
+    let info_hashes: Vec<InfoHash> = request.info_hashes.iter().map(|info_hash| InfoHash(info_hash.0)).collect();
+
+    // BEP 15 answers in request order, unknown and unauthorized torrents as zeros
+    let torrent_stats: Vec<TorrentScrapeStatistics> = tracker.scrape_torrents(&info_hashes, &None).await.into_iter()
+        .map(|torrent_stats| match torrent_stats {
+            Some(stats) => TorrentScrapeStatistics {
+                seeders: NumberOfPeers(stats.seeders as i32),
+                completed: NumberOfDownloads(stats.completed as i32),
+                leechers: NumberOfPeers(stats.leechers as i32),
+            },
+            None => TorrentScrapeStatistics {
+                seeders: NumberOfPeers(0),
+                completed: NumberOfDownloads(0),
+                leechers: NumberOfPeers(0),
             }
-        };
-
-        torrent_stats.push(scrape_entry);
-    }
-
-    drop(db);
+        })
+        .collect();
 
     // send stats event
     match remote_addr {
-        SocketAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp4Scrape).await; }
-        SocketAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp6Scrape).await; }
+        SocketAddr::V4(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp4Scrape); }
+        SocketAddr::V6(_) => { tracker.send_stats_event(TrackerStatisticsEvent::Udp6Scrape); }
     }
 
     Ok(Response::from(ScrapeResponse {
@@ -7,6 +7,8 @@ pub mod errors;
 pub mod request;
 pub mod server;
 pub mod handlers;
+#[cfg(target_os = "linux")]
+pub mod batch;
 
 pub type Bytes = u64;
 pub type Port = u16;
@@ -1,71 +1,124 @@
-use std::io::Cursor;
+#[cfg(not(target_os = "linux"))]
 use std::net::SocketAddr;
 use std::sync::Arc;
 
-use aquatic_udp_protocol::Response;
 use log::{debug, info};
 use tokio::net::UdpSocket;
 
 use crate::tracker::tracker::TorrentTracker;
-use crate::udp::{handle_packet, MAX_PACKET_SIZE};
+use crate::udp::handle_packet;
+#[cfg(target_os = "linux")]
+use crate::udp::batch::PacketBatch;
+#[cfg(not(target_os = "linux"))]
+use crate::udp::MAX_PACKET_SIZE;
 
 pub struct UdpServer {
     socket: Arc<UdpSocket>,
     tracker: Arc<TorrentTracker>,
+    workers: usize,
 }
 
 impl UdpServer {
-    pub async fn new(tracker: Arc<TorrentTracker>, bind_address: &str) -> tokio::io::Result<UdpServer> {
+    pub async fn new(tracker: Arc<TorrentTracker>, bind_address: &str, workers: usize) -> tokio::io::Result<UdpServer> {
         let socket = UdpSocket::bind(bind_address).await?;
 
         Ok(UdpServer {
             socket: Arc::new(socket),
             tracker,
+            workers: workers.max(1),
         })
     }
 
+    // Every worker receives from the same socket, so up to `workers` packets are handled at once
     pub async fn start(&self) {
-        loop {
-            let mut data = [0; MAX_PACKET_SIZE];
-            let socket = self.socket.clone();
-            let tracker = self.tracker.clone();
+        let workers: Vec<_> = (0..self.workers)
+            .map(|_| tokio::spawn(UdpServer::run_worker(self.socket.clone(), self.tracker.clone())))
+            .collect();
+
+        futures::future::join_all(workers).await;
+
+        info!("Stopping UDP server: {}..", self.socket.local_addr().unwrap());
+    }
+
+    // Linux fast path: receive and send up to BATCH_SIZE datagrams per syscall,
+    // using buffers that are allocated once per worker
+    #[cfg(target_os = "linux")]
+    async fn run_worker(socket: Arc<UdpSocket>, tracker: Arc<TorrentTracker>) {
+        let mut requests = PacketBatch::new();
+        let mut responses = PacketBatch::new();
 
+        loop {
             tokio::select! {
                 _ = tokio::signal::ctrl_c() => {
-                    info!("Stopping UDP server: {}..", socket.local_addr().unwrap());
                     break;
                 }
-                Ok((valid_bytes, remote_addr)) = socket.recv_from(&mut data) => {
-                    let payload = data[..valid_bytes].to_vec();
+                result = requests.recv(&socket) => {
+                    let received = match result {
+                        Ok(received) => received,
+                        Err(e) => {
+                            debug!("could not receive datagrams: {}", e);
+                            tracker.metrics().udp_receive_failures.add(1);
+                            continue;
+                        }
+                    };
 
-                    debug!("Received {} bytes from {}", payload.len(), remote_addr);
-                    debug!("{:?}", payload);
+                    for index in 0..received {
+                        let remote_addr = match requests.remote_addr(index) {
+                            Some(remote_addr) => remote_addr,
+                            None => continue
+                        };
+
+                        let payload = requests.payload(index);
+
+                        debug!("Received {} bytes from {}", payload.len(), remote_addr);
+                        debug!("{:?}", payload);
 
-                    let response = handle_packet(remote_addr, payload, tracker).await;
-                    UdpServer::send_response(socket, remote_addr, response).await;
+                        match handle_packet(remote_addr, payload, tracker.clone(), responses.response_buffer()).await {
+                            Ok(0) => {}
+                            Ok(response_len) => responses.push_response(&requests, index, response_len),
+                            Err(_) => debug!("could not write response to bytes.")
+                        }
+                    }
+
+                    let _ = responses.send(&socket).await;
                 }
             }
         }
     }
 
-    async fn send_response(socket: Arc<UdpSocket>, remote_addr: SocketAddr, response: Response) {
-        debug!("sending response to: {:?}", &remote_addr);
+    #[cfg(not(target_os = "linux"))]
+    async fn run_worker(socket: Arc<UdpSocket>, tracker: Arc<TorrentTracker>) {
+        loop {
+            let mut data = [0; MAX_PACKET_SIZE];
+            let socket = socket.clone();
+            let tracker = tracker.clone();
+
+            tokio::select! {
+                _ = tokio::signal::ctrl_c() => {
+                    break;
+                }
+                Ok((valid_bytes, remote_addr)) = socket.recv_from(&mut data) => {
+                    let payload = &data[..valid_bytes];
 
-        let buffer = vec![0u8; MAX_PACKET_SIZE];
-        let mut cursor = Cursor::new(buffer);
+                    debug!("Received {} bytes from {}", payload.len(), remote_addr);
+                    debug!("{:?}", payload);
 
-        match response.write(&mut cursor) {
-            Ok(_) => {
-                let position = cursor.position() as usize;
-                let inner = cursor.get_ref();
+                    let mut response_buffer = [0u8; MAX_PACKET_SIZE];
 
-                debug!("{:?}", &inner[..position]);
-                UdpServer::send_packet(socket, &remote_addr, &inner[..position]).await;
+                    match handle_packet(remote_addr, payload, tracker, &mut response_buffer).await {
+                        Ok(0) => {}
+                        Ok(response_len) => {
+                            debug!("sending response to: {:?}", &remote_addr);
+                            UdpServer::send_packet(socket, &remote_addr, &response_buffer[..response_len]).await;
+                        }
+                        Err(_) => { debug!("could not write response to bytes."); }
+                    }
+                }
             }
-            Err(_) => { debug!("could not write response to bytes."); }
         }
     }
 
+    #[cfg(not(target_os = "linux"))]
     async fn send_packet(socket: Arc<UdpSocket>, remote_addr: &SocketAddr, payload: &[u8]) {
         // doesn't matter if it reaches or not
         let _ = socket.send_to(payload, remote_addr).await;